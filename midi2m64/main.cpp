@@ -5,9 +5,19 @@
 #include <string>
 #include <fstream>
 #include <stdio.h>
+#include <ctype.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <stdint.h>
 #include <limits>
 #include <stdexcept>
+#include <queue>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <map>
 using namespace std;
 
 // TODO:
@@ -34,11 +44,137 @@ unsigned short bit_mask_from_value[16] =
 		0x01FF, 0x03FF, 0x07FF, 0x0FFF,
 		0x1FFF, 0x3FFF, 0x7FFF, 0xFFFF};
 
-short rev_short(short _x)
+// Appends m64 bytes to an output buffer. Words are big-endian, and
+// set_w() fills in a word that was written earlier as a placeholder, such
+// as a channel or layer pointer.
+class M64Emitter
 {
-	return ((unsigned short)_x >> 8) | (_x << 8);
-}
+public:
+	M64Emitter(vector<uchar>& _output) : output(_output)
+	{
+	}
+	void reserve(size_t _n)
+	{
+		output.reserve(_n);
+	}
+	void add(uchar _x)
+	{
+		output.push_back(_x);
+	}
+	void add_w(int _x)
+	{
+		output.push_back((_x >> 8) & 0xFF);
+		output.push_back(_x & 0xFF);
+	}
+	void add_v(int _x)
+	{
+		if (_x < 127)
+		{
+			add(_x);
+		}
+		else
+		{
+			add_w(_x | 0x8000);
+		}
+	}
+	// the number of bytes add_v() writes for _x
+	static int size_v(int _x)
+	{
+		return (_x < 127) ? 1 : 2;
+	}
+	void set_w(int _offset, int _x)
+	{
+		output[_offset] = (_x >> 8) & 0xFF;
+		output[_offset + 1] = _x & 0xFF;
+	}
+	int size()
+	{
+		return output.size();
+	}
+private:
+	vector<uchar>& output;
+};
+
+// A 16-bit pointer in an M64Block which is filled in with the offset of
+// the start of another block, plus _target_offset, once the blocks are
+// joined.
+class M64Fixup
+{
+public:
+	M64Fixup(int _offset, int _target, int _target_offset = 0)
+	{
+		offset = _offset;
+		target = _target;
+		target_offset = _target_offset;
+	}
+	int offset;
+	int target;
+	int target_offset;
+};
+
+// The start of a command in an M64Block, and the part of the script's
+// state that the command's meaning depends on. Commands with the same
+// bytes and state do the same wherever they are; M64_PINNED keeps a
+// command, such as one holding a pointer, out of any subroutine.
+#define M64_PINNED -1
+class M64Mark
+{
+public:
+	M64Mark(int _offset, int _state)
+	{
+		offset = _offset;
+		state = _state;
+	}
+	int offset;
+	int state;
+};
+
+// A separately encoded piece of the m64 data, with the start of each of
+// its commands.
+class M64Block
+{
+public:
+	vector<uchar> data;
+	vector<M64Fixup> fixups;
+	vector<M64Mark> marks;
+};
+
+// How a note of a layer is written. Mode 1 writes the delay and the gate,
+// mode 2 only the delay, and mode 3 only the gate, reusing the delay of the
+// last mode 1 or 2 note. The delay covers the note and whatever part of
+// the rest after it is played as its gate; the remainder of that rest is
+// written as a rest of its own.
+class LayerNote
+{
+public:
+	int mode;
+	int delay;
+};
+
+// A state of the search for the shortest encoding of a layer, after one of
+// its notes: the delay that a mode 3 note would reuse, the fewest bytes to
+// get there, the state before the note and how the note was written.
+class LayerState
+{
+public:
+	int held_delay;
+	int bytes;
+	int from;
+	int note_index;
+	LayerNote note;
+};
 
+// A track whose notes are those of an earlier track, delay ticks later and
+// transpose semitones higher. Its channel is transposed instead, so that
+// its layer is written with the keys of the other and can share its
+// commands.
+class LayerCopy
+{
+public:
+	int source;
+	int delay;
+	int transpose;
+};
 
 class NoteRemapping
 {
@@ -63,165 +199,412 @@ private:
 	int mapping[256];
 };
 
-// Technically impressive, but needs to be built in to event optimization,
-//    can't use alone
-void opt_avg_intervals(
-	float* _data,
+// Sums of squared differences from the mean over runs of a data series,
+// found in constant time from prefix sums. Errors below SEGMENT_ERROR_MIN,
+// far less than one step of a controller value, are rounding left over
+// from the sums and count as zero, so runs of equal values stay together.
+#define SEGMENT_ERROR_MIN 1e-9
+class SegmentError
+{
+public:
+	SegmentError(const float* _data, size_t _data_n)
+	{
+		size_t i;
+		sum.resize(_data_n + 1);
+		sum_sq.resize(_data_n + 1);
+		sum[0] = 0.0;
+		sum_sq[0] = 0.0;
+		for (i = 0; i < _data_n; i++)
+		{
+			sum[i + 1] = sum[i] + _data[i];
+			sum_sq[i + 1] = sum_sq[i] + (double)_data[i] * _data[i];
+		}
+	}
+	// error of the run from _first to _last, inclusive
+	double operator()(size_t _first, size_t _last) const
+	{
+		double s;
+		double e;
+		if (_first == _last)
+		{
+			return 0.0;
+		}
+		s = sum[_last + 1] - sum[_first];
+		e = sum_sq[_last + 1] - sum_sq[_first] - s * s / (_last - _first + 1);
+		return (e > SEGMENT_ERROR_MIN) ? e : 0.0;
+	}
+private:
+	vector<double> sum;
+	vector<double> sum_sq;
+};
+
+// Splits _data into at most _desired_n runs so that the total squared
+// error of replacing each run by its average is as small as possible.
+// The start index of each run is stored in _res, and the number of runs
+// is returned. The error of a run never shrinks as the run grows, and the
+// least error of the runs before it is prev[k - 1], so the search for
+// where the last run starts stops once those two together are worse than
+// the best split found.
+size_t opt_avg_intervals(
+	const float* _data,
 	size_t _data_n,
 	size_t _desired_n,
 	size_t* _res
 )
 {
-	float** L;
-	double** best;
-	double global_best;
-	double this_best;
-	size_t* start;
-	size_t* start_best;
-	double* total_err;
-	double avg;
-	double err_sq;
-	double this_err;
-	double total;
-	int i;
-	int q;
-	int k;
-	int start_base;
-	bool proceed_flag;
-	bool escape_flag;
+	SegmentError err(_data, _data_n);
+	vector<double> prev;
+	vector<double> cur;
+	vector<unsigned int> from;
+	double best;
+	double e;
+	size_t i;
+	size_t j;
+	size_t k;
+	size_t arg;
+
+	if (_desired_n > _data_n)
+	{
+		_desired_n = _data_n;
+	}
+	if (_desired_n == 0)
+	{
+		return 0;
+	}
+
+	// prev[j] is the least error for _data[0..j] in k runs, and
+	// from[k * _data_n + j] is where run k starts in the best split of
+	// _data[0..j] into k + 1 runs
+	prev.resize(_data_n);
+	cur.resize(_data_n);
+	from.resize(_desired_n * _data_n);
+	for (j = 0; j < _data_n; j++)
+	{
+		prev[j] = err(0, j);
+		from[j] = 0;
+	}
+	for (k = 1; k < _desired_n; k++)
+	{
+		for (j = k; j < _data_n; j++)
+		{
+			best = DBL_MAX;
+			arg = j;
+			for (i = j; i >= k; i--)
+			{
+				e = err(i, j);
+				if (e + prev[k - 1] >= best)
+				{
+					break;
+				}
+				if (prev[i - 1] + e < best)
+				{
+					best = prev[i - 1] + e;
+					arg = i;
+				}
+			}
+			cur[j] = best;
+			from[k * _data_n + j] = arg;
+		}
+		prev.swap(cur);
+	}
 
-	_desired_n++;
+	j = _data_n - 1;
+	for (k = _desired_n; k-- > 0;)
+	{
+		_res[k] = from[k * _data_n + j];
+		if (_res[k] > 0)
+		{
+			j = _res[k] - 1;
+		}
+	}
+	return _desired_n;
+}
 
-	L = (float**)malloc(sizeof(float*)*(_data_n - 1));
-	for (i = 0; i < _data_n; i++)
+// Splits _data into as few runs as possible such that the squared error
+// of replacing each run by its average is at most _tolerance, preferring
+// the least total error between splits with the same number of runs.
+// _tolerance must not be negative. The start index of each run is stored
+// in _res, and the number of runs is returned.
+size_t opt_tolerance_intervals(
+	const float* _data,
+	size_t _data_n,
+	double _tolerance,
+	size_t* _res
+)
+{
+	SegmentError err(_data, _data_n);
+	vector<size_t> count;
+	vector<double> total;
+	vector<size_t> from;
+	size_t c;
+	double t;
+	double e;
+	size_t i;
+	size_t j;
+	size_t n;
+
+	if (_data_n == 0)
+	{
+		return 0;
+	}
+	count.resize(_data_n);
+	total.resize(_data_n);
+	from.resize(_data_n);
+	for (j = 0; j < _data_n; j++)
 	{
-		L[i] = (float*)malloc(sizeof(float)*(_data_n - i));
-		for (q = 0; q < _data_n; q++)
+		count[j] = SIZE_MAX;
+		for (i = j + 1; i-- > 0;)
 		{
-			total = 0;
-			err_sq = 0;
-			for (k = i; k <= q; k++)
+			e = err(i, j);
+			if (e > _tolerance)
 			{
-				total += _data[k];
+				break;
 			}
-			avg = total / (q - i + 1.0);
-			for (k = i; k <= q; k++)
+			c = (i == 0) ? 1 : count[i - 1] + 1;
+			t = (i == 0) ? e : total[i - 1] + e;
+			if ((c < count[j]) || ((c == count[j]) && (t < total[j])))
 			{
-				this_err = _data[k] - avg;
-				err_sq = this_err*this_err;
+				count[j] = c;
+				total[j] = t;
+				from[j] = i;
 			}
-			L[i][q - i] = err_sq;
 		}
 	}
-	
-	best = (double**)malloc(sizeof(double*)*(_desired_n - 3));
-	for (i = 0; i < _desired_n - 3; i++)
+
+	n = count[_data_n - 1];
+	j = _data_n - 1;
+	for (i = n; i-- > 0;)
 	{
-		best[i] = (double*)malloc(sizeof(double)*_data_n);
-		for (q = 0; q < _data_n; q++)
+		_res[i] = from[j];
+		if (from[j] > 0)
 		{
-			best[i][q] = -1.0;
+			j = from[j] - 1;
 		}
 	}
-	global_best = FLT_MAX;
-	start_best = _res;
-	for (i = 0; i < _desired_n - 1; i++)
+	return n;
+}
+
+// Orders suffixes by the rank of their first k symbols, then by the rank
+// of the k symbols after those; a suffix with nothing after its first k
+// symbols goes first.
+class SuffixOrder
+{
+public:
+	SuffixOrder(const vector<int>& _rank, size_t _k) : rank(_rank), k(_k)
+	{
+	}
+	int second(int _i) const
 	{
-		start_best[i] = i;
+		return (_i + k < rank.size()) ? rank[_i + k] : -1;
 	}
-	start = (size_t*)malloc(sizeof(size_t)*(_desired_n - 1));
-	total_err = (double*)malloc(sizeof(double)*(_desired_n - 1));
+	bool operator()(int _a, int _b) const
+	{
+		if (rank[_a] != rank[_b])
+		{
+			return rank[_a] < rank[_b];
+		}
+		return second(_a) < second(_b);
+	}
+private:
+	const vector<int>& rank;
+	size_t k;
+};
 
-	for (q = 0; q <= (_data_n - _desired_n); q++)
+// Sorts the suffixes of _data, whose symbols must not be negative, by
+// prefix doubling: each round ranks the suffixes by twice as many symbols
+// as the last, until every rank is different. _sa holds the start of each
+// suffix in order.
+void suffix_array(const vector<int>& _data, vector<int>& _sa)
+{
+	vector<int> rank;
+	vector<int> next;
+	size_t n;
+	size_t k;
+	size_t i;
+
+	n = _data.size();
+	_sa.resize(n);
+	if (n == 0)
+	{
+		return;
+	}
+	rank = _data;
+	next.resize(n);
+	for (i = 0; i < n; i++)
+	{
+		_sa[i] = i;
+	}
+	for (k = 1; ; k *= 2)
 	{
-		start[0] = q;
-		total_err[0] = L[0][start[0]];
-		start[1] = start[0] + 1;
-		i = 1;
-		do
+		SuffixOrder order(rank, k);
+		sort(_sa.begin(), _sa.end(), order);
+		next[_sa[0]] = 0;
+		for (i = 1; i < n; i++)
 		{
-			proceed_flag = false;
-			if (i < _desired_n - 2)
-			{
-				start_base = start[i - 1] + 1;
-				total_err[i] = total_err[i - 1] +
-					L[start_base][start[i] - start_base];
-				this_best = best[i - 1][start[i] + 1];
-				if ((this_best = -1.0) && (total_err[i] < global_best))
-				{
-					i += 1;
-					if (i == (_desired_n - 2))
-					{
-						start[i] = _data_n - 1;
-					}
-					else
-					{
-						start[i] = start[i - 1] + 1;
-					}
-				}
-				else
-				{
-					if ((this_best != -1.0) && ((this_best +
-						total_err[i]) < global_best))
-					{
-						global_best = this_best + total_err[i];
-						for (k = 0; k < _desired_n - 1; k++)
-						{
-							start_best[k] = start[k];
-						}
-					}
-					proceed_flag = true;
-				}
-			}
-			else
+			next[_sa[i]] = next[_sa[i - 1]] +
+				(order(_sa[i - 1], _sa[i]) ? 1 : 0);
+		}
+		rank.swap(next);
+		if ((rank[_sa[n - 1]] == n - 1) || (k >= n))
+		{
+			break;
+		}
+	}
+}
+
+// _lcp[i] is the number of symbols that the suffixes starting at _sa[i - 1]
+// and _sa[i] have in common, and _lcp[0] is 0. Found in linear time by
+// Kasai's method: the suffix one after a suffix shares at least one symbol
+// less with the suffix before it in order.
+void lcp_array(const vector<int>& _data, const vector<int>& _sa,
+	vector<int>& _lcp)
+{
+	vector<int> rank;
+	size_t n;
+	size_t i;
+	size_t j;
+	size_t h;
+
+	n = _data.size();
+	_lcp.assign(n, 0);
+	rank.resize(n);
+	for (i = 0; i < n; i++)
+	{
+		rank[_sa[i]] = i;
+	}
+	h = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (rank[i] == 0)
+		{
+			h = 0;
+			continue;
+		}
+		j = _sa[rank[i] - 1];
+		while ((i + h < n) && (j + h < n) && (_data[i + h] == _data[j + h]))
+		{
+			h++;
+		}
+		_lcp[rank[i]] = h;
+		if (h > 0)
+		{
+			h--;
+		}
+	}
+}
+
+// the bytes of a call to a subroutine, and of the command ending one
+#define PATTERN_CALL_SIZE 3
+#define PATTERN_RETURN_SIZE 1
+// the longest run of symbols looked at as a pattern
+#define PATTERN_MAX_N 256
+
+// A run of symbols to be moved into a subroutine: its length, the bytes
+// saved, and where each copy replaced by a call starts.
+class Pattern
+{
+public:
+	int length;
+	int savings;
+	vector<int> starts;
+};
+
+// the copies of the run of _length symbols starting at _sa[_first] to
+// _sa[_last] which do not overlap an earlier copy, and the bytes saved by
+// calling one subroutine in place of each; _bytes[i] is the size of the
+// symbols before i
+void evaluate_pattern(const vector<int>& _sa, const vector<int>& _bytes,
+	int _first, int _last, int _length, Pattern& _pattern)
+{
+	vector<int> starts;
+	int size;
+	int end;
+	int i;
+
+	starts.assign(_sa.begin() + _first, _sa.begin() + _last + 1);
+	sort(starts.begin(), starts.end());
+	_pattern.length = _length;
+	_pattern.starts.clear();
+	end = 0;
+	for (i = 0; i < starts.size(); i++)
+	{
+		if (starts[i] >= end)
+		{
+			_pattern.starts.push_back(starts[i]);
+			end = starts[i] + _length;
+		}
+	}
+	size = _bytes[starts[0] + _length] - _bytes[starts[0]];
+	_pattern.savings = (_pattern.starts.size() - 1) * size -
+		_pattern.starts.size() * PATTERN_CALL_SIZE - PATTERN_RETURN_SIZE;
+}
+
+// Finds the run of symbols that saves the most bytes when the copies of it
+// which do not overlap are each replaced by a call to one subroutine
+// holding it; _sizes[i] is the number of bytes of _symbols[i]. Each run
+// shared by a group of suffixes is an interval of the suffix array whose
+// common prefix is longer than that of the interval around it, so the
+// intervals are walked bottom up with a stack. Runs are cut to
+// PATTERN_MAX_N symbols, and intervals inside one whose runs were already
+// cut are skipped. Returns false if no run saves any bytes.
+bool find_best_pattern(const vector<int>& _symbols, const vector<int>& _sizes,
+	Pattern& _best)
+{
+	vector<int> sa;
+	vector<int> lcp;
+	vector<int> bytes;
+	vector<pair<int, int> > open;
+	Pattern candidate;
+	int n;
+	int h;
+	int first;
+	int parent;
+	int i;
+
+	n = _symbols.size();
+	_best.savings = 0;
+	_best.starts.clear();
+	if (n < 2)
+	{
+		return false;
+	}
+	suffix_array(_symbols, sa);
+	lcp_array(_symbols, sa, lcp);
+	bytes.resize(n + 1);
+	bytes[0] = 0;
+	for (i = 0; i < n; i++)
+	{
+		bytes[i + 1] = bytes[i] + _sizes[i];
+	}
+
+	// each open interval is its common prefix length and first suffix
+	open.push_back(make_pair(0, 0));
+	for (i = 1; i <= n; i++)
+	{
+		h = (i < n) ? lcp[i] : 0;
+		first = i - 1;
+		while (h < open.back().first)
+		{
+			first = open.back().second;
+			parent = open[open.size() - 2].first;
+			parent = (parent > h) ? parent : h;
+			if (parent < PATTERN_MAX_N)
 			{
-				start_base = start[i - 1] + 1;
-				total_err[i] = total_err[i - 1] +
-					L[start_base][start[i] - start_base];
-				if (total_err[i] < global_best)
+				evaluate_pattern(sa, bytes, first, i - 1,
+					min(open.back().first, PATTERN_MAX_N), candidate);
+				if (candidate.savings > _best.savings)
 				{
-					global_best = total_err[i];
-					for (k = 0; k < _desired_n - 1; k++)
-					{
-						start_best[k] = start[k];
-					}
+					_best = candidate;
 				}
-				proceed_flag = true;
-			}
-			escape_flag = false;
-			if (proceed_flag)
-			{
-				do
-				{
-					start[i]++;
-					if (start[i] > (_data_n - _desired_n + i + 1))
-					{
-						if (i == 1)
-						{
-							escape_flag = true;
-						}
-						else
-						{
-							i--;
-							best[i - 1][start[i] + 1] = global_best - 
-								total_err[i];
-						}
-					}
-					else
-					{
-						break;
-					}
-				} while (!escape_flag);
 			}
-		} while (!escape_flag);
+			open.pop_back();
+		}
+		if (h > open.back().first)
+		{
+			open.push_back(make_pair(h, first));
+		}
 	}
-
-	free(total_err);
-	free(start);
-	for (i = 0; i < _desired_n - 3; free(best[i++]));
-	free(best);
-	for (i = 0; i < _data_n; free(L[i++]));
-	free(L);
+	return _best.savings > 0;
 }
 
 enum class ControllerSourceType
@@ -233,6 +616,14 @@ enum class ControllerSourceType
 	Unknown, 
 	UserFixed
 };
+#define CONTROLLER_SOURCE_TYPE_N 6
+
+enum class ThinningMode
+{
+	None,
+	Tolerance,
+	Count
+};
 
 enum class NoteType
 {
@@ -270,6 +661,14 @@ public:
 	float value;
 };
 
+// a controller event as the value written for its m64 command
+class QuantizedEvent
+{
+public:
+	int ticks;
+	int value;
+};
+
 class ControllerSource
 {
 public:
@@ -286,17 +685,24 @@ public:
 		events.clear();
 		controller_number = -1;
 		owner_track_name = "";
+		thinning = ThinningMode::None;
+		thinning_tolerance = 0.0;
+		thinning_count = 0;
 	}
 
 	void convert_clock_base(int _from_base, int _total_ticks)
 	{
 		float divisor;
 		int i;
+		int kept;
 		int d_duration;
 		int prev_duration;
 		divisor = 48.0f / (float)_from_base;
-		i = 0;
-		while(i < events.size())
+		// events that land on the same tick after scaling collapse into
+		// the one with the longest duration; kept events are compacted
+		// to the front as the list is scanned
+		kept = 0;
+		for (i = 0; i < events.size(); i++)
 		{
 			if (i < (events.size() - 1))
 			{
@@ -307,32 +713,71 @@ public:
 				d_duration = (_total_ticks - events[i].ticks)*divisor;
 			}
 			events[i].ticks *= divisor;
-			if (i > 0)
+			if ((kept > 0) && (events[i].ticks == events[kept - 1].ticks))
 			{
-				if (events[i].ticks == events[i - 1].ticks)
-				{
-					if (d_duration > prev_duration)
-					{
-						events.erase(events.begin() + i - 1);
-						prev_duration = d_duration;
-					}
-					else
-					{
-						events.erase(events.begin() + i);
-					}
-				}
-				else
+				if (d_duration > prev_duration)
 				{
+					events[kept - 1] = events[i];
 					prev_duration = d_duration;
-					i++;
 				}
 			}
 			else
 			{
+				events[kept] = events[i];
 				prev_duration = d_duration;
-				i++;
+				kept++;
+			}
+		}
+		events.erase(events.begin() + kept, events.end());
+	}
+	// replaces runs of events by one event at the start of each run with
+	// their average value. In Tolerance mode the runs are as few as
+	// possible while keeping each run's sum of squared differences from
+	// its average within thinning_tolerance (in raw 0.0-1.0 values); in
+	// Count mode there are at most thinning_count runs, with the least
+	// total squared difference.
+	void thin()
+	{
+		vector<float> values;
+		vector<size_t> starts;
+		vector<ControllerEvent> thinned;
+		size_t n;
+		size_t i;
+		size_t j;
+		size_t end;
+		float total;
+		if ((thinning == ThinningMode::None) || (events.size() < 2))
+		{
+			return;
+		}
+		for (i = 0; i < events.size(); i++)
+		{
+			values.push_back(events[i].value);
+		}
+		starts.resize(events.size());
+		if (thinning == ThinningMode::Count)
+		{
+			n = opt_avg_intervals(values.data(), values.size(),
+				(thinning_count > 1) ? thinning_count : 1, starts.data());
+		}
+		else
+		{
+			n = opt_tolerance_intervals(values.data(), values.size(),
+				(thinning_tolerance > 0.0f) ? thinning_tolerance : 0.0f,
+				starts.data());
+		}
+		for (i = 0; i < n; i++)
+		{
+			end = (i + 1 < n) ? starts[i + 1] : values.size();
+			total = 0.0;
+			for (j = starts[i]; j < end; j++)
+			{
+				total += values[j];
 			}
+			thinned.push_back(ControllerEvent(events[starts[i]].ticks,
+				total / (end - starts[i])));
 		}
+		events.swap(thinned);
 	}
 	float get(int _index)
 	{
@@ -355,9 +800,15 @@ public:
 	int controller_number;
 	int owner_track_id;
 	string owner_track_name;
+	ThinningMode thinning;
+	float thinning_tolerance;
+	int thinning_count;
 };
 
 #define PARAM_SOURCE_NONE -1
+#define CHANNEL_PARAM_N 5
+// how many note layers the sound driver gives a channel
+#define VOICE_MAX 4
 class Track
 {
 public:
@@ -367,7 +818,9 @@ public:
 	}
 	void clear()
 	{
+		int i;
 		notes.clear();
+		voices.clear();
 		name = "";
 		fine_pitch_source = PARAM_SOURCE_NONE;
 		volume_source = PARAM_SOURCE_NONE;
@@ -377,86 +830,168 @@ public:
 		instrument = 0;
 		velocity_multiplier = 1.0;
 		map_directly = false;
+		for (i = 0; i < CHANNEL_PARAM_N; param_events[i++].clear());
 	}
-	void transpose(char _amt)
-	{
-		int i;
-		for (i = 0; i < notes.size(); i++)
-		{
-			notes[i].note = notes[i].note + _amt;
-		}
-	}
-	void remap(NoteRemapping& _mapping)
+	// the notes of layer _k: notes for the first, then the voices
+	int voice_count()
 	{
-		int i;
-		for (i = 0; i < notes.size(); i++)
-		{
-			notes[i].note = (unsigned char)_mapping[notes[i].note];
-		}
-		map_directly = true;
+		return 1 + voices.size();
 	}
-	void remap_midi(NoteRemapping& _mapping)
+	vector<NoteEvent>& voice(int _k)
 	{
-		int i;
-		for (i = 0; i < notes.size(); i++)
-		{
-			notes[i].note = (unsigned char)_mapping[notes[i].note];
-		}
+		return (_k == 0) ? notes : voices[_k - 1];
 	}
-	void convert_clock_base(int _from_base, int _total_ticks)
+	// the notes of all layers as one list: a note wherever a layer
+	// starts one, and a rest wherever all of them are silent
+	vector<NoteEvent> get_merged_notes()
 	{
-		float divisor;
-		int i;
-		int d_duration;
-		int prev_duration;
-		divisor = 48.0f / (float)_from_base;
-		i = 0;
-		while (i < notes.size())
+		vector<NoteEvent> merged;
+		vector<int> next;
+		vector<bool> sounding;
+		bool struck;
+		bool silent;
+		int tick;
+		int k;
+		next.assign(voice_count(), 0);
+		sounding.assign(voice_count(), false);
+		while (true)
 		{
-			if (i < (notes.size() - 1))
+			tick = INT_MAX;
+			for (k = 0; k < voice_count(); k++)
 			{
-				d_duration = (notes[i + 1].ticks - notes[i].ticks)*divisor;
+				if ((next[k] < voice(k).size()) &&
+					(voice(k)[next[k]].ticks < tick))
+				{
+					tick = voice(k)[next[k]].ticks;
+				}
 			}
-			else
+			if (tick == INT_MAX)
 			{
-				d_duration = (_total_ticks - notes[i].ticks)*divisor;
+				break;
 			}
-			notes[i].ticks *= divisor;
-			if (i > 0)
+			struck = false;
+			silent = true;
+			for (k = 0; k < voice_count(); k++)
 			{
-				if (notes[i].ticks == notes[i - 1].ticks)
+				if ((next[k] < voice(k).size()) &&
+					(voice(k)[next[k]].ticks == tick))
 				{
-					if (((d_duration > prev_duration) || 
-						((notes[i].type == NoteType::Note) && 
-							(notes[i - 1].type == NoteType::Rest))) && 
-						!((notes[i].type == NoteType::Rest) && 
-							(notes[i - 1].type == NoteType::Note)))
+					sounding[k] = (voice(k)[next[k]].type == NoteType::Note);
+					if (sounding[k] && !struck)
 					{
-						notes.erase(notes.begin() + i - 1);
-						prev_duration = d_duration;
-					}
-					else
-					{
-						notes.erase(notes.begin() + i);
+						merged.push_back(voice(k)[next[k]]);
+						struck = true;
 					}
+					next[k]++;
 				}
-				else
+				silent = silent && !sounding[k];
+			}
+			if (silent && (merged.empty() ||
+				(merged.back().type != NoteType::Rest)))
+			{
+				merged.push_back(NoteEvent(NoteType::Rest, tick));
+			}
+		}
+		return merged;
+	}
+	void transpose(char _amt)
+	{
+		int i;
+		int k;
+		for (k = 0; k < voice_count(); k++)
+		{
+			for (i = 0; i < voice(k).size(); i++)
+			{
+				voice(k)[i].note = voice(k)[i].note + _amt;
+			}
+		}
+	}
+	void remap(NoteRemapping& _mapping)
+	{
+		int i;
+		int k;
+		for (k = 0; k < voice_count(); k++)
+		{
+			for (i = 0; i < voice(k).size(); i++)
+			{
+				voice(k)[i].note = (unsigned char)_mapping[voice(k)[i].note];
+			}
+		}
+		map_directly = true;
+	}
+	void remap_midi(NoteRemapping& _mapping)
+	{
+		int i;
+		int k;
+		for (k = 0; k < voice_count(); k++)
+		{
+			for (i = 0; i < voice(k).size(); i++)
+			{
+				voice(k)[i].note = (unsigned char)_mapping[voice(k)[i].note];
+			}
+		}
+	}
+	void convert_clock_base(int _from_base, int _total_ticks)
+	{
+		int k;
+		for (k = 0; k < voice_count(); k++)
+		{
+			convert_clock_base(voice(k), _from_base, _total_ticks);
+		}
+	}
+	void convert_clock_base(vector<NoteEvent>& _notes, int _from_base,
+		int _total_ticks)
+	{
+		float divisor;
+		int i;
+		int kept;
+		int d_duration;
+		int prev_duration;
+		divisor = 48.0f / (float)_from_base;
+		// notes that land on the same tick after scaling collapse into
+		// one, preferring notes over rests and then the longest duration;
+		// kept notes are compacted to the front as the list is scanned
+		kept = 0;
+		for (i = 0; i < _notes.size(); i++)
+		{
+			if (i < (_notes.size() - 1))
+			{
+				d_duration =
+					(_notes[i + 1].ticks - _notes[i].ticks)*divisor;
+			}
+			else
+			{
+				d_duration = (_total_ticks - _notes[i].ticks)*divisor;
+			}
+			_notes[i].ticks *= divisor;
+			if ((kept > 0) && (_notes[i].ticks == _notes[kept - 1].ticks))
+			{
+				if (((d_duration > prev_duration) || 
+					((_notes[i].type == NoteType::Note) && 
+						(_notes[kept - 1].type == NoteType::Rest))) && 
+					!((_notes[i].type == NoteType::Rest) && 
+						(_notes[kept - 1].type == NoteType::Note)))
 				{
+					_notes[kept - 1] = _notes[i];
 					prev_duration = d_duration;
-					i++;
 				}
 			}
 			else
 			{
+				_notes[kept] = _notes[i];
 				prev_duration = d_duration;
-				i++;
+				kept++;
 			}
 		}
+		_notes.erase(_notes.begin() + kept, _notes.end());
 	}
 	
 	unsigned char instrument; 
 	string name; 
 	vector<NoteEvent> notes;
+	// the notes of the further layers, which overlap those of the first
+	// or of each other; each is laid out like notes
+	vector<vector<NoteEvent> > voices;
 	int fine_pitch_source;
 	int volume_source;
 	int pan_source;
@@ -464,6 +999,9 @@ public:
 	int vibrato_source;
 	float velocity_multiplier;
 	bool map_directly;
+	// the sources quantized for each channel parameter, in the order
+	// of Sequence::get_channel_params
+	vector<QuantizedEvent> param_events[CHANNEL_PARAM_N];
 };
 
 class Sequence
@@ -471,11 +1009,92 @@ class Sequence
 public:
 	Sequence()
 	{
+		int i;
 		tempo_source = PARAM_SOURCE_NONE;
 		source_vibrato_range = 4;
 		source_fine_pitch_range = 12;
 		bank = 0;
 		volume = 1.0;
+		thread_count = 1;
+		use_subroutines = true;
+		loop_start_ticks = -1;
+		loop_end_ticks = -1;
+		// one step of the m64 value, squared, at the default ranges: each
+		// value of a thinned run stays within a step of the run's average.
+		// The tempo and fixed values are left alone.
+		for (i = 0; i < CONTROLLER_SOURCE_TYPE_N; thinning_tolerance[i++] = 0);
+		thinning_tolerance[(int)ControllerSourceType::FinePitch] =
+			1.0 / (255.0 * 255.0);
+		thinning_tolerance[(int)ControllerSourceType::Volume] =
+			1.0 / (128.0 * 128.0);
+		thinning_tolerance[(int)ControllerSourceType::Pan] =
+			1.0 / (126.0 * 126.0);
+		thinning_tolerance[(int)ControllerSourceType::Unknown] =
+			1.0 / (128.0 * 128.0);
+		// one step of the m64 value: a dropped event is never more than
+		// a step away from the value held in its place. The tempo and
+		// fixed values are left alone.
+		for (i = 0; i < CONTROLLER_SOURCE_TYPE_N; simplify_tolerance[i++] = 0);
+		simplify_tolerance[(int)ControllerSourceType::FinePitch] = 1;
+		simplify_tolerance[(int)ControllerSourceType::Volume] = 1;
+		simplify_tolerance[(int)ControllerSourceType::Pan] = 1;
+		simplify_tolerance[(int)ControllerSourceType::Unknown] = 1;
+	}
+	// ends the song at the loop end and gives every track an event on
+	// the loop start, so that each script can jump back to it there; a
+	// note or rest across the loop start is split in two, so a held note
+	// is struck again. With only one marker the loop starts at the
+	// beginning or runs to the end of the song; an empty loop is dropped.
+	// Afterwards loop_start_ticks is -1 if the song does not loop.
+	void cut_loop()
+	{
+		NoteEvent split(NoteType::Rest, 0);
+		int i;
+		int j;
+		int k;
+		if ((loop_start_ticks < 0) && (loop_end_ticks < 0))
+		{
+			return;
+		}
+		if (loop_start_ticks < 0)
+		{
+			loop_start_ticks = 0;
+		}
+		if ((loop_end_ticks >= 0) && (loop_end_ticks < total_ticks))
+		{
+			total_ticks = loop_end_ticks;
+		}
+		loop_end_ticks = -1;
+		if (loop_start_ticks >= total_ticks)
+		{
+			loop_start_ticks = -1;
+			return;
+		}
+		for (i = 0; i < tracks.size(); i++)
+		{
+			for (k = 0; k < tracks[i].voice_count(); k++)
+			{
+				vector<NoteEvent>& notes = tracks[i].voice(k);
+				while ((!notes.empty()) &&
+					(notes.back().ticks >= total_ticks))
+				{
+					notes.pop_back();
+				}
+				for (j = notes.size(); j-- > 0;)
+				{
+					if (notes[j].ticks <= loop_start_ticks)
+					{
+						break;
+					}
+				}
+				if ((j >= 0) && (notes[j].ticks < loop_start_ticks))
+				{
+					split = notes[j];
+					split.ticks = loop_start_ticks;
+					notes.insert(notes.begin() + j + 1, split);
+				}
+			}
+		}
 	}
 	void trim_events()
 	{
@@ -492,112 +1111,327 @@ public:
 			}
 		}
 	}
-	void optimize(Track& _track, ControllerSource& _source)
+	void optimize(Track& _track, vector<QuantizedEvent>& _events)
 	{
 		int cur_event;
+		int kept;
 		int this_note;
 		int last_rest_ticks;
-		float last_value;
+		int last_value;
 		bool passed_note;
 		NoteType last_type;
+		vector<NoteEvent> merged;
 
-		
+		// an event with no note started since the previous one replaces
+		// it if that one fell in a rest, when no layer plays; kept events
+		// are compacted to the front as the list is scanned
+		if (!_track.voices.empty())
+		{
+			merged = _track.get_merged_notes();
+		}
+		vector<NoteEvent>& notes = _track.voices.empty() ? _track.notes :
+			merged;
 		this_note = 0;
 		last_type = NoteType::Note;
-		cur_event = 0; 
+		kept = 0;
 		
-		while(cur_event < _source.events.size())
+		for (cur_event = 0; cur_event < _events.size(); cur_event++)
 		{
 			passed_note = false;
-			while (_track.notes[this_note].ticks <=
-				_source.events[cur_event].ticks)
+			while (notes[this_note].ticks <=
+				_events[cur_event].ticks)
 			{
-				if (_track.notes[this_note].type == NoteType::Note)
+				if (notes[this_note].type == NoteType::Note)
 				{
 					passed_note = true;
 				}
 				this_note++;
-				if (this_note >= _track.notes.size()) break;
+				if (this_note >= notes.size()) break;
 			}
 			this_note--;
-			if (!passed_note)
+			if ((!passed_note) && (last_type == NoteType::Rest))
 			{
-				if (last_type == NoteType::Rest) 
-				{
-					_source.events.erase(_source.events.begin() + 
-						cur_event - 1);
-				}
-				else
-				{
-					cur_event++;
-				}
+				_events[kept - 1] = _events[cur_event];
 			}
 			else
 			{
-				cur_event++;
+				_events[kept] = _events[cur_event];
+				kept++;
 			}
-			last_type = _track.notes[this_note].type;
+			last_type = notes[this_note].type;
 		}
-		cur_event--;
-		if (_track.notes[_track.notes.size() - 1].type != NoteType::Note)
+		_events.erase(_events.begin() + kept,
+			_events.end());
+		cur_event = kept - 1;
+		if (notes[notes.size() - 1].type != NoteType::Note)
 		{
-			last_rest_ticks = _track.notes[_track.notes.size() - 1].ticks;
-			if (_source.events[cur_event].ticks >= last_rest_ticks)
+			last_rest_ticks = notes[notes.size() - 1].ticks;
+			if (_events[cur_event].ticks >= last_rest_ticks)
 			{
-				_source.events.pop_back();
+				_events.pop_back();
 			}
 		}
 		
 
-		last_value = _source.events[0].value;
-		cur_event = 1;
-		while (cur_event < _source.events.size())
+		// drop events which write the same value as the previous one
+		if (_events.size() == 0)
 		{
-			if (_source.events[cur_event].value == last_value)
+			return;
+		}
+		last_value = _events[0].value;
+		kept = 1;
+		for (cur_event = 1; cur_event < _events.size(); cur_event++)
+		{
+			if (_events[cur_event].value != last_value)
 			{
-				_source.events.erase(_source.events.begin() + cur_event);
+				last_value = _events[cur_event].value;
+				_events[kept] = _events[cur_event];
+				kept++;
 			}
-			else
+		}
+		_events.erase(_events.begin() + kept,
+			_events.end());
+	}
+	void optimize_track_sources(int _track_number)
+	{
+		int j;
+		for (j = 0; j < CHANNEL_PARAM_N; j++)
+		{
+			if (!tracks[_track_number].param_events[j].empty())
 			{
-				last_value = _source.events[cur_event].value;
-				cur_event++;
+				optimize(tracks[_track_number],
+					tracks[_track_number].param_events[j]);
 			}
 		}
 	}
-	void optimize_track_sources(int _track_number)
+	void optimize_all()
+	{
+		run_track_pass(&Sequence::optimize_track_sources);
+	}
+	// thins each source as it was set up to, or else in Tolerance mode
+	// with the thinning_tolerance of its type, if that is above 0
+	void thin_sources()
+	{
+		int i;
+		for (i = 0; i < sources.size(); i++)
+		{
+			if ((sources[i].thinning == ThinningMode::None) &&
+				(thinning_tolerance[(int)sources[i].type] > 0))
+			{
+				sources[i].thinning = ThinningMode::Tolerance;
+				sources[i].thinning_tolerance =
+					thinning_tolerance[(int)sources[i].type];
+			}
+			sources[i].thin();
+		}
+	}
+	// converts the sources into the values written to the m64: the
+	// tempo, and each channel parameter of each track
+	void quantize_sources()
+	{
+		int i;
+
+		tempo_events.clear();
+		if (tempo_source != PARAM_SOURCE_NONE)
+		{
+			tempo_events.resize(sources[tempo_source].events.size());
+			for (i = 0; i < tempo_events.size(); i++)
+			{
+				tempo_events[i].ticks = sources[tempo_source].events[i].ticks;
+				tempo_events[i].value =
+					(int)(sources[tempo_source].get(i) * 255.0);
+			}
+		}
+		run_track_pass(&Sequence::quantize_track_sources);
+	}
+	void quantize_track_sources(int _track_number)
+	{
+		ChannelParam params[CHANNEL_PARAM_N];
+		int source;
+		int i;
+		int j;
+
+		get_channel_params(params);
+		for (j = 0; j < CHANNEL_PARAM_N; j++)
+		{
+			vector<QuantizedEvent>& events =
+				tracks[_track_number].param_events[j];
+			source = tracks[_track_number].*(params[j].source);
+			events.clear();
+			if (source == PARAM_SOURCE_NONE)
+			{
+				continue;
+			}
+			events.resize(sources[source].events.size());
+			for (i = 0; i < events.size(); i++)
+			{
+				events[i].ticks = sources[source].events[i].ticks;
+				events[i].value = (int)(sources[source].get(i) *
+					params[j].multiplier + params[j].offset);
+			}
+		}
+	}
+	// drops quantized events within simplify_tolerance (by source type)
+	// of the value still held from the last kept event, and reports the
+	// controller events left on each track on stderr
+	void simplify_sources()
 	{
-		if (tracks[_track_number].echo_source != PARAM_SOURCE_NONE)
+		ChannelParam params[CHANNEL_PARAM_N];
+		int before;
+		int source;
+		int i;
+		int j;
+
+		for (i = 0; i < CONTROLLER_SOURCE_TYPE_N; i++)
+		{
+			if (simplify_tolerance[i] > 0)
+			{
+				break;
+			}
+		}
+		if (i == CONTROLLER_SOURCE_TYPE_N)
+		{
+			return;
+		}
+		get_channel_params(params);
+		for (i = 0; i < tracks.size(); i++)
 		{
-			optimize(tracks[_track_number], 
-				sources[tracks[_track_number].echo_source]);
+			before = track_event_count(tracks[i]);
+			for (j = 0; j < CHANNEL_PARAM_N; j++)
+			{
+				source = tracks[i].*(params[j].source);
+				if (source != PARAM_SOURCE_NONE)
+				{
+					simplify(tracks[i].param_events[j],
+						simplify_tolerance[(int)sources[source].type]);
+				}
+			}
+			cerr << "Track " << i << " (" << tracks[i].name << "): "
+				<< before << " -> " << track_event_count(tracks[i])
+				<< " controller events\n";
 		}
-		if (tracks[_track_number].fine_pitch_source != PARAM_SOURCE_NONE)
+		if (tempo_source != PARAM_SOURCE_NONE)
 		{
-			optimize(tracks[_track_number], 
-				sources[tracks[_track_number].fine_pitch_source]);
+			simplify(tempo_events,
+				simplify_tolerance[(int)sources[tempo_source].type]);
 		}
-		if (tracks[_track_number].pan_source != PARAM_SOURCE_NONE)
+	}
+	void simplify(vector<QuantizedEvent>& _events, float _tolerance)
+	{
+		int kept;
+		int i;
+
+		if ((_tolerance <= 0) || (_events.size() < 2))
 		{
-			optimize(tracks[_track_number], 
-				sources[tracks[_track_number].pan_source]);
+			return;
 		}
-		if (tracks[_track_number].vibrato_source != PARAM_SOURCE_NONE)
+		kept = 1;
+		for (i = 1; i < _events.size(); i++)
 		{
-			optimize(tracks[_track_number], 
-				sources[tracks[_track_number].vibrato_source]);
+			if (abs(_events[i].value - _events[kept - 1].value) > _tolerance)
+			{
+				_events[kept++] = _events[i];
+			}
 		}
-		if (tracks[_track_number].volume_source != PARAM_SOURCE_NONE)
+		_events.erase(_events.begin() + kept, _events.end());
+	}
+	int find_track_group(vector<int>& _parent, int _track)
+	{
+		while (_parent[_track] != _track)
 		{
-			optimize(tracks[_track_number], 
-				sources[tracks[_track_number].volume_source]);
+			_parent[_track] = _parent[_parent[_track]];
+			_track = _parent[_track];
 		}
+		return _track;
 	}
-	void optimize_all()
+	// groups of tracks which are linked by sharing controller sources,
+	// each in track order; tracks in different groups touch different
+	// data, so their transform passes can run at the same time
+	vector<vector<int> > get_track_groups()
 	{
+		vector<vector<int> > groups;
+		vector<int> parent;
+		vector<int> source_track;
+		vector<int> group_index;
+		ChannelParam params[CHANNEL_PARAM_N];
+		int source;
 		int i;
+		int j;
+		int a;
+		int b;
+		get_channel_params(params);
+		parent.resize(tracks.size());
+		source_track.assign(sources.size(), -1);
+		for (i = 0; i < tracks.size(); i++)
+		{
+			parent[i] = i;
+			for (j = 0; j < CHANNEL_PARAM_N; j++)
+			{
+				source = tracks[i].*(params[j].source);
+				if (source == PARAM_SOURCE_NONE)
+				{
+					continue;
+				}
+				if (source_track[source] == -1)
+				{
+					source_track[source] = i;
+				}
+				else
+				{
+					a = find_track_group(parent, source_track[source]);
+					b = find_track_group(parent, i);
+					parent[b] = a;
+				}
+			}
+		}
+		group_index.assign(tracks.size(), -1);
 		for (i = 0; i < tracks.size(); i++)
 		{
-			optimize_track_sources(i);
+			a = find_track_group(parent, i);
+			if (group_index[a] == -1)
+			{
+				group_index[a] = groups.size();
+				groups.push_back(vector<int>());
+			}
+			groups[group_index[a]].push_back(i);
+		}
+		return groups;
+	}
+	// applies _pass to the tracks of the groups taken from _next_group
+	// until none are left; run on several threads at once
+	void run_track_groups(void (Sequence::*_pass)(int),
+		vector<vector<int> >* _groups, atomic<int>* _next_group)
+	{
+		int i;
+		int j;
+		while ((i = (*_next_group)++) < (int)_groups->size())
+		{
+			for (j = 0; j < (*_groups)[i].size(); j++)
+			{
+				(this->*_pass)((*_groups)[i][j]);
+			}
+		}
+	}
+	// applies a per-track pass to every track, on up to thread_count
+	// threads; tracks which share a source are kept on one thread and
+	// done in track order, so the result is the same as a serial pass
+	void run_track_pass(void (Sequence::*_pass)(int))
+	{
+		vector<vector<int> > groups;
+		vector<thread> workers;
+		atomic<int> next_group;
+		int i;
+		groups = get_track_groups();
+		next_group = 0;
+		for (i = 1; (i < thread_count) && (i < groups.size()); i++)
+		{
+			workers.push_back(thread(&Sequence::run_track_groups, this,
+				_pass, &groups, &next_group));
+		}
+		run_track_groups(_pass, &groups, &next_group);
+		for (i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
 		}
 	}
 	void refactor_notes_to_pitch_bend(Track& _track, ControllerSource& _source)
@@ -605,131 +1439,137 @@ public:
 		int i;
 		int j;
 		int k;
-		int start_j;
+		int note_index;
 		int ticks;
 		int next_note_ticks;
 		float semitone_shift;
 		float semitone_offset;
 		float value_adjust;
 		bool has_events_flag;
-		j = 0;
+		vector<NoteEvent> notes;
+		vector<ControllerEvent> events;
+		// the new note and bend streams are built in one pass; the bend
+		// event being looked at is always events.back(), and j is the
+		// next source event which has not been copied yet
+		if (_source.events.size() == 0)
+		{
+			return;
+		}
+		notes.reserve(_track.notes.size());
+		events.reserve(_source.events.size() + _track.notes.size());
+		events.push_back(_source.events[0]);
+		j = 1;
 		for (i = 0; i < _track.notes.size(); i++)
 		{
-			k = 1;
-			if (_track.notes[i].type == NoteType::Note)
+			notes.push_back(_track.notes[i]);
+			if (_track.notes[i].type != NoteType::Note)
 			{
-				ticks = _track.notes[i].ticks;
-				if (i == (_track.notes.size() - 1))
-				{
-					next_note_ticks = total_ticks;
-				}
-				else
+				continue;
+			}
+			note_index = notes.size() - 1;
+			ticks = _track.notes[i].ticks;
+			if (i == (_track.notes.size() - 1))
+			{
+				next_note_ticks = total_ticks;
+			}
+			else
+			{
+				next_note_ticks = _track.notes[i + 1].ticks;
+			}
+			if (events.back().ticks < ticks)
+			{
+				// move up to the last event at or before the note
+				while ((j < _source.events.size()) && 
+					(_source.events[j].ticks <= ticks))
 				{
-					next_note_ticks = _track.notes[i + 1].ticks;
+					events.push_back(_source.events[j]);
+					j++;
 				}
-				if (_source.events[j].ticks < ticks)
+				has_events_flag = true;
+			}
+			else
+			{
+				has_events_flag = (events.back().ticks < next_note_ticks);
+			}
+			if (!has_events_flag)
+			{
+				continue;
+			}
+
+			while (true)
+			{
+				semitone_shift = (events.back().value*2.0 - 1.0)*
+					source_fine_pitch_range;
+				if (fabs(semitone_shift) > 11.9)
 				{
-					has_events_flag = false;
-					for (; j < _source.events.size(); j++)
+					semitone_offset = 
+						floor((ceil(fabs(semitone_shift) - 1.0) /
+							12.0) + 0.5) * 12;
+					semitone_offset *= signbit(semitone_shift) ? 
+						-1.0 : 1.0;
+					if (events.back().ticks <= ticks)
 					{
-						if (_source.events[j].ticks > ticks)
-						{
-							j--;
-							has_events_flag = true;
-							break;
-						}
+						notes[note_index].note = 
+							((int)notes.back().note) + (int) semitone_offset;
 					}
-					if (!has_events_flag) j--;
-					has_events_flag = true;
-				}
-				else
-				{
-					if (_source.events[j].ticks < next_note_ticks)
+					else
 					{
-						has_events_flag = true;
+						notes.push_back(
+							NoteEvent(
+								NoteType::Note,
+								events.back().ticks,
+								_track.notes[i].velocity,
+								notes.back().note + (int) semitone_offset));
 					}
-					else
+					if (events.back().ticks < ticks)
 					{
-						has_events_flag = false;
+						events.push_back(
+							ControllerEvent(ticks, events.back().value));
 					}
-				}
-	
-				if (has_events_flag)
-				{
-					do
+					// shift the rest of the bend under this note,
+					// including the events not yet copied
+					value_adjust = (semitone_offset / 
+						source_fine_pitch_range)*0.5;
+					if (events.back().ticks < next_note_ticks)
 					{
-						semitone_shift = (_source.events[j].value*2.0 - 1.0)*
-							source_fine_pitch_range;
-						if (fabs(semitone_shift) > 11.9)
+						events.back().value -= value_adjust;
+						for (k = j; k < _source.events.size(); k++)
 						{
-							semitone_offset = 
-								floor((ceil(fabs(semitone_shift) - 1.0) /
-									12.0) + 0.5) * 12;
-							semitone_offset *= signbit(semitone_shift) ? 
-								-1.0 : 1.0;
-							if (_source.events[j].ticks <= ticks)
-							{
-								_track.notes[i].note = 
-									((int)_track.notes[i + k - 1].note) + 
-										(int) semitone_offset;
-							}
-							else
-							{
-								_track.notes.insert(
-									_track.notes.begin() + i + k,
-									NoteEvent(
-										NoteType::Note,
-										_source.events[j].ticks,
-										_track.notes[i].velocity,
-										_track.notes[i + k - 1].note + 
-											(int) semitone_offset));
-								k++;
-							}
-							if (_source.events[j].ticks < ticks)
-							{
-								_source.events.insert(
-									_source.events.begin() + j + 1,
-									ControllerEvent(
-										ticks,
-										_source.events[j].value));
-								j++;
-							}
-							start_j = j;
-							value_adjust = (semitone_offset / 
-								source_fine_pitch_range)*0.5;
-							while (j < _source.events.size())
+							if (_source.events[k].ticks >= next_note_ticks)
 							{
-								if (_source.events[j].ticks >= next_note_ticks)
-								{
-									break;
-								}
-								_source.events[j].value -= value_adjust;
-								j++;
+								break;
 							}
-							j = start_j;
+							_source.events[k].value -= value_adjust;
 						}
-						j++;
-						if (j >= _source.events.size()) break;
- 					} while (_source.events[j].ticks < next_note_ticks);
-					j--;
+					}
 				}
+				if (j >= _source.events.size()) break;
+				if (_source.events[j].ticks >= next_note_ticks) break;
+				events.push_back(_source.events[j]);
+				j++;
 			}
 		}
+		events.insert(events.end(), _source.events.begin() + j, 
+			_source.events.end());
+		_track.notes.swap(notes);
+		_source.events.swap(events);
 	}
-	void refactor_all_pitch_bends()
+	// the bend moves the notes of one layer only, so a track with
+	// several keeps it as it is
+	void refactor_track_pitch_bend(int _track_number)
 	{
-		int i;
-		for (i = 0; i < tracks.size(); i++)
+		if ((tracks[_track_number].fine_pitch_source != PARAM_SOURCE_NONE) &&
+			tracks[_track_number].voices.empty())
 		{
-			if (tracks[i].fine_pitch_source != PARAM_SOURCE_NONE)
-			{
-				refactor_notes_to_pitch_bend(
-					tracks[i],
-					sources[tracks[i].fine_pitch_source]
-				);
-			}
+			refactor_notes_to_pitch_bend(
+				tracks[_track_number],
+				sources[tracks[_track_number].fine_pitch_source]
+			);
 		}
-
+	}
+	void refactor_all_pitch_bends()
+	{
+		run_track_pass(&Sequence::refactor_track_pitch_bend);
 	}
 	void convert_clock_base()
 	{
@@ -743,75 +1583,173 @@ public:
 			tracks[i].convert_clock_base(ticks_per_quarter, total_ticks);
 		}
 		total_ticks *= 48.0f / (float)ticks_per_quarter;
+		if (loop_start_ticks >= 0)
+		{
+			loop_start_ticks *= 48.0f / (float)ticks_per_quarter;
+		}
+		if (loop_end_ticks >= 0)
+		{
+			loop_end_ticks *= 48.0f / (float)ticks_per_quarter;
+		}
 		ticks_per_quarter = 48;
 	}
 	class EventStream
 	{
 	public:
 		EventStream(
-			ControllerSource* _event_source,
+			vector<QuantizedEvent>* _events,
 			unsigned char _event_code,
-			float _multiplier,
-			float _offset)
+			int _default_value)
 		{
 			cur_event = 0;
-			event_source = _event_source;
+			events = _events;
 			event_code = _event_code;
-			multiplier = _multiplier;
-			offset = _offset;
+			default_value = _default_value;
+			held_value = _default_value;
 		}
 		int cur_event;
-		ControllerSource* event_source;
+		vector<QuantizedEvent>* events;
+		unsigned char event_code;
+		// the value before the first event, and the last value written
+		int default_value;
+		int held_value;
+	};
+	// a controller parameter of a channel: the track field naming its
+	// source, the channel command, the scaling from source values to the
+	// command's value, and the value set when the track has no source
+	class ChannelParam
+	{
+	public:
+		int Track::* source;
 		unsigned char event_code;
 		float multiplier;
 		float offset;
+		unsigned char default_value;
 	};
+	void set_channel_param(ChannelParam& _param,
+		int Track::* _source,
+		unsigned char _event_code,
+		float _multiplier,
+		float _offset,
+		unsigned char _default_value)
+	{
+		_param.source = _source;
+		_param.event_code = _event_code;
+		_param.multiplier = _multiplier;
+		_param.offset = _offset;
+		_param.default_value = _default_value;
+	}
+	// the channel parameters in the order they are written to the m64
+	void get_channel_params(ChannelParam* _params)
+	{
+		float fine_pitch_scaling;
+		float vibrato_scaling;
 
-	std::vector<uchar> create_m64()
+		fine_pitch_scaling = source_fine_pitch_range / 12.0;
+		vibrato_scaling = source_vibrato_range / 12.0;
+		set_channel_param(_params[0], &Track::echo_source,
+			0xD4, 200, 0, 0x00);
+		set_channel_param(_params[1], &Track::fine_pitch_source,
+			0xD3, 255.0*fine_pitch_scaling, -128.0*fine_pitch_scaling, 0x00);
+		set_channel_param(_params[2], &Track::pan_source,
+			0xDD, 126, 1, 0x40);
+		set_channel_param(_params[3], &Track::vibrato_source,
+			0xD8, 255.0*vibrato_scaling, 1, 0x00);
+		// NO CLUE WHAT THIS NUMBER ACTUALLY IS
+		set_channel_param(_params[4], &Track::volume_source,
+			0xDF, 128, 0, 0xC4);
+	}
+
+	int track_event_count(Track& _track)
 	{
-#define ADD(_X_) m64.push_back(_X_)
-#define ADD_W(_X_)							\
-	m64.push_back(((_X_) >> 8) & 0xFF);		\
-	m64.push_back((_X_) & 0xFF)
-#define ADD_V(_X_)							\
-	{										\
-		if((_X_) < 127)						\
-		{									\
-			ADD((_X_));						\
-		}									\
-		else								\
-		{									\
-			ADD_W((_X_) | 0x8000);			\
-		}									\
-	}
-		vector<uchar> m64;
-		vector<int> track_pointers;
-		vector<int> note_pointers;
-		vector<EventStream> events;
-		int i;
+		int count;
 		int j;
-		int last_tick;
+		count = 0;
+		for (j = 0; j < CHANNEL_PARAM_N; j++)
+		{
+			count += _track.param_events[j].size();
+		}
+		return count;
+	}
+	// upper bounds on the number of bytes written for each part of the
+	// m64 data, from the number of notes and controller events
+	int estimate_sequence_size()
+	{
+		return 32 + tracks.size() * 3 + tempo_events.size() * 6;
+	}
+	int estimate_channel_size(Track& _track)
+	{
+		return 32 + _track.voices.size() * 3 + track_event_count(_track) * 5;
+	}
+	int estimate_layer_size(Track& _track)
+	{
+		return 8 + _track.notes.size() * 7;
+	}
+#define ADD(_X_) m64.add(_X_)
+#define ADD_W(_X_) m64.add_w(_X_)
+#define ADD_V(_X_) m64.add_v(_X_)
+#define MARK(_S_) _block.marks.push_back(M64Mark(m64.size(), _S_))
+	// writes the delay from _last_tick to the loop start, and marks the
+	// loop start with a pinned command of no bytes so that it stays in
+	// the script; returns where it is
+	int emit_loop_label(M64Emitter& m64, M64Block& _block, int _last_tick)
+	{
+		if (loop_start_ticks > _last_tick)
+		{
+			MARK(0);
+			ADD(0xFD);
+			ADD_V(loop_start_ticks - _last_tick);
+		}
+		MARK(M64_PINNED);
+		return m64.size();
+	}
+	// ends a looping script by jumping back to _label in block
+	// _block_index
+	void emit_loop_jump(M64Emitter& m64, M64Block& _block, int _block_index,
+		int _label)
+	{
+		MARK(M64_PINNED);
+		ADD(0xFB);
+		_block.fixups.push_back(M64Fixup(m64.size(), _block_index, _label));
+		ADD_W(0x0000);
+	}
+	// sets the values of the streams held at the loop start once more
+	// after it, where the loop changes them by its end and they are not
+	// set again on the loop start anyway
+	void emit_loop_values(M64Emitter& m64, M64Block& _block,
+		vector<EventStream>& _events)
+	{
+		int last_value;
+		int j;
+		for (j = 0; j < _events.size(); j++)
+		{
+			EventStream& stream = _events[j];
+			if ((stream.cur_event < stream.events->size()) &&
+				((*stream.events)[stream.cur_event].ticks == loop_start_ticks))
+			{
+				continue;
+			}
+			last_value = stream.events->empty() ? stream.default_value :
+				stream.events->back().value;
+			if (stream.held_value != last_value)
+			{
+				MARK(0);
+				ADD(stream.event_code);
+				ADD(stream.held_value);
+			}
+		}
+	}
+	// the sequence script: header, channel pointers and tempo
+	void emit_sequence(M64Block& _block)
+	{
+		M64Emitter m64(_block.data);
+		vector<EventStream> tempo;
+		int i;
+		int last_tick;
 		int tick;
-		int near_event;
-		float value;
-		int val_int;
-		int cur_note_group;
-		int note_group;
-		int note;
-		int note_fmt;
-		int prev_duration;
-		int this_duration;
-		int mode;
-		int this_and_next_duration;
-		float play_percentage;
-		bool next_note_is_rest;
-		float fine_pitch_scaling;
-		float vibrato_scaling;
-		float note_vel;
-		int event_prev_values[256];
+		int label;
 
-		fine_pitch_scaling = source_fine_pitch_range / 12.0;
-		vibrato_scaling = source_vibrato_range / 12.0;
+		m64.reserve(estimate_sequence_size());
 
 		ADD(0xD3);									
 		ADD((unsigned char)bank);					
@@ -821,343 +1759,1189 @@ public:
 		for (i = 0; i < tracks.size(); i++)			
 		{
 			ADD(0x90 | i);
+			_block.fixups.push_back(M64Fixup(m64.size(), 1 + i));
 			ADD_W(0x0000);
-			track_pointers.push_back(m64.size() - 2);
 		}
 		ADD(0xDB);									
 		ADD(volume * 100.0); // NO CLUE WHAT THIS NUMBER ACTUALLY IS
 
+		last_tick = 0;
+		label = -1;
 		if (tempo_source == PARAM_SOURCE_NONE)		
 		{											
 			ADD(0xDD);								
 			ADD(0x78);		
-			ADD(0xFD);
-			ADD_V(total_ticks);
 		}
 		else
 		{
-			last_tick = 0;
+			tempo.push_back(EventStream(&tempo_events, 0xDD, 0x78));
 			for (i = 0; 
-				i < sources[tempo_source].events.size(); 
+				i < tempo_events.size();
 				i++)
 			{
-				tick = sources[tempo_source].events[i].ticks;
-				if (tick > 0)
+				tick = tempo_events[i].ticks;
+				if ((label < 0) && (loop_start_ticks >= 0) &&
+					(tick >= loop_start_ticks))
+				{
+					label = emit_loop_label(m64, _block, last_tick);
+					last_tick = loop_start_ticks;
+					emit_loop_values(m64, _block, tempo);
+				}
+				if (tick != last_tick)
 				{
 					ADD(0xFD);
 					ADD_V(tick - last_tick);
 				}
 				ADD(0xDD);
-				ADD((uchar)(sources[tempo_source].get(i) * 255.0));
+				ADD(tempo_events[i].value);
+				tempo[0].held_value = tempo_events[i].value;
+				tempo[0].cur_event++;
 				last_tick = tick;
 			}
-			if (last_tick != total_ticks)
-			{
-				ADD(0xFD);
-				ADD_V(total_ticks - last_tick);
-			}
+		}
+		if ((label < 0) && (loop_start_ticks >= 0))
+		{
+			label = emit_loop_label(m64, _block, last_tick);
+			last_tick = loop_start_ticks;
+		}
+		if (last_tick != total_ticks)
+		{
+			ADD(0xFD);
+			ADD_V(total_ticks - last_tick);
 		}
 
-		ADD(0xFF);
+		if (label < 0)
+		{
+			ADD(0xFF);
+		}
+		else
+		{
+			emit_loop_jump(m64, _block, 0, label);
+		}
+	}
+	// whether channel parameter _j of a track holds one value for the
+	// whole song, as it does with no source or with a source which never
+	// changes from the start, such as a fixed one; that value is written
+	// once as the channel starts rather than as a stream of events
+	bool get_fixed_value(Track& _track, ChannelParam* _params, int _j,
+		int& _value)
+	{
+		vector<QuantizedEvent>& events = _track.param_events[_j];
+		int i;
+		if (_track.*(_params[_j].source) == PARAM_SOURCE_NONE)
+		{
+			_value = _params[_j].default_value;
+			return true;
+		}
+		if (events.empty() || (events[0].ticks != 0))
+		{
+			return false;
+		}
+		for (i = 1; (i < events.size()) &&
+			(events[i].value == events[0].value); i++);
+		_value = events[0].value;
+		return i == events.size();
+	}
+	// the channel script of a track in block _block_index: its instrument,
+	// transpose and controller events, with pointers to its note layers in
+	// the blocks from _layer_block on
+	void emit_channel(Track& _track, M64Block& _block, int _block_index,
+		int _layer_block, int _transpose)
+	{
+		M64Emitter m64(_block.data);
+		vector<EventStream> events;
+		priority_queue<pair<int, int>, vector<pair<int, int> >,
+			greater<pair<int, int> > > stream_heads;
+		int j;
+		int last_tick;
+		int tick;
+		int near_event;
+		int label;
+		int value;
+		ChannelParam params[CHANNEL_PARAM_N];
 
-		for (i = 0; i < tracks.size(); i++)
+		get_channel_params(params);
+		m64.reserve(estimate_channel_size(_track));
+
+		// no channel command depends on what came before it
+		MARK(M64_PINNED);
+		ADD(0xC4);
+		for (j = 0; j < _track.voice_count(); j++)
 		{
-			ADD(0xC4);
-			*((short*) &(m64[track_pointers[i]])) = rev_short(m64.size() - 1);
-			ADD(0x90);
+			MARK(M64_PINNED);
+			ADD(0x90 | j);
+			_block.fixups.push_back(M64Fixup(m64.size(), _layer_block + j));
 			ADD_W(0x0000);
-			note_pointers.push_back(m64.size() - 2);
-			ADD(0xC1);
-			ADD(tracks[i].instrument);
-			events.clear();
-			if (tracks[i].echo_source == PARAM_SOURCE_NONE)
+		}
+		MARK(0);
+		ADD(0xC1);
+		ADD(_track.instrument);
+		if (_transpose != 0)
+		{
+			MARK(0);
+			ADD(0xDB);
+			ADD(_transpose);
+		}
+		events.clear();
+		for (j = 0; j < CHANNEL_PARAM_N; j++)
+		{
+			if (get_fixed_value(_track, params, j, value))
 			{
-				ADD(0xD4);
-				ADD(0x00);
+				MARK(0);
+				ADD(params[j].event_code);
+				ADD(value);
 			}
 			else
 			{
 				events.push_back(
 					EventStream(
-						&sources[tracks[i].echo_source],
-						0xD4,
-						200, 0)
+						&_track.param_events[j],
+						params[j].event_code,
+						params[j].default_value)
 					);
 			}
-			if (tracks[i].fine_pitch_source == PARAM_SOURCE_NONE)
+		}
+		last_tick = 0;
+		label = -1;
+		// merge the streams by tick; on equal ticks the stream added
+		// first goes first
+		for (j = 0; j < events.size(); j++)
+		{
+			if (events[j].events->size() > 0)
 			{
-				ADD(0xD3);
-				ADD(0x00);
+				stream_heads.push(make_pair(
+					(*events[j].events)[0].ticks, j));
 			}
-			else
+		}
+		while (!stream_heads.empty())
+		{
+			tick = stream_heads.top().first;
+			near_event = stream_heads.top().second;
+			stream_heads.pop();
+
+			if ((label < 0) && (loop_start_ticks >= 0) &&
+				(tick >= loop_start_ticks))
 			{
-				events.push_back(
-					EventStream(
-						&sources[tracks[i].fine_pitch_source],
-						0xD3,
-						255.0*fine_pitch_scaling, -128.0*fine_pitch_scaling)
-					);
+				label = emit_loop_label(m64, _block, last_tick);
+				last_tick = loop_start_ticks;
+				emit_loop_values(m64, _block, events);
 			}
-			if (tracks[i].pan_source == PARAM_SOURCE_NONE)
+			if (tick != last_tick)
 			{
-				ADD(0xDD);
-				ADD(0x40);
+				MARK(0);
+				ADD(0xFD);
+				ADD_V(tick - last_tick);
 			}
-			else
+			MARK(0);
+			ADD(events[near_event].event_code);
+			ADD((*events[near_event].events)[
+				events[near_event].cur_event].value);
+			events[near_event].held_value = (*events[near_event].events)[
+				events[near_event].cur_event].value;
+			last_tick = tick;
+
+			events[near_event].cur_event++;
+			if (events[near_event].cur_event <
+				events[near_event].events->size())
 			{
-				events.push_back(
-					EventStream(
-						&sources[tracks[i].pan_source],
-						0xDD,
-						126, 1)
-					);
+				stream_heads.push(make_pair(
+					(*events[near_event].events)[
+						events[near_event].cur_event].ticks,
+					near_event));
 			}
-			if (tracks[i].vibrato_source == PARAM_SOURCE_NONE)
+		} 
+		if ((label < 0) && (loop_start_ticks >= 0))
+		{
+			label = emit_loop_label(m64, _block, last_tick);
+			last_tick = loop_start_ticks;
+		}
+		if (last_tick != total_ticks)
+		{
+			MARK(0);
+			ADD(0xFD);
+			ADD_V(total_ticks - last_tick);
+		}
+		if (label < 0)
+		{
+			MARK(M64_PINNED);
+			ADD(0xFF);
+		}
+		else
+		{
+			emit_loop_jump(m64, _block, _block_index, label);
+		}
+	}
+	// the duration of note _j up to the next note or rest, and of the
+	// rest after it; returns whether a rest follows. A rest on the loop
+	// start is not counted, as the layer has to be able to jump to it.
+	bool get_note_durations(Track& _track, int _j,
+		int& _note_duration, int& _rest_duration)
+	{
+		_rest_duration = 0;
+		if (_j == (_track.notes.size() - 1))
+		{
+			_note_duration = total_ticks - _track.notes[_j].ticks;
+			return false;
+		}
+		_note_duration = _track.notes[_j + 1].ticks - _track.notes[_j].ticks;
+		if ((_track.notes[_j + 1].type == NoteType::Rest) &&
+			(_track.notes[_j + 1].ticks != loop_start_ticks))
+		{
+			if (_j == (_track.notes.size() - 2))
 			{
-				ADD(0xD8);
-				ADD(0x00);
+				_rest_duration = total_ticks - _track.notes[_j + 1].ticks;
 			}
 			else
 			{
-				events.push_back(
-					EventStream(
-						&sources[tracks[i].vibrato_source],
-						0xD8,
-						255.0*vibrato_scaling, 1)
-					);
+				_rest_duration = _track.notes[_j + 2].ticks -
+					_track.notes[_j + 1].ticks;
 			}
-			if (tracks[i].volume_source == PARAM_SOURCE_NONE)
+			return true;
+		}
+		return false;
+	}
+	// the number of bytes of a rest command, or none for an empty rest
+	int rest_size(int _duration)
+	{
+		return (_duration > 0) ? 1 + M64Emitter::size_v(_duration) : 0;
+	}
+	// adds a candidate state for the note being planned, or replaces the
+	// one with the same held delay if the new one is shorter
+	void offer_layer_state(vector<LayerState>& _states, vector<int>& _slots,
+		vector<int>& _held_values, LayerState& _state)
+	{
+		int k;
+		k = lower_bound(_held_values.begin(), _held_values.end(),
+			_state.held_delay) - _held_values.begin();
+		if (_slots[k] < 0)
+		{
+			_slots[k] = _states.size();
+			_states.push_back(_state);
+		}
+		else if (_state.bytes < _states[_slots[k]].bytes)
+		{
+			_states[_slots[k]] = _state;
+		}
+	}
+	// chooses the transpose (0xC2) value in effect for each note of a
+	// track's layer so that as few transpose commands as possible are
+	// written. A note can be played under any transpose which puts it in
+	// the 64 keys above NOTE_BIAS; cost[t] is the fewest commands so far
+	// that end with transpose t, which either was already in effect or
+	// was set just before the note.
+	void plan_transpose(Track& _track, vector<int>& _transpose)
+	{
+		vector<int> cost(256);
+		vector<int> next_cost(256);
+		vector<char> kept;
+		vector<int> best_before;
+		vector<int> note_index;
+		int best;
+		int low;
+		int high;
+		int t;
+		int j;
+		int k;
+
+		_transpose.assign(_track.notes.size(), 0);
+		// transpose t is stored at t + 128, as the command takes a
+		// signed byte
+		for (t = 0; t < 256; cost[t++] = INT_MAX);
+		cost[128] = 0;
+		for (j = 0; j < _track.notes.size(); j++)
+		{
+			if (_track.notes[j].type != NoteType::Note)
 			{
-				ADD(0xDF);
-				ADD(0xC4);
+				continue;
 			}
-			else
+			low = _track.notes[j].note - NOTE_BIAS - 63;
+			high = _track.notes[j].note - NOTE_BIAS;
+			low = (low < -128) ? -128 : low;
+			high = (high > 127) ? 127 : high;
+			if (low > high)
 			{
-				events.push_back(
-					EventStream(
-						&sources[tracks[i].volume_source],
-						0xDF,
-						128, 0) // NO CLUE WHAT THIS NUMBER ACTUALLY IS
-					);
+				// out of reach of any transpose; keep the nearest
+				low = high = (high < -128) ? -128 : 127;
+			}
+			best = 0;
+			for (t = 1; t < 256; t++)
+			{
+				if (cost[t] < cost[best])
+				{
+					best = t;
+				}
+			}
+			note_index.push_back(j);
+			best_before.push_back(best);
+			kept.resize(kept.size() + 256);
+			for (t = 0; t < 256; t++)
+			{
+				k = t - 128;
+				next_cost[t] = INT_MAX;
+				kept[kept.size() - 256 + t] = 0;
+				if ((k < low) || (k > high))
+				{
+					continue;
+				}
+				if ((cost[t] != INT_MAX) && (cost[t] <= cost[best] + 1))
+				{
+					next_cost[t] = cost[t];
+					kept[kept.size() - 256 + t] = 1;
+				}
+				else
+				{
+					next_cost[t] = cost[best] + 1;
+				}
+			}
+			cost.swap(next_cost);
+		}
+
+		best = 0;
+		for (t = 1; t < 256; t++)
+		{
+			if (cost[t] < cost[best])
+			{
+				best = t;
+			}
+		}
+		for (j = note_index.size(); j-- > 0;)
+		{
+			_transpose[note_index[j]] = best - 128;
+			if (!kept[j * 256 + best])
+			{
+				best = best_before[j];
+			}
+		}
+	}
+	// chooses how each note of a track's layer is written so that the
+	// layer takes the fewest bytes. The search runs over the delay held
+	// for mode 3 notes, which only ever takes the value of a note's
+	// duration or of a note and the rest after it; a note may play all,
+	// part or none of the following rest as its gate. Delays written with
+	// a gate are kept to 255 ticks or less, as the single note writer did.
+	// The first note of a loop is never mode 3, as the delay held when
+	// the layer jumps back to it is not the one held the first time.
+	void plan_layer(Track& _track, vector<LayerNote>& _plan)
+	{
+		vector<LayerState> states;
+		vector<int> held_values;
+		vector<int> slots;
+		LayerState state;
+		int first;
+		int last;
+		int best;
+		int note_duration;
+		int rest_duration;
+		int total_duration;
+		int held;
+		int loop_note;
+		int i;
+		int j;
+		int k;
+
+		_plan.resize(_track.notes.size());
+		held_values.push_back(0);
+		loop_note = -1;
+		for (j = 0; j < _track.notes.size(); j++)
+		{
+			if ((loop_note < 0) && (loop_start_ticks >= 0) &&
+				(_track.notes[j].ticks >= loop_start_ticks) &&
+				(_track.notes[j].type == NoteType::Note))
+			{
+				loop_note = j;
+			}
+			if (_track.notes[j].type == NoteType::Note)
+			{
+				get_note_durations(_track, j, note_duration, rest_duration);
+				held_values.push_back(note_duration);
+				if (rest_duration > 0)
+				{
+					held_values.push_back(note_duration + rest_duration);
+				}
+			}
+		}
+		sort(held_values.begin(), held_values.end());
+		held_values.erase(unique(held_values.begin(), held_values.end()),
+			held_values.end());
+		slots.assign(held_values.size(), -1);
+
+		state.held_delay = 0;
+		state.bytes = 0;
+		state.from = -1;
+		state.note_index = -1;
+		states.push_back(state);
+		first = 0;
+		last = 1;
+		for (j = 0; j < _track.notes.size(); j++)
+		{
+			if (_track.notes[j].type != NoteType::Note)
+			{
+				continue;
+			}
+			get_note_durations(_track, j, note_duration, rest_duration);
+			total_duration = note_duration + rest_duration;
+			best = first;
+			for (i = first + 1; i < last; i++)
+			{
+				if (states[i].bytes < states[best].bytes)
+				{
+					best = i;
+				}
+			}
+			state.note_index = j;
+
+			// mode 2, with the whole rest after it
+			state.from = best;
+			state.held_delay = note_duration;
+			state.bytes = states[best].bytes + 2 +
+				M64Emitter::size_v(note_duration) + rest_size(rest_duration);
+			state.note.mode = 2;
+			state.note.delay = note_duration;
+			offer_layer_state(states, slots, held_values, state);
+
+			// mode 1, playing part or all of the rest as the gate
+			for (k = 0; k < held_values.size(); k++)
+			{
+				held = held_values[k];
+				if ((held > note_duration) && (held <= total_duration) &&
+					(held <= 255))
+				{
+					state.held_delay = held;
+					state.bytes = states[best].bytes + 3 +
+						M64Emitter::size_v(held) +
+						rest_size(total_duration - held);
+					state.note.mode = 1;
+					state.note.delay = held;
+					offer_layer_state(states, slots, held_values, state);
+				}
+			}
+
+			// mode 3, wherever the held delay fits
+			for (i = first; (i < last) && (loop_note != j); i++)
+			{
+				held = states[i].held_delay;
+				if ((held > 0) && (held >= note_duration) &&
+					(held <= total_duration) && (held <= 255))
+				{
+					state.from = i;
+					state.held_delay = held;
+					state.bytes = states[i].bytes + 3 +
+						rest_size(total_duration - held);
+					state.note.mode = 3;
+					state.note.delay = held;
+					offer_layer_state(states, slots, held_values, state);
+				}
+			}
+
+			first = last;
+			last = states.size();
+			for (i = first; i < last; i++)
+			{
+				slots[lower_bound(held_values.begin(), held_values.end(),
+					states[i].held_delay) - held_values.begin()] = -1;
+			}
+		}
+
+		best = first;
+		for (i = first + 1; i < last; i++)
+		{
+			if (states[i].bytes < states[best].bytes)
+			{
+				best = i;
+			}
+		}
+		for (i = best; states[i].from >= 0; i = states[i].from)
+		{
+			_plan[states[i].note_index] = states[i].note;
+		}
+	}
+	// the velocity written for note _j of a track
+	uchar note_velocity(Track& _track, int _j)
+	{
+		return note_velocity(_track, _track.notes[_j]);
+	}
+	uchar note_velocity(Track& _track, NoteEvent& _note)
+	{
+		float note_vel;
+		note_vel = _note.velocity * _track.velocity_multiplier;
+		if (note_vel > 1.0)
+		{
+			note_vel = 1.0;
+		}
+		else if (note_vel < 0.0)
+		{
+			note_vel = 0.0;
+		}
+		return note_vel * 100.0;
+	}
+	// the note layer of a track. A rest or a transpose means the same
+	// anywhere; a note depends on the transpose, and a mode 3 note on the
+	// held delay as well, which is marked as held_delay * 256 + transpose
+	// + 128. A looping layer sets the transpose it had on the loop start
+	// again before it jumps back.
+	void emit_layer(Track& _track, M64Block& _block, int _block_index)
+	{
+		M64Emitter m64(_block.data);
+		vector<LayerNote> plan;
+		vector<int> transpose;
+		int j;
+		int cur_transpose;
+		int held_delay;
+		int label;
+		int loop_transpose;
+		int note;
+		int note_fmt;
+		int this_duration;
+		int rest_duration;
+		int delay;
+		bool next_note_is_rest;
+		float play_percentage;
+		uchar note_vel;
+
+		m64.reserve(estimate_layer_size(_track));
+		plan_layer(_track, plan);
+		if (!_track.map_directly)
+		{
+			plan_transpose(_track, transpose);
+		}
+
+		j = 0;
+		cur_transpose = 0;
+		held_delay = 0;
+		label = -1;
+		loop_transpose = 0;
+		while (j < _track.notes.size())
+		{
+			if ((label < 0) && (_track.notes[j].ticks == loop_start_ticks))
+			{
+				MARK(M64_PINNED);
+				label = m64.size();
+				loop_transpose = cur_transpose;
 			}
-			for (j = 0; j < 256; event_prev_values[j++] = -1);
-			last_tick = 0;
-			while (!events.empty())
+			if (_track.notes[j].type == NoteType::Rest)
 			{
-				near_event = 0;
-				tick = (*(events[0].event_source)).events[
-					events[0].cur_event].ticks;
-				for (j = 1; j < events.size(); j++)
+				MARK(0);
+				ADD(0xC0);
+				if (j == (_track.notes.size() - 1))
 				{
-					if ((*(events[j].event_source)).events[
-						events[j].cur_event].ticks < tick)
+					ADD_V(total_ticks - _track.notes[j].ticks);
+				}
+				else
+				{
+					ADD_V(_track.notes[j + 1].ticks -
+						_track.notes[j].ticks);
+				}
+				j += 1;
+			}
+			else if (_track.notes[j].type == NoteType::Note)
+			{
+				note = _track.notes[j].note;
+				if ((!_track.map_directly) && (transpose[j] != cur_transpose))
+				{
+					MARK(0);
+					ADD(0xC2);
+					ADD(transpose[j]);
+					cur_transpose = transpose[j];
+				}
+
+				next_note_is_rest = get_note_durations(_track, j,
+					this_duration, rest_duration);
+				delay = plan[j].delay;
+
+				if (_track.map_directly)
+				{
+					note_fmt = note;
+				}
+				else
+				{
+					note_fmt = note - (cur_transpose + NOTE_BIAS);
+				}
+				note_vel = note_velocity(_track, j);
+				play_percentage = ((float)(delay - this_duration)) /
+					((float)delay) * 255.0;
+				if (plan[j].mode == 3)
+				{
+					MARK(held_delay * 256 + cur_transpose + 128);
+				}
+				else
+				{
+					MARK(cur_transpose + 128);
+					held_delay = delay;
+				}
+				switch (plan[j].mode)
+				{
+				case 1:
+					ADD(note_fmt);
+					ADD_V(delay);
+					ADD(note_vel);
+					ADD(play_percentage);
+					break;
+				case 2:
+					ADD(64 + note_fmt);
+					ADD_V(delay);
+					ADD(note_vel);
+					break;
+				case 3:
+					ADD(128 + note_fmt);
+					ADD(note_vel);
+					ADD(play_percentage);
+				}
+
+				// whatever the note does not play of the rest after it
+				if (next_note_is_rest)
+				{
+					if (delay < this_duration + rest_duration)
 					{
-						tick = (*(events[j].event_source)).events[
-							events[j].cur_event].ticks;
-						near_event = j;
+						MARK(0);
+						ADD(0xC0);
+						ADD_V(this_duration + rest_duration - delay);
 					}
+					j += 2;
 				}
+				else
+				{
+					j += 1;
+				}
+			}
+		}
+		if (label >= 0)
+		{
+			if (cur_transpose != loop_transpose)
+			{
+				MARK(0);
+				ADD(0xC2);
+				ADD(loop_transpose);
+			}
+			emit_loop_jump(m64, _block, _block_index, label);
+		}
+	}
+	// the bytes of command _command of _block
+	int command_size(M64Block& _block, int _command)
+	{
+		if (_command + 1 < _block.marks.size())
+		{
+			return _block.marks[_command + 1].offset -
+				_block.marks[_command].offset;
+		}
+		return _block.data.size() - _block.marks[_command].offset;
+	}
+	// whether command _command of _block ends its script, or jumps back
+	// to the loop start for good
+	bool ends_script(M64Block& _block, int _command)
+	{
+		return (_block.marks[_command].state == M64_PINNED) &&
+			(command_size(_block, _command) > 0) &&
+			((_block.data[_block.marks[_command].offset] == 0xFF) ||
+				(_block.data[_block.marks[_command].offset] == 0xFB));
+	}
+	void copy_command(M64Block& _from, int _command, M64Block& _to)
+	{
+		int begin;
+		begin = _from.marks[_command].offset;
+		_to.marks.push_back(M64Mark(_to.data.size(),
+			_from.marks[_command].state));
+		_to.data.insert(_to.data.end(), _from.data.begin() + begin,
+			_from.data.begin() + begin + command_size(_from, _command));
+	}
+	// moves runs of commands which repeat within or between the blocks
+	// of _group into subroutines for as long as that makes the blocks
+	// shorter. The subroutines are written to block _sub_block, which is
+	// either the one block of _group or an empty block of their own.
+	// Commands are the same if their bytes and marked states are; each
+	// pinned command, each call and the end of each block is a symbol of
+	// its own, so runs stay within a block and subroutines never call
+	// each other.
+	void factor_blocks(vector<M64Block>& _blocks, vector<int>& _group,
+		int _sub_block)
+	{
+		map<pair<int, vector<uchar> >, int> known;
+		vector<int> symbols;
+		vector<int> sizes;
+		vector<int> next_symbols;
+		vector<int> next_sizes;
+		// the block and the first command of each symbol; a call has a
+		// block of -1 and the subroutine it calls, and the end of a block
+		// has neither
+		vector<int> symbol_block;
+		vector<int> symbol_command;
+		vector<vector<int> > subroutines;
+		vector<int> starts;
+		vector<M64Block> factored;
+		M64Block subroutine_block;
+		Pattern pattern;
+		int begin;
+		int size;
+		int g;
+		int i;
+		int j;
 
-				value = (*(events[near_event].event_source)).get(
-					events[near_event].cur_event);
-				val_int = (int)(value * events[near_event].multiplier +
-					events[near_event].offset);
-
-				if (event_prev_values[events[near_event].event_code] != 
-					val_int) {
-					if (tick != last_tick)
+		for (g = 0; g < _group.size(); g++)
+		{
+			M64Block& block = _blocks[_group[g]];
+			for (i = 0; i < block.marks.size(); i++)
+			{
+				begin = block.marks[i].offset;
+				size = command_size(block, i);
+				pair<int, vector<uchar> > key(block.marks[i].state,
+					vector<uchar>(block.data.begin() + begin,
+						block.data.begin() + begin + size));
+				if ((block.marks[i].state == M64_PINNED) ||
+					(known.count(key) == 0))
+				{
+					if (block.marks[i].state != M64_PINNED)
 					{
-						ADD(0xFD);
-						ADD_V(tick - last_tick);
+						known[key] = symbol_command.size();
 					}
-					ADD(events[near_event].event_code);
-					ADD(val_int);
-					last_tick = tick;
+					symbols.push_back(symbol_command.size());
+					symbol_block.push_back(_group[g]);
+					symbol_command.push_back(i);
+				}
+				else
+				{
+					symbols.push_back(known[key]);
 				}
+				sizes.push_back(size);
+			}
+			symbols.push_back(symbol_command.size());
+			symbol_block.push_back(-1);
+			symbol_command.push_back(-1);
+			sizes.push_back(0);
+		}
 
-				event_prev_values[events[near_event].event_code] = val_int;
-				events[near_event].cur_event++;
-				if (events[near_event].event_source->events.size() ==
-					events[near_event].cur_event)
+		while (find_best_pattern(symbols, sizes, pattern))
+		{
+			subroutines.push_back(vector<int>(
+				symbols.begin() + pattern.starts[0],
+				symbols.begin() + pattern.starts[0] + pattern.length));
+			next_symbols.clear();
+			next_sizes.clear();
+			j = 0;
+			for (i = 0; i < symbols.size(); i++)
+			{
+				if ((j < pattern.starts.size()) && (i == pattern.starts[j]))
 				{
-					events.erase(events.begin() + near_event);
+					next_symbols.push_back(symbol_command.size());
+					next_sizes.push_back(PATTERN_CALL_SIZE);
+					symbol_block.push_back(-1);
+					symbol_command.push_back(subroutines.size() - 1);
+					i += pattern.length - 1;
+					j++;
 				}
-			} 
-			if (last_tick != total_ticks)
+				else
+				{
+					next_symbols.push_back(symbols[i]);
+					next_sizes.push_back(sizes[i]);
+				}
+			}
+			symbols.swap(next_symbols);
+			sizes.swap(next_sizes);
+		}
+		if (subroutines.empty())
+		{
+			return;
+		}
+
+		for (i = 0; i < subroutines.size(); i++)
+		{
+			starts.push_back(subroutine_block.data.size());
+			for (j = 0; j < subroutines[i].size(); j++)
+			{
+				copy_command(_blocks[symbol_block[subroutines[i][j]]],
+					symbol_command[subroutines[i][j]], subroutine_block);
+			}
+			subroutine_block.marks.push_back(M64Mark(
+				subroutine_block.data.size(), M64_PINNED));
+			subroutine_block.data.push_back(0xFF);
+		}
+		// the blocks are only replaced once all are written, as their
+		// commands are copied from each other
+		factored.resize(_group.size());
+		begin = 0;
+		for (g = 0; g < _group.size(); g++)
+		{
+			for (i = begin; symbol_block[symbols[i]] != -1 ||
+				symbol_command[symbols[i]] != -1; i++);
+			write_factored_block(_blocks, _group[g], _sub_block,
+				vector<int>(symbols.begin() + begin, symbols.begin() + i),
+				symbol_block, symbol_command, subroutine_block, starts,
+				factored[g]);
+			begin = i + 1;
+		}
+		for (g = 0; g < _group.size(); g++)
+		{
+			_blocks[_group[g]].data.swap(factored[g].data);
+			_blocks[_group[g]].fixups.swap(factored[g].fixups);
+			_blocks[_group[g]].marks.swap(factored[g].marks);
+		}
+		if (_blocks[_sub_block].data.empty())
+		{
+			_blocks[_sub_block] = subroutine_block;
+		}
+	}
+	// writes to _factored the script of block _index left after
+	// factoring, which ends with FF if it did not end already. Calls go to
+	// _starts in block _sub_block; if that is this block, _subroutines
+	// follows the script.
+	void write_factored_block(vector<M64Block>& _blocks, int _index,
+		int _sub_block, const vector<int>& _symbols,
+		vector<int>& _symbol_block, vector<int>& _symbol_command,
+		M64Block& _subroutines, vector<int>& _starts, M64Block& _factored)
+	{
+		M64Block& block = _blocks[_index];
+		M64Emitter m64(_factored.data);
+		vector<int> new_offsets;
+		vector<int> call_offsets;
+		vector<int> call_targets;
+		int base;
+		int command;
+		int i;
+		int j;
+
+		m64.reserve(block.data.size() + _subroutines.data.size());
+		new_offsets.assign(block.marks.size(), -1);
+		// a command may be copied from where it first appeared, in another
+		// block, unless it is pinned
+		command = -1;
+		for (i = 0; i < _symbols.size(); i++)
+		{
+			command = _symbol_command[_symbols[i]];
+			if (_symbol_block[_symbols[i]] >= 0)
+			{
+				if (_symbol_block[_symbols[i]] == _index)
+				{
+					new_offsets[command] = m64.size();
+				}
+				copy_command(_blocks[_symbol_block[_symbols[i]]], command,
+					_factored);
+				if (_symbol_block[_symbols[i]] != _index)
+				{
+					command = -1;
+				}
+				continue;
+			}
+			_factored.marks.push_back(M64Mark(m64.size(), M64_PINNED));
+			m64.add(0xFC);
+			call_offsets.push_back(m64.size());
+			call_targets.push_back(command);
+			m64.add_w(0x0000);
+			command = -1;
+		}
+		if ((command < 0) || !ends_script(block, command))
+		{
+			_factored.marks.push_back(M64Mark(m64.size(), M64_PINNED));
+			m64.add(0xFF);
+		}
+		base = 0;
+		if (_sub_block == _index)
+		{
+			base = m64.size();
+			for (i = 0; i < _subroutines.marks.size(); i++)
+			{
+				_factored.marks.push_back(M64Mark(
+					base + _subroutines.marks[i].offset,
+					_subroutines.marks[i].state));
+			}
+			_factored.data.insert(_factored.data.end(),
+				_subroutines.data.begin(), _subroutines.data.end());
+		}
+
+		// pointers are only ever in pinned commands, which stay in the
+		// script, and a jump within the block goes to a pinned label, the
+		// first command at its offset
+		for (i = 0; i < block.fixups.size(); i++)
+		{
+			for (j = block.marks.size() - 1;
+				block.marks[j].offset > block.fixups[i].offset; j--);
+			_factored.fixups.push_back(block.fixups[i]);
+			_factored.fixups.back().offset += new_offsets[j] -
+				block.marks[j].offset;
+			if (block.fixups[i].target == _index)
+			{
+				for (j = 0; block.marks[j].offset <
+					block.fixups[i].target_offset; j++);
+				_factored.fixups.back().target_offset = new_offsets[j];
+			}
+		}
+		for (i = 0; i < call_offsets.size(); i++)
+		{
+			_factored.fixups.push_back(M64Fixup(call_offsets[i], _sub_block,
+				base + _starts[call_targets[i]]));
+		}
+	}
+	// whether track _b plays the notes of track _a, _copy.delay ticks
+	// later and _copy.transpose semitones higher, with the same
+	// velocities, until the end of the song; either may start with rests.
+	// The delay and transpose come from the first layer, and tracks of
+	// several layers must match layer by layer.
+	bool find_layer_copy(Track& _a, Track& _b, LayerCopy& _copy)
+	{
+		int i;
+		int j;
+		int k;
+		for (i = 0; (i < _a.notes.size()) &&
+			(_a.notes[i].type != NoteType::Note); i++);
+		for (j = 0; (j < _b.notes.size()) &&
+			(_b.notes[j].type != NoteType::Note); j++);
+		if ((i == _a.notes.size()) || (j == _b.notes.size()) ||
+			(_a.map_directly != _b.map_directly) ||
+			(_a.voice_count() != _b.voice_count()))
+		{
+			return false;
+		}
+		_copy.delay = _b.notes[j].ticks - _a.notes[i].ticks;
+		_copy.transpose = (int)_b.notes[j].note - (int)_a.notes[i].note;
+		if ((_copy.delay < 0) || (_copy.transpose < -127) ||
+			(_copy.transpose > 127) ||
+			(_b.map_directly && (_copy.transpose != 0)))
+		{
+			return false;
+		}
+		for (k = 0; k < _a.voice_count(); k++)
+		{
+			if (!copies_layer(_a, _a.voice(k), _b, _b.voice(k), _copy))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	// whether layer _b_notes of track _b plays layer _a_notes of track _a
+	// with the delay and transpose of _copy
+	bool copies_layer(Track& _a, vector<NoteEvent>& _a_notes, Track& _b,
+		vector<NoteEvent>& _b_notes, LayerCopy& _copy)
+	{
+		int i;
+		int j;
+		for (i = 0; (i < _a_notes.size()) &&
+			(_a_notes[i].type != NoteType::Note); i++);
+		for (j = 0; (j < _b_notes.size()) &&
+			(_b_notes[j].type != NoteType::Note); j++);
+		if ((i == _a_notes.size()) != (j == _b_notes.size()))
+		{
+			return false;
+		}
+		for (; j < _b_notes.size(); i++, j++)
+		{
+			if ((i == _a_notes.size()) ||
+				(_b_notes[j].type != _a_notes[i].type) ||
+				(_b_notes[j].ticks != _a_notes[i].ticks + _copy.delay))
+			{
+				return false;
+			}
+			if ((_b_notes[j].type == NoteType::Note) &&
+				(((int)_b_notes[j].note !=
+					(int)_a_notes[i].note + _copy.transpose) ||
+				(note_velocity(_b, _b_notes[j]) !=
+					note_velocity(_a, _a_notes[i]))))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	// finds for each track an earlier track, not a copy itself, whose
+	// notes it plays
+	void find_layer_copies()
+	{
+		LayerCopy copy;
+		int i;
+		int j;
+		copy.source = -1;
+		copy.delay = 0;
+		copy.transpose = 0;
+		layer_copies.assign(tracks.size(), copy);
+		for (j = 0; j < tracks.size(); j++)
+		{
+			for (i = 0; i < j; i++)
+			{
+				if ((layer_copies[i].source < 0) &&
+					find_layer_copy(tracks[i], tracks[j], copy))
+				{
+					copy.source = i;
+					layer_copies[j] = copy;
+					break;
+				}
+			}
+		}
+	}
+	// encodes the tracks taken from _next_track until none are left; run
+	// on several threads at once by create_m64(). A copied track's layers
+	// are written with the keys of the track it copies, and each further
+	// layer of a track as a track of its own.
+	void emit_tracks(atomic<int>* _next_track, vector<M64Block>* _blocks)
+	{
+		Track shifted;
+		Track* track;
+		int layer;
+		int i;
+		int k;
+		while ((i = (*_next_track)++) < (int)tracks.size())
+		{
+			layer = layer_blocks[i];
+			emit_channel(tracks[i], (*_blocks)[1 + i], 1 + i, layer,
+				layer_copies[i].transpose);
+			track = &tracks[i];
+			if (layer_copies[i].transpose != 0)
+			{
+				shifted = tracks[i];
+				shifted.transpose(-layer_copies[i].transpose);
+				track = &shifted;
+			}
+			emit_layer(*track, (*_blocks)[layer], layer);
+			for (k = 1; k < track->voice_count(); k++)
+			{
+				Track voice(*track);
+				voice.notes.swap(voice.voices[k - 1]);
+				voice.voices.clear();
+				emit_layer(voice, (*_blocks)[layer + k], layer + k);
+			}
+		}
+	}
+	// whether blocks _a and _b, at _a_index and _b_index, hold the same
+	// script
+	bool same_block(M64Block& _a, int _a_index, M64Block& _b, int _b_index)
+	{
+		int i;
+		if ((_a.data != _b.data) || (_a.fixups.size() != _b.fixups.size()))
+		{
+			return false;
+		}
+		for (i = 0; i < _a.fixups.size(); i++)
+		{
+			if ((_a.fixups[i].offset != _b.fixups[i].offset) ||
+				(_a.fixups[i].target_offset != _b.fixups[i].target_offset) ||
+				((_a.fixups[i].target != _b.fixups[i].target) &&
+					((_a.fixups[i].target != _a_index) ||
+						(_b.fixups[i].target != _b_index))))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	// points the channel of each copy at each layer of the track it
+	// copies which came out the same as its own, and empties its own
+	void share_layer_copies(vector<M64Block>& _blocks)
+	{
+		int layer;
+		int source_layer;
+		int i;
+		int j;
+		int k;
+		for (i = 0; i < tracks.size(); i++)
+		{
+			if (layer_copies[i].source < 0)
+			{
+				continue;
+			}
+			for (k = 0; k < tracks[i].voice_count(); k++)
+			{
+				layer = layer_blocks[i] + k;
+				source_layer = layer_blocks[layer_copies[i].source] + k;
+				if (!same_block(_blocks[source_layer], source_layer,
+					_blocks[layer], layer))
+				{
+					continue;
+				}
+				for (j = 0; j < _blocks[1 + i].fixups.size(); j++)
+				{
+					if (_blocks[1 + i].fixups[j].target == layer)
+					{
+						_blocks[1 + i].fixups[j].target = source_layer;
+					}
+				}
+				_blocks[layer] = M64Block();
+			}
+		}
+	}
+	// joins the blocks in order and fills in the pointers between them
+	vector<uchar> link_m64(vector<M64Block>& _blocks)
+	{
+		vector<uchar> output;
+		M64Emitter m64(output);
+		vector<int> starts;
+		int size;
+		int i;
+		int j;
+		size = 0;
+		for (i = 0; i < _blocks.size(); i++)
+		{
+			starts.push_back(size);
+			size += _blocks[i].data.size();
+		}
+		m64.reserve(size);
+		for (i = 0; i < _blocks.size(); i++)
+		{
+			output.insert(output.end(), _blocks[i].data.begin(),
+				_blocks[i].data.end());
+		}
+		for (i = 0; i < _blocks.size(); i++)
+		{
+			for (j = 0; j < _blocks[i].fixups.size(); j++)
 			{
-				ADD(0xFD);
-				ADD_V(total_ticks - last_tick);
+				m64.set_w(starts[i] + _blocks[i].fixups[j].offset,
+					starts[_blocks[i].fixups[j].target] +
+					_blocks[i].fixups[j].target_offset);
 			}
-			ADD(0xFF);
 		}
+		return output;
+	}
+	std::vector<uchar> create_m64()
+	{
+		vector<M64Block> blocks;
+		vector<thread> workers;
+		vector<int> layers;
+		vector<int> channels;
+		atomic<int> next_track;
+		int layer_end;
+		int i;
+
+		// block 0 is the sequence script, followed by the channel script
+		// of each track, the note layers of each track, the subroutines of
+		// the layers and those of the channels; the tracks only refer to
+		// each other through pointers, so they are encoded separately and
+		// linked at the end. The layers, which often repeat each other,
+		// share their subroutines, as do the channels, whose sources are
+		// often cloned; a layer which copies another may use it instead.
+		layer_blocks.clear();
+		layer_end = 1 + tracks.size();
 		for (i = 0; i < tracks.size(); i++)
 		{
-			*((short*)&(m64[note_pointers[i]])) = rev_short(m64.size());
-			j = 0;
-			cur_note_group = 0;
-			prev_duration = 0;
-			while (j < tracks[i].notes.size())
+			layer_blocks.push_back(layer_end);
+			layer_end += tracks[i].voice_count();
+		}
+		blocks.resize(layer_end + 2);
+		find_layer_copies();
+		emit_sequence(blocks[0]);
+		next_track = 0;
+		for (i = 1; (i < thread_count) && (i < tracks.size()); i++)
+		{
+			workers.push_back(thread(&Sequence::emit_tracks, this,
+				&next_track, &blocks));
+		}
+		emit_tracks(&next_track, &blocks);
+		for (i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
+		}
+		share_layer_copies(blocks);
+		if (use_subroutines)
+		{
+			for (i = 1 + tracks.size(); i < layer_end; i++)
 			{
-				if (tracks[i].notes[j].type == NoteType::Rest)
-				{
-					ADD(0xC0);
-					if (j == (tracks[i].notes.size() - 1))
-					{
-						ADD_V(total_ticks - tracks[i].notes[j].ticks);
-					}
-					else
-					{
-						ADD_V(tracks[i].notes[j + 1].ticks -
-							tracks[i].notes[j].ticks);
-					}
-					j += 1;
-				}
-				else if (tracks[i].notes[j].type == NoteType::Note)
+				if (!blocks[i].data.empty())
 				{
-					note = tracks[i].notes[j].note;
-					if (!tracks[i].map_directly)
-					{
-						note_group = cur_note_group;
-						while ((note - (note_group * 64 + NOTE_BIAS)) < 0)
-						{
-							note_group--;
-						}
-						while ((note - (note_group * 64 + NOTE_BIAS)) >= 64)
-						{
-							note_group++;
-						}
-						if (note_group != cur_note_group)
-						{
-							ADD(0xC2);
-							ADD(note_group * 64);
-							cur_note_group = note_group;
-						}
-					}
-
-					if (j == (tracks[i].notes.size() - 1))
-					{
-						next_note_is_rest = false;
-						this_duration = total_ticks - tracks[i].notes[j].ticks;
-					}
-					else
-					{
-						this_duration = tracks[i].notes[j + 1].ticks - 
-							tracks[i].notes[j].ticks;
-						if (j == (tracks[i].notes.size() - 2))
-						{
-							this_and_next_duration = total_ticks - 
-								tracks[i].notes[j].ticks;
-						}
-						else
-						{
-							this_and_next_duration = tracks[i].notes[
-									j + 2
-								].ticks - tracks[i].notes[j].ticks;
-						}
-						if (tracks[i].notes[j + 1].type == NoteType::Rest)
-						{
-							next_note_is_rest = true;
-						}
-						else
-						{
-							next_note_is_rest = false;
-						}
-					}
-					
-					if (next_note_is_rest)
-					{
-						if (this_and_next_duration <= 255)
-						{
-							if (this_and_next_duration == prev_duration)
-							{
-								mode = 3;
-							}
-							else
-							{
-								mode = 1;
-							}
-						}
-						else
-						{
-							mode = 2;
-						}
-					}
-					else
-					{
-						mode = 2;
-					}
-
-					if (tracks[i].map_directly)
-					{
-						note_fmt = note;
-					}
-					else
-					{
-						note_fmt = note - (cur_note_group * 64 + NOTE_BIAS);
-					}
-					switch (mode)
-					{
-					case 1:
-						ADD(note_fmt);
-						ADD_V(this_and_next_duration);
-						prev_duration = this_and_next_duration;
-						note_vel = tracks[i].notes[j].velocity *
-							tracks[i].velocity_multiplier;
-						if (note_vel > 1.0)
-						{
-							note_vel = 1.0;
-						}
-						else if (note_vel < 0.0)
-						{
-							note_vel = 0.0;
-						}
-						ADD(note_vel * 100.0);
-						play_percentage = ((float) (this_and_next_duration - 
-							this_duration)) / 
-								((float) this_and_next_duration) * 255.0;
-						ADD(play_percentage);
-						j += 2;
-						break;
-					case 2:
-						ADD(64 + note_fmt);
-						ADD_V(this_duration);
-						prev_duration = this_duration;
-						note_vel = tracks[i].notes[j].velocity *
-							tracks[i].velocity_multiplier;
-						if (note_vel > 1.0)
-						{
-							note_vel = 1.0;
-						}
-						else if (note_vel < 0.0)
-						{
-							note_vel = 0.0;
-						}
-						ADD(note_vel * 100.0);
-						j += 1;
-						break;
-					case 3:
-						ADD(128 + note_fmt);
-						note_vel = tracks[i].notes[j].velocity *
-							tracks[i].velocity_multiplier;
-						if (note_vel > 1.0)
-						{
-							note_vel = 1.0;
-						}
-						else if (note_vel < 0.0)
-						{
-							note_vel = 0.0;
-						}
-						ADD(note_vel * 100.0);
-						play_percentage = ((float)(this_and_next_duration -
-							this_duration)) /
-							((float)this_and_next_duration) * 255.0;
-						ADD(play_percentage);
-						j += 2;
-					}
+					layers.push_back(i);
 				}
 			}
+			factor_blocks(blocks, layers, layer_end);
+			for (i = 0; i < tracks.size(); i++)
+			{
+				channels.push_back(1 + i);
+			}
+			factor_blocks(blocks, channels, layer_end + 1);
 		}
-		return m64;
+		return link_m64(blocks);
 	}
 	Track& get_track_by_name(const string& _name)
 	{
@@ -1192,10 +2976,22 @@ public:
 	float source_fine_pitch_range; 
 	vector<ControllerSource> sources; 
 	vector<Track> tracks;
+	// for each track, the earlier track it copies, and the block of its
+	// first layer, found by create_m64()
+	vector<LayerCopy> layer_copies;
+	vector<int> layer_blocks;
 	uint32_t ticks_per_quarter; 
 	int total_ticks;
 	unsigned char bank;
 	float volume;
+	int thread_count;
+	bool use_subroutines;
+	// the ticks of the loop markers, or -1 where there are none
+	int loop_start_ticks;
+	int loop_end_ticks;
+	float thinning_tolerance[CONTROLLER_SOURCE_TYPE_N];
+	float simplify_tolerance[CONTROLLER_SOURCE_TYPE_N];
+	vector<QuantizedEvent> tempo_events;
 };
 
 int get_source_index(vector<ControllerSource>& _sources,
@@ -1227,6 +3023,322 @@ int get_source_index(vector<ControllerSource>& _sources,
 }
 
 
+// Builds the tracks and controller sources of a Sequence while the MIDI 
+// file is being parsed, so the file's events are never stored. Note 
+// lengths come from matching each note-off with the most recent open 
+// note-on of the same channel and key. Each track is added to the
+// sequence as soon as it ends, so only the events of the track being
+// read are held. Controller events at or past the end of the song are
+// dropped in finish(), once the end is known.
+class SequenceBuilder : public MidiEventVisitor
+{
+public:
+	SequenceBuilder(Sequence& _seq) : seq(_seq)
+	{
+		first_track = 0;
+		first_source = 0;
+	}
+	void onHeader(int _type, int _tracks, int _ticks_per_quarter)
+	{
+		seq.ticks_per_quarter = _ticks_per_quarter;
+		seq.total_ticks = 0;
+		seq.loop_start_ticks = -1;
+		seq.loop_end_ticks = -1;
+		first_track = seq.tracks.size();
+		first_source = seq.sources.size();
+	}
+	void onTrackStart(int _track)
+	{
+		int i;
+		new_track.clear();
+		cur_sources.clear();
+		pending_notes.clear();
+		pending_ends.clear();
+		for (i = 0; i < 16 * 128; i++)
+		{
+			open_notes[i].clear();
+		}
+	}
+	void onNoteOn(int _track, int _ticks, int _channel, int _key, 
+		int _velocity)
+	{
+		open_notes[_channel * 128 + _key].push_back(pending_notes.size());
+		pending_notes.push_back(
+			NoteEvent(NoteType::Note,
+				_ticks,
+				(float)_velocity / 127.0f,
+				_key)
+			);
+		pending_ends.push_back(-1);
+	}
+	void onNoteOff(int _track, int _ticks, int _channel, int _key, 
+		int _velocity)
+	{
+		vector<int>& open = open_notes[_channel * 128 + _key];
+		if (!open.empty())
+		{
+			pending_ends[open.back()] = _ticks;
+			open.pop_back();
+		}
+	}
+	void onPitchBend(int _track, int _ticks, int _channel, int _value)
+	{
+		int source_index;
+		source_index = get_source_index(cur_sources,
+			_track,
+			ControllerSourceType::FinePitch);
+		cur_sources[source_index].events.push_back(
+			ControllerEvent(_ticks, (float)_value / 16383.0)
+			);
+	}
+	void onController(int _track, int _ticks, int _channel, int _number, 
+		int _value)
+	{
+		int source_index;
+		switch (_number)
+		{
+		case 0x07:
+			source_index = get_source_index(cur_sources,
+				_track,
+				ControllerSourceType::Volume);
+			break;
+		case 0x0A:
+			source_index = get_source_index(cur_sources,
+				_track,
+				ControllerSourceType::Pan);
+			break;
+		default:
+			source_index = get_source_index(cur_sources,
+				_track,
+				ControllerSourceType::Unknown,
+				_number);
+		}
+		cur_sources[source_index].events.push_back(
+			ControllerEvent(_ticks, (float)_value / 127.0f)
+			);
+	}
+	void onMeta(int _track, int _ticks, int _type, const uchar* _data, 
+		int _length)
+	{
+		int source_index;
+		int shift_reg;
+		int i;
+		string marker;
+		switch (_type)
+		{
+		case 0x51:
+			shift_reg = 0;
+			for (i = 0; i < _length; i++)
+			{
+				shift_reg = (shift_reg << 8) | ((int)_data[i]);
+			}
+			shift_reg = (int)((60000000.0 / ((float)shift_reg)) + 0.5);
+			source_index = get_source_index(cur_sources,
+				_track,
+				ControllerSourceType::Tempo);
+			cur_sources[source_index].events.push_back(
+				ControllerEvent(_ticks, (float)shift_reg / 255.0f)
+				);
+			break;
+		case 0x03:
+			new_track.name = "";
+			for (i = 0; i < _length; i++)
+			{
+				new_track.name += _data[i];
+			}
+			break;
+		case 0x06:
+			// "loop start", "loopStart", "Loop_End" and so on; the
+			// first of each is kept
+			for (i = 0; i < _length; i++)
+			{
+				if (isalpha(_data[i]))
+				{
+					marker += tolower(_data[i]);
+				}
+			}
+			if ((marker == "loopstart") && (seq.loop_start_ticks < 0))
+			{
+				seq.loop_start_ticks = _ticks;
+			}
+			else if ((marker == "loopend") && (seq.loop_end_ticks < 0))
+			{
+				seq.loop_end_ticks = _ticks;
+			}
+			break;
+		}
+	}
+	// lays the notes out over as few layers as they need: each note goes
+	// to the free layer whose last note ended latest, so that layers rest
+	// as little as they can, or to a new one. A channel plays VOICE_MAX
+	// layers, so the layers past those spill onto further tracks, named
+	// after this one with their number, which play on channels of their
+	// own with the same instrument and controllers. Each of those gets a
+	// copy of the fine pitch source, as refactor_all_pitch_bends rewrites
+	// the source of a track of one layer.
+	void onTrackEnd(int _track, int _ticks)
+	{
+		vector<vector<NoteEvent> > layers;
+		vector<int> voice_ends;
+		Track spill;
+		int voice;
+		int i;
+		int k;
+		for (i = 0; i < pending_notes.size(); i++)
+		{
+			if (pending_ends[i] < 0)
+			{
+				// never released, so it lasts until the end of the track
+				pending_ends[i] = _ticks;
+			}
+			voice = -1;
+			for (k = 0; k < voice_ends.size(); k++)
+			{
+				if ((voice_ends[k] <= pending_notes[i].ticks) &&
+					((voice < 0) || (voice_ends[k] > voice_ends[voice])))
+				{
+					voice = k;
+				}
+			}
+			if (voice < 0)
+			{
+				voice = voice_ends.size();
+				voice_ends.push_back(0);
+				layers.push_back(vector<NoteEvent>());
+			}
+			if (pending_notes[i].ticks > voice_ends[voice])
+			{
+				layers[voice].push_back(
+					NoteEvent(NoteType::Rest, voice_ends[voice])
+					);
+			}
+			voice_ends[voice] = pending_ends[i];
+			layers[voice].push_back(pending_notes[i]);
+		}
+		for (k = 0; k < voice_ends.size(); k++)
+		{
+			if (_ticks > voice_ends[k])
+			{
+				layers[k].push_back(NoteEvent(NoteType::Rest, voice_ends[k]));
+			}
+		}
+		if (_ticks > seq.total_ticks)
+		{
+			seq.total_ticks = _ticks;
+		}
+		for (i = 0; i < cur_sources.size(); i++)
+		{
+			cur_sources[i].owner_track_name = new_track.name;
+			if (layers.empty())
+			{
+				continue;
+			}
+			switch (cur_sources[i].type)
+			{
+			case ControllerSourceType::FinePitch:
+				new_track.fine_pitch_source = seq.sources.size() + i;
+				break;
+			case ControllerSourceType::Pan:
+				new_track.pan_source = seq.sources.size() + i;
+				break;
+			case ControllerSourceType::Volume:
+				new_track.volume_source = seq.sources.size() + i;
+			}
+		}
+		seq.sources.insert(seq.sources.end(),
+			cur_sources.begin(),
+			cur_sources.end());
+		new_track.instrument = seq.tracks.size();
+		for (i = 0; i < layers.size(); i += VOICE_MAX)
+		{
+			spill = new_track;
+			spill.notes.swap(layers[i]);
+			for (k = i + 1; (k < i + VOICE_MAX) && (k < layers.size()); k++)
+			{
+				spill.voices.push_back(vector<NoteEvent>());
+				spill.voices.back().swap(layers[k]);
+			}
+			if (i > 0)
+			{
+				spill.name += " (" + to_string(1 + i / VOICE_MAX) + ")";
+				if (spill.fine_pitch_source != PARAM_SOURCE_NONE)
+				{
+					seq.sources.push_back(
+						seq.sources[spill.fine_pitch_source]);
+					seq.sources.back().owner_track_name = spill.name;
+					spill.fine_pitch_source = seq.sources.size() - 1;
+				}
+			}
+			seq.tracks.push_back(spill);
+		}
+		// the track's events now live in the sequence
+		new_track.clear();
+		vector<ControllerSource>().swap(cur_sources);
+		vector<NoteEvent>().swap(pending_notes);
+		vector<int>().swap(pending_ends);
+	}
+	// Drops the controller events at or past the end of the song, and the
+	// sources left empty, from what was parsed.
+	void finish()
+	{
+		vector<int> new_index;
+		int kept;
+		int i;
+		new_index.resize(seq.sources.size());
+		kept = first_source;
+		for (i = 0; i < first_source; i++)
+		{
+			new_index[i] = i;
+		}
+		for (i = first_source; i < seq.sources.size(); i++)
+		{
+			vector<ControllerEvent>& events = seq.sources[i].events;
+			while ((!events.empty()) &&
+				(events.back().ticks >= seq.total_ticks))
+			{
+				events.pop_back();
+			}
+			if (events.empty())
+			{
+				new_index[i] = PARAM_SOURCE_NONE;
+				continue;
+			}
+			new_index[i] = kept;
+			if (kept != i)
+			{
+				seq.sources[kept] = seq.sources[i];
+			}
+			kept++;
+		}
+		seq.sources.resize(kept);
+		for (i = first_track; i < seq.tracks.size(); i++)
+		{
+			renumber_source(seq.tracks[i].fine_pitch_source, new_index);
+			renumber_source(seq.tracks[i].pan_source, new_index);
+			renumber_source(seq.tracks[i].volume_source, new_index);
+		}
+	}
+private:
+	// points _source, one of the sources given to a track above, at
+	// where finish() moved it
+	void renumber_source(int& _source, vector<int>& _new_index)
+	{
+		if (_source != PARAM_SOURCE_NONE)
+		{
+			_source = _new_index[_source];
+		}
+	}
+	Sequence& seq;
+	Track new_track;
+	vector<ControllerSource> cur_sources;
+	vector<NoteEvent> pending_notes;
+	vector<int> pending_ends;
+	vector<int> open_notes[16 * 128];
+	int first_track;
+	int first_source;
+};
+
+
 
 void press_enter_to_continue()
 {
@@ -1239,17 +3351,9 @@ int main(int _argc, char** _argv)
 {
 	string filename;
 	string out_filename;
-	int cur_track;
-	int cur_event;
 	int i;
 	Sequence seq;
-	Track new_track;
-	int ticks;
-	int source_index;
-	int shift_reg;
-	int last_note_ending_ticks;
-	vector<ControllerSource> cur_sources;
-	size_t previous_size;
+	SequenceBuilder builder(seq);
 	vector<uchar> m64;
 	fstream output;
 	MidiFile midifile;
@@ -1259,6 +3363,10 @@ int main(int _argc, char** _argv)
 #endif
 
 #ifdef _NDEBUG
+	options.define("thin=d:1.0",
+		"scales the thinning tolerance of each controller type; 0 is off");
+	options.define("simplify=d:1.0",
+		"scales the simplify tolerance of each controller type; 0 is off");
 	options.process(_argc, _argv);
 	if (options.getArgCount() != 1) 
 	{
@@ -1266,167 +3374,23 @@ int main(int _argc, char** _argv)
 		return 1;
 	}
 	filename = options.getArg(1);
+	for (i = 0; i < CONTROLLER_SOURCE_TYPE_N; i++)
+	{
+		seq.thinning_tolerance[i] *= options.getDouble("thin");
+		seq.simplify_tolerance[i] *= options.getDouble("simplify");
+	}
 #else
 	filename = DEBUG_MIDI_FILE;
 #endif
 
-	midifile.read(filename);
+	midifile.parse(filename, builder);
 	if (!midifile.status())
 	{
 		cerr << "Error reading MIDI file " << filename << endl;
 		return 1;
 	}
+	builder.finish();
 
-	midifile.linkNotePairs();
-	midifile.absoluteTicks();
-	midifile.sortTracks();
-	seq.ticks_per_quarter = midifile.getTicksPerQuarterNote();
-	seq.total_ticks = midifile.getTotalTimeInTicks();
-
-	for (cur_track = 0; cur_track < midifile.getNumTracks(); cur_track++)
-	{
-		new_track.clear();
-		cur_sources.clear();
-		last_note_ending_ticks = 0;
-		for (cur_event = 0;
-			cur_event < midifile[cur_track].getSize();
-			cur_event++)
-		{
-			ticks = midifile[cur_track][cur_event].tick;
-			switch (midifile[cur_track][cur_event][0] & 0xF0)
-			{
-			case 0xE0:
-				if (ticks < seq.total_ticks)
-				{
-					source_index =
-						get_source_index(cur_sources,
-							cur_track,
-							ControllerSourceType::FinePitch);
-					shift_reg = (((int)midifile[cur_track][cur_event][1]) |
-						((int)midifile[cur_track][cur_event][2]) << 7);
-					cur_sources[source_index].events.push_back(
-						ControllerEvent(ticks, (float)shift_reg / 16383.0)
-						);
-				}
-				break;
-			case 0xB0:
-				if (ticks < seq.total_ticks)
-				{
-					switch (midifile[cur_track][cur_event][1])
-					{
-					case 0x07:
-						source_index = get_source_index(cur_sources,
-							cur_track,
-							ControllerSourceType::Volume);
-						break;
-					case 0x0A:
-						source_index = get_source_index(cur_sources,
-							cur_track,
-							ControllerSourceType::Pan);
-						break;
-					default:
-						source_index = get_source_index(cur_sources,
-							cur_track,
-							ControllerSourceType::Unknown,
-							midifile[cur_track][cur_event][1]);
-					}
-					cur_sources[source_index].events.push_back(
-						ControllerEvent(ticks,
-							(float)midifile[cur_track][cur_event][2] / 127.0f)
-						);
-				}
-				break;
-			case 0xF0:
-				switch(midifile[cur_track][cur_event][1])
-				{
-				case 0x51:
-					if (ticks < seq.total_ticks)
-					{
-						shift_reg = 0;
-						for (i = 0;
-						i < (int)midifile[cur_track][cur_event][2];
-							i++)
-						{
-							shift_reg = (shift_reg << 8) |
-								((int)midifile[cur_track][cur_event][3 + i]);
-						}
-						shift_reg = (int)
-							((60000000.0 / ((float)shift_reg)) + 0.5);
-						source_index = get_source_index(cur_sources,
-							cur_track,
-							ControllerSourceType::Tempo);
-						cur_sources[source_index].events.push_back(
-							ControllerEvent(ticks, (float)shift_reg / 255.0f)
-							);
-					}
-					break;
-				case 0x03:
-					new_track.name = "";
-					for (i = 0;
-						i < (int)midifile[cur_track][cur_event][2];
-						i++)
-					{
-						new_track.name += 
-							midifile[cur_track][cur_event][3 + i];
-					}
-					break;
-				case 0x2F:
-					if ((!new_track.notes.empty()) &&
-						(ticks > last_note_ending_ticks))
-					{
-						new_track.notes.push_back(
-							NoteEvent(NoteType::Rest, last_note_ending_ticks)
-							);
-					}
-				}
-				break;
-			case 0x90:
-				if (ticks > last_note_ending_ticks)
-				{
-					new_track.notes.push_back(
-						NoteEvent(NoteType::Rest,
-							last_note_ending_ticks)
-						);
-				}
-				last_note_ending_ticks =
-					midifile[cur_track][cur_event].getLinkedEvent()->tick;
-				new_track.notes.push_back(
-					NoteEvent(NoteType::Note,
-						ticks,
-						(float)midifile[cur_track][cur_event][2] / 127.0f,
-						midifile[cur_track][cur_event][1])
-					);
-				break;
-			}
-		}
-		previous_size = seq.sources.size();
-		for (i = 0; i < cur_sources.size(); i++)
-		{
-			cur_sources[i].owner_track_name = new_track.name;
-		}
-		seq.sources.insert(seq.sources.end(), 
-			cur_sources.begin(), 
-			cur_sources.end());
-		if (!new_track.notes.empty())
-		{
-			for (i = previous_size; i < seq.sources.size(); i++)
-			{
-				switch (seq.sources[i].type)
-				{
-				case ControllerSourceType::FinePitch:
-					new_track.fine_pitch_source = i;
-					break;
-				case ControllerSourceType::Pan:
-					new_track.pan_source = i;
-					break;
-				case ControllerSourceType::Volume:
-					new_track.volume_source = i;
-				}
-			}
-			new_track.instrument = seq.tracks.size();
-			seq.tracks.push_back(new_track);
-		}
-	}
 	for (i = 0; i < seq.sources.size(); i++)
 	{
 		if (seq.sources[i].type == ControllerSourceType::Tempo)
@@ -1452,6 +3416,7 @@ int main(int _argc, char** _argv)
 		}
 	}
 	seq.convert_clock_base();
+	seq.cut_loop();
 	seq.trim_events();
 
 
@@ -1560,8 +3525,12 @@ int main(int _argc, char** _argv)
 	seq.source_fine_pitch_range = 48;
 	*/
 
+	seq.thread_count = thread::hardware_concurrency();
 	seq.refactor_all_pitch_bends();
+	seq.thin_sources();
+	seq.quantize_sources();
 	seq.optimize_all();
+	seq.simplify_sources();
 	
 	m64.clear();
 	m64 = seq.create_m64();
@@ -0,0 +1,48 @@
+//
+// Filename:      midifile/include/MidiEventArena.h
+// Syntax:        C++11
+// vim:           ts=3 expandtab
+//
+// Description:   A block allocator which owns the MidiEvents of a
+//                MidiFile.  Events are placement-constructed into large
+//                blocks and are all destroyed together by reset(),
+//                rather than being allocated and freed one at a time.
+//
+
+#ifndef _MIDIEVENTARENA_H_INCLUDED
+#define _MIDIEVENTARENA_H_INCLUDED
+
+#include "MidiEvent.h"
+#include <vector>
+
+using namespace std;
+
+class MidiEventArena {
+   public:
+                  MidiEventArena   (void);
+                 ~MidiEventArena   ();
+
+      MidiEvent*  allocate         (void);
+      MidiEvent*  allocate         (const MidiEvent& event);
+      void        reset            (void);
+      void        adopt            (MidiEventArena& other);
+      int         getSize          (void) const;
+
+   private:
+                  MidiEventArena   (const MidiEventArena& other);
+      MidiEventArena& operator=    (const MidiEventArena& other);
+
+      void*       nextSlot         (void);
+
+      enum { BLOCK_EVENTS = 4096 };   // events per storage block
+
+      vector<MidiEvent*>  blocks;     // raw storage, BLOCK_EVENTS each
+      vector<int>         counts;     // constructed events in each block
+      int                 current;    // index of block being filled
+};
+
+
+#endif /* _MIDIEVENTARENA_H_INCLUDED */
+
+
+
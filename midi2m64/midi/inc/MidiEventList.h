@@ -14,6 +14,7 @@
 #define _MIDIEVENTLIST_H_INCLUDED
 
 #include "MidiEvent.h"
+#include "MidiEventArena.h"
 #include <vector>
 
 using namespace std;
@@ -21,6 +22,7 @@ using namespace std;
 class MidiEventList {
    public:
                   MidiEventList    (void);
+                  MidiEventList    (MidiEventArena* anArena);
 
                  ~MidiEventList    ();
 
@@ -48,11 +50,14 @@ class MidiEventList {
       // careful when using these, intended for internal use in MidiFile class:
       void        detach              (void);
       int         push_back_no_copy   (MidiEvent* event);
+      MidiEvent*  newEvent            (void);
+      MidiEventArena* getArena        (void);
 
       MidiEventList& operator=(MidiEventList other);
 
    private:
       vector<MidiEvent*>     list;
+      MidiEventArena*        arena;   // owner of events, or NULL if heap
 
 };
 
@@ -0,0 +1,62 @@
+//
+// Filename:      midifile/include/MidiEventVisitor.h
+// Syntax:        C++11
+// vim:           ts=3 expandtab
+//
+// Description:   Callback interface for MidiFile::parse(), which decodes
+//                a Standard MIDI File and reports each message as it is
+//                read instead of storing it in a MidiEventList.  Ticks
+//                are absolute within the track.  All callbacks default
+//                to doing nothing, so a visitor only needs to override
+//                the messages it is interested in.
+//
+
+#ifndef _MIDIEVENTVISITOR_H_INCLUDED
+#define _MIDIEVENTVISITOR_H_INCLUDED
+
+typedef unsigned char  uchar;
+
+class MidiEventVisitor {
+   public:
+      virtual            ~MidiEventVisitor () { }
+
+      // file and track boundaries; onTrackEnd() is given the tick of the
+      // end-of-track meta message:
+      virtual void        onHeader        (int /*type*/, int /*tracks*/,
+                                           int /*tpq*/) { }
+      virtual void        onTrackStart    (int /*track*/) { }
+      virtual void        onTrackEnd      (int /*track*/, int /*tick*/) { }
+
+      // channel messages.  A note-on with a velocity of 0 is reported as
+      // a note-off, and the pitch-bend value is the 14-bit wheel position:
+      virtual void        onNoteOn        (int /*track*/, int /*tick*/,
+                                           int /*channel*/, int /*key*/,
+                                           int /*velocity*/) { }
+      virtual void        onNoteOff       (int /*track*/, int /*tick*/,
+                                           int /*channel*/, int /*key*/,
+                                           int /*velocity*/) { }
+      virtual void        onController    (int /*track*/, int /*tick*/,
+                                           int /*channel*/, int /*number*/,
+                                           int /*value*/) { }
+      virtual void        onPitchBend     (int /*track*/, int /*tick*/,
+                                           int /*channel*/, int /*value*/) { }
+
+      // meta messages other than end-of-track; data points to the bytes
+      // after the length byte and is only valid during the call:
+      virtual void        onMeta          (int /*track*/, int /*tick*/,
+                                           int /*type*/,
+                                           const uchar* /*data*/,
+                                           int /*length*/) { }
+
+      // all other messages (patch change, aftertouch, sysex), with the
+      // bytes as they would be stored in a MidiMessage:
+      virtual void        onMessage       (int /*track*/, int /*tick*/,
+                                           const uchar* /*bytes*/,
+                                           int /*length*/) { }
+};
+
+
+#endif /* _MIDIEVENTVISITOR_H_INCLUDED */
+
+
+
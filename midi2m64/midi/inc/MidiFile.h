@@ -28,9 +28,11 @@
 #define _MIDIFILE_H_INCLUDED
 
 #include "MidiEventList.h"
+#include "MidiEventVisitor.h"
 
 #include <vector>
 #include <istream>
+#include <stdint.h>
 #include <fstream>
 
 using namespace std;
@@ -41,10 +43,21 @@ using namespace std;
 #define TRACK_STATE_SPLIT      0
 #define TRACK_STATE_JOINED     1
 
-class _TickTime {
+// A span of constant tempo in the time map: the tick at which it starts,
+// the time in seconds at that tick, and the tempo until the next span.
+class _TempoSegment {
    public:
       int    tick;
       double seconds;
+      double secondsPerTick;
+};
+
+// Packed ordering key for sorting: tick, then seq, then the event class
+// (see MidiFile::getSortClass) in the low three bits.
+class _SortKey {
+   public:
+      uint64_t   key;
+      MidiEvent* event;
 };
 
 
@@ -62,6 +75,15 @@ class MidiFile {
       int       read                      (const char* aFile);
       int       read                      (const string& aFile);
       int       read                      (istream& istream);
+      int       read                      (const uchar* data, int length);
+      int       parse                     (const char* aFile,
+                                           MidiEventVisitor& visitor);
+      int       parse                     (const string& aFile,
+                                           MidiEventVisitor& visitor);
+      int       parse                     (const uchar* data, int length,
+                                           MidiEventVisitor& visitor);
+      void      setThreadCount            (int count);
+      int       getThreadCount            (void);
       int       write                     (const char* aFile);
       int       write                     (const string& aFile);
       int       write                     (ostream& out);
@@ -217,6 +239,7 @@ class MidiFile {
 
    protected:
       vector<MidiEventList*> events;             // MIDI file events
+      MidiEventArena*  arena;                    // storage for the events
       int              ticksPerQuarterNote;      // time base of file
       int              trackCount;               // # of tracks in file
       int              theTrackState;            // joined or split
@@ -224,21 +247,47 @@ class MidiFile {
       vector<char>     readFileName;             // read file name
 
       int               timemapvalid;
-      vector<_TickTime> timemap;
+      vector<_TempoSegment> timemap;             // tempo spans by start tick
+      int               timemapend;              // last event tick in map
       int               rwstatus;                // read/write success flag
+      int               threadCount;             // threads for per-track work
 
    private:
-      int        extractMidiData  (istream& inputfile, vector<uchar>& array,
-                                       uchar& runningCommand);
-      ulong      readVLValue      (istream& inputfile);
-      ulong      unpackVLV        (uchar a, uchar b, uchar c, uchar d, uchar e);
-      void       writeVLValue     (long aValue, vector<uchar>& data);
+      int        readHeader       (const uchar*& ptr, const uchar* end,
+                                   int& type, int& tracks, int& tpq);
+      static void visitMessage    (MidiEventVisitor& visitor, int track,
+                                   int tick, const vector<uchar>& bytes);
+      int        readTrack        (const uchar*& ptr, const uchar* end,
+                                   MidiEventList& track, int index,
+                                   MidiEventArena& storage, int quiet = 0);
+      int        readTracksParallel (const uchar*& ptr, const uchar* end,
+                                   int tracks);
+      int        extractMidiData  (const uchar*& ptr, const uchar* end,
+                                   vector<uchar>& array,
+                                   uchar& runningCommand, int quiet = 0);
+      int        readVLValue      (const uchar*& ptr, const uchar* end,
+                                   ulong& value, int quiet = 0);
+      static int readChunkTag     (const uchar*& ptr, const uchar* end,
+                                   const char* tag, const char* where,
+                                   const char* filename);
+      static int readBigEndian4Bytes (const uchar*& ptr, const uchar* end,
+                                   ulong& value);
+      static int readBigEndian2Bytes (const uchar*& ptr, const uchar* end,
+                                   ushort& value);
+      ulong      getTrackWriteSize (int track);
+      uchar*     writeTrackData   (int track, uchar* ptr);
+      static uchar* writeVLValue  (long aValue, uchar* ptr);
+      static int getVLValueSize   (long aValue);
+      static uchar* writeBigEndian4Bytes (uchar* ptr, ulong value);
+      static uchar* writeBigEndian2Bytes (uchar* ptr, ushort value);
       int        makeVLV          (uchar *buffer, int number);
-      static int ticksearch       (const void* A, const void* B);
-      static int secondsearch     (const void* A, const void* B);
+      int        mergeTracksByKey (MidiEventList& output);
+      static int getSortClass     (const MidiEvent& event);
+      static int getSortKeyShift  (int maxtick, int maxseq);
+      static int sortByKey        (MidiEvent** list, int count, int shift);
       void       buildTimeMap     (void);
-      int        linearTickInterpolationAtSecond  (double seconds);
-      double     linearSecondInterpolationAtTick  (int ticktime);
+      void       fillEventSeconds (void);
+      int        findTempoSegment (int tick);
 };
 
 
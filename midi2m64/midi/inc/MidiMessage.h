@@ -8,7 +8,9 @@
 // vim:           ts=3 expandtab
 //
 // Description:   Storage for bytes of a MIDI message for use in MidiFile
-//                class.
+//                class.  Messages of up to eight bytes (all channel
+//                messages and most meta messages) are stored inline;
+//                longer meta and sysex data is moved to the heap.
 //
 
 #ifndef _MIDIMESSAGE_H_INCLUDED
@@ -23,7 +25,7 @@ typedef unsigned char  uchar;
 typedef unsigned short ushort;
 typedef unsigned long  ulong;
 
-class MidiMessage : public vector<uchar> {
+class MidiMessage {
 	public:
 		               MidiMessage          (void);
 		               MidiMessage          (int command);
@@ -42,6 +44,24 @@ class MidiMessage : public vector<uchar> {
       MidiMessage&   operator=            (const vector<int>& bytes);
       void           setSize              (int asize);
       int            getSize              (void) const;
+
+      // byte access (same usage as the vector<uchar> previously inherited):
+      int            size                 (void) const;
+      int            empty                (void) const;
+      void           resize               (int asize);
+      void           reserve              (int asize);
+      void           clear                (void);
+      void           push_back            (uchar value);
+      uchar&         operator[]           (int index);
+      const uchar&   operator[]           (int index) const;
+      uchar&         back                 (void);
+      uchar*         data                 (void);
+      const uchar*   data                 (void) const;
+      uchar*         begin                (void);
+      const uchar*   begin                (void) const;
+      uchar*         end                  (void);
+      const uchar*   end                  (void) const;
+
       int            setSizeToCommand     (void);
       int            resizeToCommand      (void);
 
@@ -128,6 +148,17 @@ class MidiMessage : public vector<uchar> {
       void           setMetaTempo         (double tempo);
       int            isEndOfTrack         (void) const;
 
+   private:
+      void           grow                 (size_t newcapacity);
+
+      enum { INLINE_BYTES = 8 };           // largest message stored inline
+
+      union {
+         uchar       local[INLINE_BYTES];  // bytes when capacity is inline
+         uchar*      heap;                 // bytes when capacity is larger
+      } storage;
+      int            count;                // number of bytes in message
+      int            capacity;             // INLINE_BYTES or heap size
 };
 
 
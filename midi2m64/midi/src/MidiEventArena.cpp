@@ -0,0 +1,157 @@
+//
+// Filename:      midifile/src-library/MidiEventArena.cpp
+// Syntax:        C++11
+// vim:           ts=3 expandtab
+//
+// Description:   A block allocator which owns the MidiEvents of a
+//                MidiFile.  Events are placement-constructed into large
+//                blocks and are all destroyed together by reset(),
+//                rather than being allocated and freed one at a time.
+//
+
+#include "MidiEventArena.h"
+
+#include <new>
+
+using namespace std;
+
+
+//////////////////////////////
+//
+// MidiEventArena::MidiEventArena -- Constructor.  No storage is
+//    allocated until the first event is requested.
+//
+
+MidiEventArena::MidiEventArena(void) {
+   current = 0;
+}
+
+
+
+//////////////////////////////
+//
+// MidiEventArena::~MidiEventArena -- Deconstructor.  Destroy all stored
+//    events and release the storage blocks.
+//
+
+MidiEventArena::~MidiEventArena() {
+   reset();
+   for (int i=0; i<(int)blocks.size(); i++) {
+      ::operator delete(blocks[i]);
+      blocks[i] = NULL;
+   }
+   blocks.resize(0);
+   counts.resize(0);
+}
+
+
+
+//////////////////////////////
+//
+// MidiEventArena::allocate -- Construct a new event in the arena and
+//    return a pointer to it.  The arena keeps ownership of the event,
+//    so it must not be deleted by the caller.
+//
+
+MidiEvent* MidiEventArena::allocate(void) {
+   MidiEvent* event = new (nextSlot()) MidiEvent;
+   counts[current]++;
+   return event;
+}
+
+
+MidiEvent* MidiEventArena::allocate(const MidiEvent& event) {
+   MidiEvent* copy = new (nextSlot()) MidiEvent(event);
+   counts[current]++;
+   return copy;
+}
+
+
+
+//////////////////////////////
+//
+// MidiEventArena::reset -- Destroy every event allocated from the arena.
+//    The storage blocks are kept for reuse by later allocations.
+//
+
+void MidiEventArena::reset(void) {
+   for (int i=0; i<(int)blocks.size(); i++) {
+      for (int j=0; j<counts[i]; j++) {
+         blocks[i][j].~MidiEvent();
+      }
+      counts[i] = 0;
+   }
+   current = 0;
+}
+
+
+
+//////////////////////////////
+//
+// MidiEventArena::adopt -- Take ownership of all events and storage of
+//    another arena, which is left empty.  Used to gather the events
+//    decoded by separate threads into the arena of a MidiFile.  The
+//    adopted blocks are placed before the block being filled, so they
+//    are not allocated into again until the next reset().
+//
+
+void MidiEventArena::adopt(MidiEventArena& other) {
+   if (&other == this) {
+      return;
+   }
+   blocks.insert(blocks.begin() + current, other.blocks.begin(),
+         other.blocks.end());
+   counts.insert(counts.begin() + current, other.counts.begin(),
+         other.counts.end());
+   current += (int)other.blocks.size();
+   other.blocks.resize(0);
+   other.counts.resize(0);
+   other.current = 0;
+}
+
+
+
+//////////////////////////////
+//
+// MidiEventArena::getSize -- Return the number of events currently
+//    allocated from the arena.
+//
+
+int MidiEventArena::getSize(void) const {
+   int sum = 0;
+   for (int i=0; i<(int)counts.size(); i++) {
+      sum += counts[i];
+   }
+   return sum;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// private functions
+//
+
+
+//////////////////////////////
+//
+// MidiEventArena::nextSlot -- Return the storage for the next event,
+//    moving on to a new block when the current one is full.  The slot
+//    is only counted as used once the event has been constructed in it.
+//
+
+void* MidiEventArena::nextSlot(void) {
+   while ((current < (int)blocks.size()) &&
+         (counts[current] >= BLOCK_EVENTS)) {
+      current++;
+   }
+   if (current >= (int)blocks.size()) {
+      blocks.push_back(static_cast<MidiEvent*>(
+            ::operator new(BLOCK_EVENTS * sizeof(MidiEvent))));
+      counts.push_back(0);
+      current = (int)blocks.size() - 1;
+   }
+   return blocks[current] + counts[current];
+}
+
+
+
@@ -24,10 +24,18 @@ using namespace std;
 
 //////////////////////////////
 //
-// MidiEventList::MidiEventList -- Constructor.
+// MidiEventList::MidiEventList -- Constructor.  When an arena is given,
+//    events are allocated from it and owned by it rather than by the list.
 //
 
 MidiEventList::MidiEventList(void) {
+   arena = NULL;
+   reserve(1000);
+}
+
+
+MidiEventList::MidiEventList(MidiEventArena* anArena) {
+   arena = anArena;
    reserve(1000);
 }
 
@@ -39,6 +47,7 @@ MidiEventList::MidiEventList(void) {
 //
 
 MidiEventList::MidiEventList(const MidiEventList& other) {
+   arena = NULL;
    list.reserve(other.list.size());
    auto it = other.list.begin();
    std::generate_n(std::back_inserter(list), other.list.size(), [&]() -> MidiEvent* {
@@ -51,11 +60,15 @@ MidiEventList::MidiEventList(const MidiEventList& other) {
 //////////////////////////////
 //
 // MidiEventList::MidiEventList(MidiEventList&&) -- Move constructor.
+//    The moved-from list is left empty and owns any events added to it
+//    later itself, so clearing it never touches the arena.
 //
 
 MidiEventList::MidiEventList(MidiEventList&& other) {
     list = std::move(other.list);
     other.list.clear();
+    arena = other.arena;
+    other.arena = NULL;
 }
 
 
@@ -120,10 +133,15 @@ MidiEvent& MidiEventList::getEvent(int index) {
 //////////////////////////////
 //
 // MidiEventList::clear -- De-allocate any MidiEvents present in the list
-//    and set the size of the list to 0.
+//    and set the size of the list to 0.  Events owned by an arena are
+//    left for the arena to destroy when it is reset.
 //
 
 void MidiEventList::clear(void) {
+   if (arena != NULL) {
+      list.resize(0);
+      return;
+   }
    for (int i=0; i<(int)list.size(); i++) {
       if (list[i] != NULL) {
          delete list[i];
@@ -182,7 +200,12 @@ int MidiEventList::size(void) const {
 //
 
 int MidiEventList::append(MidiEvent& event) {
-   MidiEvent* ptr = new MidiEvent(event);
+   MidiEvent* ptr;
+   if (arena != NULL) {
+      ptr = arena->allocate(event);
+   } else {
+      ptr = new MidiEvent(event);
+   }
    list.push_back(ptr);
    return (int)list.size()-1;
 }
@@ -217,16 +240,14 @@ int MidiEventList::linkEventPairs(void) {
 
 int MidiEventList::linkNotePairs(void) {
 
-   // Note-on states:
-   // dimension 1: MIDI channel (0-15)
-   // dimension 2: MIDI key     (0-127)  (but 0 not used for note-ons)
-   // dimension 3: List of active note-ons or note-offs.
-   vector<vector<vector<MidiEvent*> > > noteons;
-   noteons.resize(16);
-   int i;
-   for (i=0; i<(int)noteons.size(); i++) {
-      noteons[i].resize(128);
-   }
+   // Note-on states: for each MIDI channel (0-15) and key (0-127), a stack
+   // of active note-ons.  The stacks are threaded through the event list:
+   // noteons[] holds the list index of the latest active note-on for a
+   // channel/key (or -1), and below[] the index of the note-on which was
+   // active before it.
+   int noteons[16 * 128];
+   fill(noteons, noteons + 16 * 128, -1);
+   vector<int> below(getSize());
 
    // Controller linking: The following General MIDI controller numbers are
    // also monitored for linking within the track (but not between tracks).
@@ -250,46 +271,32 @@ int MidiEventList::linkNotePairs(void) {
    // 5A  90   Undefined on/off                        0..63=off  64..127=on
    // 7A 122   Local Keyboard On/Off                   0..63=off  64..127=on
 
-   // first keep track of whether the controller is an on/off switch:
-   vector<pair<int, int> > contmap;
-   contmap.resize(128);
-   pair<int, int> zero(0, 0);
-   fill(contmap.begin(), contmap.end(), zero);
-   contmap[64].first  = 1;   contmap[64].second = 0;
-   contmap[65].first  = 1;   contmap[65].second = 1;
-   contmap[66].first  = 1;   contmap[66].second = 2;
-   contmap[67].first  = 1;   contmap[67].second = 3;
-   contmap[68].first  = 1;   contmap[68].second = 4;
-   contmap[69].first  = 1;   contmap[69].second = 5;
-   contmap[80].first  = 1;   contmap[80].second = 6;
-   contmap[81].first  = 1;   contmap[81].second = 7;
-   contmap[82].first  = 1;   contmap[82].second = 8;
-   contmap[83].first  = 1;   contmap[83].second = 9;
-   contmap[84].first  = 1;   contmap[84].second = 10;
-   contmap[85].first  = 1;   contmap[85].second = 11;
-   contmap[86].first  = 1;   contmap[86].second = 12;
-   contmap[87].first  = 1;   contmap[87].second = 13;
-   contmap[88].first  = 1;   contmap[88].second = 14;
-   contmap[89].first  = 1;   contmap[89].second = 15;
-   contmap[90].first  = 1;   contmap[90].second = 16;
-   contmap[122].first = 1;   contmap[122].second = 17;
+   // index of each on/off switch controller in the state tables below,
+   // or -1 for other controllers:
+   static const signed char contmap[128] = {
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+       0,  1,  2,  3,  4,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+       6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 17, -1, -1, -1, -1, -1
+   };
 
    // dimensions:
    // 1: mapped controller (0 to 17)
    // 2: channel (0 to 15)
-   vector<vector<MidiEvent*> > contevents;
-   contevents.resize(18);
-   vector<vector<int> > oldstates;
-   oldstates.resize(18);
+   MidiEvent* contevents[18][16];
+   int oldstates[18][16];
    for (int i=0; i<18; i++) {
-      contevents[i].resize(16);
-      fill(contevents[i].begin(), contevents[i].end(), nullptr);
-      oldstates[i].resize(16);
-      fill(oldstates[i].begin(), oldstates[i].end(), -1);
+      fill(contevents[i], contevents[i] + 16, (MidiEvent*)NULL);
+      fill(oldstates[i], oldstates[i] + 16, -1);
    }
 
    // Now iterate through the MidiEventList keeping track of note and
    // select controller states and linking notes/controllers as needed.
+   int i;
    int channel;
    int key;
    int contnum;
@@ -297,8 +304,8 @@ int MidiEventList::linkNotePairs(void) {
    int conti;
    int contstate;
    int counter = 0;
+   int top;
    MidiEvent* mev;
-   MidiEvent* noteon;
    for (i=0; i<getSize(); i++) {
       mev = &getEvent(i);
       mev->unlinkEvent();
@@ -306,20 +313,21 @@ int MidiEventList::linkNotePairs(void) {
          // store the note-on to pair later with a note-off message.
          key = mev->getKeyNumber();
          channel = mev->getChannel();
-         noteons[channel][key].push_back(mev);
+         below[i] = noteons[channel * 128 + key];
+         noteons[channel * 128 + key] = i;
       } else if (mev->isNoteOff()) {
          key = mev->getKeyNumber();
          channel = mev->getChannel();
-         if (noteons[channel][key].size() > 0) {
-            noteon = noteons[channel][key].back();
-            noteons[channel][key].pop_back();
-            noteon->linkEvent(mev);
+         top = noteons[channel * 128 + key];
+         if (top >= 0) {
+            noteons[channel * 128 + key] = below[top];
+            getEvent(top).linkEvent(mev);
             counter++;
          }
       } else if (mev->isController()) {
          contnum = mev->getP1();
-         if (contmap[contnum].first) {
-            conti     = contmap[contnum].second;
+         if (contmap[contnum] >= 0) {
+            conti     = contmap[contnum];
             channel   = mev->getChannel();
             contval   = mev->getP2();
             contstate = contval < 64 ? 0 : 1;
@@ -395,6 +403,34 @@ int MidiEventList::push_back_no_copy(MidiEvent* event) {
 
 
 
+//////////////////////////////
+//
+// MidiEventList::newEvent -- Allocate an empty event with the same
+//     ownership as the events in the list, for passing to
+//     push_back_no_copy().
+//
+
+MidiEvent* MidiEventList::newEvent(void) {
+   if (arena != NULL) {
+      return arena->allocate();
+   }
+   return new MidiEvent;
+}
+
+
+
+//////////////////////////////
+//
+// MidiEventList::getArena -- Return the arena which owns the events
+//     in the list, or NULL if they are individually heap allocated.
+//
+
+MidiEventArena* MidiEventList::getArena(void) {
+   return arena;
+}
+
+
+
 //////////////////////////////
 //
 // MidiEventList::operator=(MidiEventList) -- Assignment.
@@ -402,6 +438,7 @@ int MidiEventList::push_back_no_copy(MidiEvent* event) {
 
 MidiEventList& MidiEventList::operator=(MidiEventList other) {
    list.swap(other.list);
+   std::swap(arena, other.arena);
    return *this;
 }
 
@@ -38,10 +38,129 @@
 #include <sstream>
 #include <algorithm>
 #include <iterator>
+#include <functional>
+#include <thread>
+#include <atomic>
+
+#ifdef _WIN32
+   #define WIN32_LEAN_AND_MEAN
+   #define NOMINMAX
+   #include <windows.h>
+#else
+   #include <fcntl.h>
+   #include <unistd.h>
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+#endif
 
 using namespace std;
 
 
+//////////////////////////////
+//
+// MappedMidiFile -- Read-only memory mapping of a file on disk, used
+//     by MidiFile::read() so that the file contents are decoded in place
+//     instead of being copied through an input stream.
+//
+
+class MappedMidiFile {
+   public:
+      MappedMidiFile(void) {
+         data = NULL;
+         size = 0;
+#ifdef _WIN32
+         mapping = NULL;
+#endif
+      }
+
+     ~MappedMidiFile() {
+         close();
+      }
+
+      int open(const char* filename) {
+         close();
+#ifdef _WIN32
+         HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ,
+               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+         if (file == INVALID_HANDLE_VALUE) {
+            return 0;
+         }
+         LARGE_INTEGER filesize;
+         if (!GetFileSizeEx(file, &filesize) || (filesize.HighPart != 0) ||
+               (filesize.LowPart > 0x7fffffff)) {
+            CloseHandle(file);
+            return 0;
+         }
+         size = (int)filesize.LowPart;
+         if (size > 0) {
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0,
+                  NULL);
+            if (mapping != NULL) {
+               data = (const uchar*)MapViewOfFile(mapping, FILE_MAP_READ,
+                     0, 0, 0);
+            }
+            if (data == NULL) {
+               close();
+               CloseHandle(file);
+               return 0;
+            }
+         }
+         CloseHandle(file);
+#else
+         int file = ::open(filename, O_RDONLY);
+         if (file < 0) {
+            return 0;
+         }
+         struct stat info;
+         if ((fstat(file, &info) != 0) || (info.st_size > 0x7fffffff)) {
+            ::close(file);
+            return 0;
+         }
+         size = (int)info.st_size;
+         if (size > 0) {
+            void* view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (view == MAP_FAILED) {
+               size = 0;
+               ::close(file);
+               return 0;
+            }
+            data = (const uchar*)view;
+         }
+         ::close(file);
+#endif
+         return 1;
+      }
+
+      void close(void) {
+#ifdef _WIN32
+         if (data != NULL) {
+            UnmapViewOfFile(data);
+         }
+         if (mapping != NULL) {
+            CloseHandle(mapping);
+            mapping = NULL;
+         }
+#else
+         if (data != NULL) {
+            munmap((void*)data, size);
+         }
+#endif
+         data = NULL;
+         size = 0;
+      }
+
+      const uchar* getData(void) const { return data; }
+      int          getSize(void) const { return size; }
+
+   private:
+      const uchar* data;
+      int          size;
+#ifdef _WIN32
+      HANDLE       mapping;
+#endif
+};
+
+
 //////////////////////////////
 //
 // MidiFile::MidiFile -- Constuctor.
@@ -52,13 +171,16 @@ MidiFile::MidiFile(void) {
    trackCount = 1;                       // # of tracks in file
    theTrackState = TRACK_STATE_SPLIT;    // joined or split
    theTimeState = TIME_STATE_ABSOLUTE;   // absolute or delta
+   arena = new MidiEventArena;
    events.resize(1);
-   events[0] = new MidiEventList;
+   events[0] = new MidiEventList(arena);
    readFileName.resize(1);
    readFileName[0] = '\0';
    timemap.clear();
    timemapvalid = 0;
+   timemapend = 0;
    rwstatus = 1;
+   threadCount = 1;
 }
 
 
@@ -67,14 +189,17 @@ MidiFile::MidiFile(const char* filename) {
    trackCount = 1;                       // # of tracks in file
    theTrackState = TRACK_STATE_SPLIT;    // joined or split
    theTimeState = TIME_STATE_ABSOLUTE;   // absolute or delta
+   arena = new MidiEventArena;
    events.resize(1);
-   events[0] = new MidiEventList;
+   events[0] = new MidiEventList(arena);
    readFileName.resize(1);
    readFileName[0] = '\0';
    read(filename);
    timemap.clear();
    timemapvalid = 0;
+   timemapend = 0;
    rwstatus = 1;
+   threadCount = 1;
 }
 
 
@@ -84,14 +209,17 @@ MidiFile::MidiFile(const string& filename) {
    trackCount = 1;                       // # of tracks in file
    theTrackState = TRACK_STATE_SPLIT;    // joined or split
    theTimeState = TIME_STATE_DELTA;      // absolute or delta
+   arena = new MidiEventArena;
    events.resize(1);
-   events[0] = new MidiEventList;
+   events[0] = new MidiEventList(arena);
    readFileName.resize(1);
    readFileName[0] = '\0';
    read(filename);
    timemap.clear();
    timemapvalid = 0;
+   timemapend = 0;
    rwstatus = 1;
+   threadCount = 1;
 }
 
 
@@ -100,14 +228,17 @@ MidiFile::MidiFile(istream& input) {
    trackCount = 1;                       // # of tracks in file
    theTrackState = TRACK_STATE_SPLIT;    // joined or split
    theTimeState = TIME_STATE_DELTA;      // absolute or delta
+   arena = new MidiEventArena;
    events.resize(1);
-   events[0] = new MidiEventList;
+   events[0] = new MidiEventList(arena);
    readFileName.resize(1);
    readFileName[0] = '\0';
    read(input);
    timemap.clear();
    timemapvalid = 0;
+   timemapend = 0;
    rwstatus = 1;
+   threadCount = 1;
 }
 
 
@@ -118,11 +249,18 @@ MidiFile::MidiFile(istream& input) {
 //
 
 MidiFile::MidiFile(const MidiFile& other) {
+   arena = new MidiEventArena;
    events.reserve(other.events.size());
    auto it = other.events.begin();
    std::generate_n(std::back_inserter(events), other.events.size(),
          [&]() -> MidiEventList* {
-      return new MidiEventList(**it++);
+      const MidiEventList& track = **it++;
+      MidiEventList* copy = new MidiEventList(arena);
+      copy->reserve(track.size());
+      for (int i=0; i<track.size(); i++) {
+         copy->push_back_no_copy(arena->allocate(track[i]));
+      }
+      return copy;
    });
 
    ticksPerQuarterNote = other.ticksPerQuarterNote;
@@ -133,7 +271,9 @@ MidiFile::MidiFile(const MidiFile& other) {
 
    timemapvalid = other.timemapvalid;
    timemap = other.timemap;
+   timemapend = other.timemapend;
    rwstatus = other.rwstatus;
+   threadCount = other.threadCount;
 }
 
 
@@ -145,8 +285,10 @@ MidiFile::MidiFile(const MidiFile& other) {
 
 MidiFile::MidiFile(MidiFile&& other) {
     events = std::move(other.events);
+    arena = other.arena;
+    other.arena = new MidiEventArena;
     other.events.clear();
-    other.events.push_back(new MidiEventList);
+    other.events.push_back(new MidiEventList(other.arena));
 
    ticksPerQuarterNote = other.ticksPerQuarterNote;
    trackCount = other.trackCount;
@@ -156,7 +298,9 @@ MidiFile::MidiFile(MidiFile&& other) {
 
    timemapvalid = other.timemapvalid;
    timemap = other.timemap;
+   timemapend = other.timemapend;
    rwstatus = other.rwstatus;
+   threadCount = other.threadCount;
 }
 
 
@@ -175,6 +319,8 @@ MidiFile::~MidiFile() {
       events[0] = NULL;
    }
    events.resize(0);
+   delete arena;
+   arena = NULL;
    rwstatus = 0;
    timemap.clear();
    timemapvalid = 0;
@@ -189,7 +335,9 @@ MidiFile::~MidiFile() {
 //////////////////////////////
 //
 // MidiFile::read -- Parse a Standard MIDI File and store its contents
-//      in the object.
+//      in the object.  Files are memory-mapped and decoded in place;
+//      streams are read into memory in large blocks first.  Both paths
+//      finish in the buffer version of read().
 //
 
 int MidiFile::read(const char* filename) {
@@ -199,14 +347,12 @@ int MidiFile::read(const char* filename) {
       setFilename(filename);
    }
 
-   fstream input;
-   input.open(filename, ios::binary | ios::in);
-
-   if (!input.is_open()) {
+   MappedMidiFile input;
+   if (!input.open(filename)) {
       return 0;
    }
 
-   rwstatus = MidiFile::read(input);
+   rwstatus = MidiFile::read(input.getData(), input.getSize());
    return rwstatus;
 }
 
@@ -217,177 +363,77 @@ int MidiFile::read(const char* filename) {
 
 
 int MidiFile::read(const string& filename) {
-   timemapvalid = 0;
-   setFilename(filename);
-   rwstatus = 1;
+   return MidiFile::read(filename.data());
+}
 
-   fstream input;
-   input.open(filename.data(), ios::binary | ios::in);
 
-   if (!input.is_open()) {
-      return 0;
-   }
+//
+// istream version of read().
+//
 
-   rwstatus = MidiFile::read(input);
-   return rwstatus;
+int MidiFile::read(istream& input) {
+   vector<uchar> buffer;
+   char block[0x10000];
+   while (input.read(block, sizeof(block)) || (input.gcount() > 0)) {
+      buffer.insert(buffer.end(), (uchar*)block,
+            (uchar*)block + input.gcount());
+   }
+   return MidiFile::read(buffer.data(), (int)buffer.size());
 }
 
 
 //
-// istream version of read().
+// buffer version of read().  The data is owned by the caller and only
+// needs to stay valid for the duration of the call.
 //
 
-int MidiFile::read(istream& input) {
+int MidiFile::read(const uchar* data, int length) {
    rwstatus = 1;
-   if (input.peek() != 'M') {
-      // If the first byte in the input stream is not 'M', then presume that
+   if ((length < 1) || (data[0] != 'M')) {
+      // If the first byte in the input is not 'M', then presume that
       // the MIDI file is in the binasc format which is an ASCII representation
       // of the MIDI file.  Convert the binasc content into binary content and
       // then continue reading with this function.
+      stringstream textdata;
+      textdata.write((const char*)data, length);
       stringstream binarydata;
       Binasc binasc;
-      binasc.writeToBinary(binarydata, input);
-      binarydata.seekg(0, ios_base::beg);
-      if (binarydata.peek() != 'M') {
+      binasc.writeToBinary(binarydata, textdata);
+      string binary = binarydata.str();
+      if ((binary.size() < 1) || (binary[0] != 'M')) {
          cerr << "Bad MIDI data input" << endl;
          rwstatus = 0;
          return rwstatus;
       } else {
-         rwstatus = read(binarydata);
+         rwstatus = read((const uchar*)binary.data(), (int)binary.size());
          return rwstatus;
       }
    }
 
-   const char* filename = getFilename();
+   const uchar* ptr = data;
+   const uchar* end = data + length;
 
-   int    character;
-   // uchar  buffer[123456] = {0};
    ulong  longdata;
-   ushort shortdata;
-
-
-   // Read the MIDI header (4 bytes of ID, 4 byte data size,
-   // anticipated 6 bytes of data.
-
-   character = input.get();
-   if (character == EOF) {
-      cerr << "In file " << filename << ": unexpected end of file." << endl;
-      cerr << "Expecting 'M' at first byte, but found nothing." << endl;
-      rwstatus = 0; return rwstatus;
-   } else if (character != 'M') {
-      cerr << "File " << filename << " is not a MIDI file" << endl;
-      cerr << "Expecting 'M' at first byte but got '"
-           << character << "'" << endl;
-      rwstatus = 0; return rwstatus;
-   }
-
-   character = input.get();
-   if (character == EOF) {
-      cerr << "In file " << filename << ": unexpected end of file." << endl;
-      cerr << "Expecting 'T' at first byte, but found nothing." << endl;
-      rwstatus = 0; return rwstatus;
-   } else if (character != 'T') {
-      cerr << "File " << filename << " is not a MIDI file" << endl;
-      cerr << "Expecting 'T' at first byte but got '"
-           << character << "'" << endl;
-      rwstatus = 0; return rwstatus;
-   }
-
-   character = input.get();
-   if (character == EOF) {
-      cerr << "In file " << filename << ": unexpected end of file." << endl;
-      cerr << "Expecting 'h' at first byte, but found nothing." << endl;
-      rwstatus = 0; return rwstatus;
-   } else if (character != 'h') {
-      cerr << "File " << filename << " is not a MIDI file" << endl;
-      cerr << "Expecting 'h' at first byte but got '"
-           << character << "'" << endl;
-      rwstatus = 0; return rwstatus;
-   }
-
-   character = input.get();
-   if (character == EOF) {
-      cerr << "In file " << filename << ": unexpected end of file." << endl;
-      cerr << "Expecting 'd' at first byte, but found nothing." << endl;
-      rwstatus = 0; return rwstatus;
-   } else if (character != 'd') {
-      cerr << "File " << filename << " is not a MIDI file" << endl;
-      cerr << "Expecting 'd' at first byte but got '"
-           << character << "'" << endl;
-      rwstatus = 0; return rwstatus;
-   }
+   int    type;
+   int    tracks;
+   int    tpq;
 
-   // read header size (allow larger header size?)
-   longdata = MidiFile::readLittleEndian4Bytes(input);
-   if (longdata != 6) {
-      cerr << "File " << filename
-           << " is not a MIDI 1.0 Standard MIDI file." << endl;
-      cerr << "The header size is " << longdata << " bytes." << endl;
+   if (!readHeader(ptr, end, type, tracks, tpq)) {
       rwstatus = 0; return rwstatus;
    }
 
-   // Header parameter #1: format type
-   int type;
-   shortdata = MidiFile::readLittleEndian2Bytes(input);
-   switch (shortdata) {
-      case 0:
-         type = 0;
-         break;
-      case 1:
-         type = 1;
-         break;
-      case 2:    // Type-2 MIDI files should probably be allowed as well.
-      default:
-         cerr << "Error: cannot handle a type-" << shortdata
-              << " MIDI file" << endl;
-         rwstatus = 0; return rwstatus;
-   }
-
-   // Header parameter #2: track count
-   int tracks;
-   shortdata = MidiFile::readLittleEndian2Bytes(input);
-   if (type == 0 && shortdata != 1) {
-      cerr << "Error: Type 0 MIDI file can only contain one track" << endl;
-      cerr << "Instead track count is: " << shortdata << endl;
-      rwstatus = 0; return rwstatus;
-   } else {
-      tracks = shortdata;
-   }
+   const char* filename = getFilename();
    clear();
    if (events[0] != NULL) {
       delete events[0];
    }
    events.resize(tracks);
    for (int z=0; z<tracks; z++) {
-      events[z] = new MidiEventList;
+      events[z] = new MidiEventList(arena);
       events[z]->reserve(10000);   // Initialize with 10,000 event storage.
       events[z]->clear();
    }
-
-   // Header parameter #3: Ticks per quarter note
-   shortdata = MidiFile::readLittleEndian2Bytes(input);
-   if (shortdata >= 0x8000) {
-      int framespersecond = ((!(shortdata >> 8))+1) & 0x00ff;
-      int resolution      = shortdata & 0x00ff;
-      switch (framespersecond) {
-         case 232:  framespersecond = 24; break;
-         case 231:  framespersecond = 25; break;
-         case 227:  framespersecond = 29; break;
-         case 226:  framespersecond = 30; break;
-         default:
-               cerr << "Warning: unknown FPS: " << framespersecond << endl;
-               framespersecond = 255 - framespersecond + 1;
-               cerr << "Setting FPS to " << framespersecond << endl;
-      }
-      // actually ticks per second (except for frame=29 (drop frame)):
-      ticksPerQuarterNote = shortdata;
-
-      cerr << "SMPTE ticks: " << ticksPerQuarterNote << " ticks/sec" << endl;
-      cerr << "SMPTE frames per second: " << framespersecond << endl;
-      cerr << "SMPTE frame resolution per frame: " << resolution << endl;
-   }  else {
-      ticksPerQuarterNote = shortdata;
-   }
+   ticksPerQuarterNote = tpq;
 
 
    //////////////////////////////////////////////////
@@ -395,69 +441,24 @@ int MidiFile::read(istream& input) {
    // now read individual tracks:
    //
 
-   uchar runningCommand;
-   MidiEvent event;
-   vector<uchar> bytes;
-   int absticks;
-   int xstatus;
-   // int barline;
-
-   for (int i=0; i<tracks; i++) {
-      runningCommand = 0;
-
-      // cout << "\nReading Track: " << i + 1 << flush;
-
-      // read track header...
-
-      character = input.get();
-      if (character == EOF) {
-         cerr << "In file " << filename << ": unexpected end of file." << endl;
-         cerr << "Expecting 'M' at first byte in track, but found nothing."
-              << endl;
-         rwstatus = 0; return rwstatus;
-      } else if (character != 'M') {
-         cerr << "File " << filename << " is not a MIDI file" << endl;
-         cerr << "Expecting 'M' at first byte in track but got '"
-              << character << "'" << endl;
-         rwstatus = 0; return rwstatus;
+   if ((threadCount > 1) && (tracks > 1)) {
+      if (readTracksParallel(ptr, end, tracks)) {
+         theTimeState = TIME_STATE_ABSOLUTE;
+         markSequence();
+         return 1;
       }
-
-      character = input.get();
-      if (character == EOF) {
-         cerr << "In file " << filename << ": unexpected end of file." << endl;
-         cerr << "Expecting 'T' at first byte in track, but found nothing."
-              << endl;
-         rwstatus = 0; return rwstatus;
-      } else if (character != 'T') {
-         cerr << "File " << filename << " is not a MIDI file" << endl;
-         cerr << "Expecting 'T' at first byte in track but got '"
-              << character << "'" << endl;
-         rwstatus = 0; return rwstatus;
+      // The chunk table could not be trusted, so decode the tracks in
+      // order, ignoring the chunk lengths.
+      for (int i=0; i<tracks; i++) {
+         events[i]->clear();
       }
+      arena->reset();
+   }
 
-      character = input.get();
-      if (character == EOF) {
-         cerr << "In file " << filename << ": unexpected end of file." << endl;
-         cerr << "Expecting 'r' at first byte in track, but found nothing."
-              << endl;
-         rwstatus = 0; return rwstatus;
-      } else if (character != 'r') {
-         cerr << "File " << filename << " is not a MIDI file" << endl;
-         cerr << "Expecting 'r' at first byte in track but got '"
-              << character << "'" << endl;
-         rwstatus = 0; return rwstatus;
-      }
+   for (int i=0; i<tracks; i++) {
+      // read track header...
 
-      character = input.get();
-      if (character == EOF) {
-         cerr << "In file " << filename << ": unexpected end of file." << endl;
-         cerr << "Expecting 'k' at first byte in track, but found nothing."
-              << endl;
-         rwstatus = 0; return rwstatus;
-      } else if (character != 'k') {
-         cerr << "File " << filename << " is not a MIDI file" << endl;
-         cerr << "Expecting 'k' at first byte in track but got '"
-              << character << "'" << endl;
+      if (!readChunkTag(ptr, end, "MTrk", " in track", filename)) {
          rwstatus = 0; return rwstatus;
       }
 
@@ -465,67 +466,164 @@ int MidiFile::read(istream& input) {
       // not really necessary since the track MUST end with an
       // end of track meta event, and many MIDI files found in the wild
       // do not correctly give the track size.
-      longdata = MidiFile::readLittleEndian4Bytes(input);
+      if (!readBigEndian4Bytes(ptr, end, longdata)) {
+         rwstatus = 0; return rwstatus;
+      }
 
       // set the size of the track allocation so that it might
       // approximately fit the data.
       events[i]->reserve((int)longdata/2);
       events[i]->clear();
 
-      // process the track
+      if (!readTrack(ptr, end, *events[i], i, *arena)) {
+         rwstatus = 0; return rwstatus;
+      }
+   }
+
+   theTimeState = TIME_STATE_ABSOLUTE;
+   markSequence();
+   return 1;
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::parse -- Decode a Standard MIDI File and pass each message
+//      to the visitor as it is read, without storing any events in the
+//      object.  Tracks are visited in file order, and the messages of a
+//      track in the order they appear in it.  Returns 0 if the file could
+//      not be read (the visitor may already have seen part of it).
+//
+
+int MidiFile::parse(const char* filename, MidiEventVisitor& visitor) {
+   rwstatus = 1;
+   if (filename != NULL) {
+      setFilename(filename);
+   }
+
+   MappedMidiFile input;
+   if (!input.open(filename)) {
+      rwstatus = 0;
+      return rwstatus;
+   }
+
+   rwstatus = MidiFile::parse(input.getData(), input.getSize(), visitor);
+   return rwstatus;
+}
+
+
+//
+// string version of parse().
+//
+
+int MidiFile::parse(const string& filename, MidiEventVisitor& visitor) {
+   return MidiFile::parse(filename.data(), visitor);
+}
+
+
+//
+// buffer version of parse().
+//
+
+int MidiFile::parse(const uchar* data, int length,
+      MidiEventVisitor& visitor) {
+   rwstatus = 1;
+   if ((length < 1) || (data[0] != 'M')) {
+      // binasc input: convert to binary as in read().
+      stringstream textdata;
+      textdata.write((const char*)data, length);
+      stringstream binarydata;
+      Binasc binasc;
+      binasc.writeToBinary(binarydata, textdata);
+      string binary = binarydata.str();
+      if ((binary.size() < 1) || (binary[0] != 'M')) {
+         cerr << "Bad MIDI data input" << endl;
+         rwstatus = 0;
+         return rwstatus;
+      }
+      rwstatus = parse((const uchar*)binary.data(), (int)binary.size(),
+            visitor);
+      return rwstatus;
+   }
+
+   const uchar* ptr = data;
+   const uchar* end = data + length;
+
+   ulong  longdata;
+   int    type;
+   int    tracks;
+   int    tpq;
+
+   if (!readHeader(ptr, end, type, tracks, tpq)) {
+      rwstatus = 0; return rwstatus;
+   }
+   visitor.onHeader(type, tracks, tpq);
+
+   const char* filename = getFilename();
+   uchar runningCommand;
+   vector<uchar> bytes;
+   int absticks;
+
+   for (int i=0; i<tracks; i++) {
+      if (!readChunkTag(ptr, end, "MTrk", " in track", filename)) {
+         rwstatus = 0; return rwstatus;
+      }
+      // chunk size is ignored, as in read().
+      if (!readBigEndian4Bytes(ptr, end, longdata)) {
+         rwstatus = 0; return rwstatus;
+      }
+
+      visitor.onTrackStart(i);
+      runningCommand = 0;
       absticks = 0;
-      // barline = 1;
-      while (!input.eof()) {
-         longdata = readVLValue(input);
-         //cout << "ticks = " << longdata << endl;
+      while (1) {
+         if (!readVLValue(ptr, end, longdata)) {
+            rwstatus = 0; return rwstatus;
+         }
          absticks += longdata;
-         xstatus = extractMidiData(input, bytes, runningCommand);
-         if (xstatus == 0) {
-            rwstatus = 0;  return rwstatus;
+         if (!extractMidiData(ptr, end, bytes, runningCommand)) {
+            rwstatus = 0; return rwstatus;
          }
-         event.setMessage(bytes);
-         //cout << "command = " << hex << (int)event.data[0] << dec << endl;
-         if (bytes[0] == 0xff && (bytes[1] == 1 ||
-             bytes[1] == 2 || bytes[1] == 3 || bytes[1] == 4)) {
-           // mididata.push_back('\0');
-           // cout << '\t';
-           // for (int m=0; m<event.data[2]; m++) {
-           //    cout << event.data[m+3];
-           // }
-           // cout.flush();
-         } else if (bytes[0] == 0xff && bytes[1] == 0x2f) {
-            // end of track message
-            // uncomment out the following three lines if you don't want
-            // to see the end of track message (which is always required,
-            // and added automatically when a MIDI is written.
-            event.tick = absticks;
-            event.track = i;
-            events[i]->push_back(event);
-
+         if (bytes[0] == 0xff && bytes[1] == 0x2f) {
+            visitor.onTrackEnd(i, absticks);
             break;
          }
-
-         if (bytes[0] != 0xff && bytes[0] != 0xf0) {
-            event.tick = absticks;
-            event.track = i;
-            events[i]->push_back(event);
-         } else {
-            event.tick = absticks;
-            event.track = i;
-            events[i]->push_back(event);
-         }
-
+         visitMessage(visitor, i, absticks, bytes);
       }
-
    }
 
-   theTimeState = TIME_STATE_ABSOLUTE;
-   markSequence();
    return 1;
 }
 
 
 
+//////////////////////////////
+//
+// MidiFile::setThreadCount -- Set the number of threads used for
+//    work which is independent per track: decoding the tracks in read()
+//    and linking note pairs in linkNotePairs().  The default of 1 does
+//    everything in order on the calling thread.
+//
+
+void MidiFile::setThreadCount(int count) {
+   threadCount = count < 1 ? 1 : count;
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::getThreadCount -- Return the number of threads used for
+//    per-track work.
+//
+
+int MidiFile::getThreadCount(void) {
+   return threadCount;
+}
+
+
+
 //////////////////////////////
 //
 // MidiFile::write -- write a standard MIDI file to a file or an output
@@ -551,106 +649,61 @@ int MidiFile::write(const string& filename) {
 
 
 int MidiFile::write(ostream& out) {
-   int oldTimeState = getTickState();
-   if (oldTimeState == TIME_STATE_ABSOLUTE) {
-      deltaTicks();
+   int tracks = getNumTracks();
+   int i;
+
+   // Find the size of each track first, so that the whole file can be
+   // encoded into a single buffer.  Four bytes are allowed per track
+   // for an end-of-track message, which is added if the track data
+   // does not already end with one.
+   vector<ulong> tracksizes(tracks);
+   ulong total = 14;
+   for (i=0; i<tracks; i++) {
+      tracksizes[i] = getTrackWriteSize(i);
+      total += 8 + tracksizes[i] + 4;
    }
+   vector<uchar> buffer(total);
+   uchar* ptr = buffer.data();
 
    // write the header of the Standard MIDI File
 
-   char ch;
-
    // 1. The characters "MThd"
-   ch = 'M'; out << ch;
-   ch = 'T'; out << ch;
-   ch = 'h'; out << ch;
-   ch = 'd'; out << ch;
+   memcpy(ptr, "MThd", 4);
+   ptr += 4;
 
    // 2. write the size of the header (always a "6" stored in unsigned long
    //    (4 bytes).
-   ulong longdata = 6;
-   writeBigEndianULong(out, longdata);
+   ptr = writeBigEndian4Bytes(ptr, 6);
 
    // 3. MIDI file format, type 0, 1, or 2
-   ushort shortdata;
-   shortdata = (getNumTracks() == 1) ? 0 : 1;
-   writeBigEndianUShort(out,shortdata);
+   ptr = writeBigEndian2Bytes(ptr, (tracks == 1) ? 0 : 1);
 
    // 4. write out the number of tracks.
-   shortdata = getNumTracks();
-   writeBigEndianUShort(out, shortdata);
+   ptr = writeBigEndian2Bytes(ptr, (ushort)tracks);
 
    // 5. write out the number of ticks per quarternote. (avoiding SMTPE for now)
-   shortdata = getTicksPerQuarterNote();
-   writeBigEndianUShort(out, shortdata);
+   ptr = writeBigEndian2Bytes(ptr, (ushort)getTicksPerQuarterNote());
 
    // now write each track.
-   vector<uchar> trackdata;
    uchar endoftrack[4] = {0, 0xff, 0x2f, 0x00};
-   int i, j, k;
-   int size;
-   for (i=0; i<getNumTracks(); i++) {
-      trackdata.reserve(123456);   // make the track data larger than
-                                   // expected data input
-      trackdata.clear();
-      for (j=0; j<(int)events[i]->size(); j++) {
-         if ((*events[i])[j].isEndOfTrack()) {
-            // suppress end-of-track meta messages (one will be added
-            // automatically after all track data has been written).
-            continue;
-         }
-         writeVLValue((*events[i])[j].tick, trackdata);
-         if (((*events[i])[j].getCommandByte() == 0xf0) ||
-             ((*events[i])[j].getCommandByte() == 0xf7)) {
-            // 0xf0 == Complete sysex message (0xf0 is part of the raw MIDI).
-            // 0xf7 == Raw byte message (0xf7 not part of the raw MIDI).
-            // Print the first byte of the message (0xf0 or 0xf7), then
-            // print a VLV length for the rest of the bytes in the message.
-            // In other words, when creating a 0xf0 or 0xf7 MIDI message,
-            // do not insert the VLV byte length yourself, as this code will
-            // do it for you automatically.
-            trackdata.push_back((*events[i])[j][0]); // 0xf0 or 0xf7;
-            writeVLValue((*events[i])[j].size()-1, trackdata);
-            for (k=1; k<(int)(*events[i])[j].size(); k++) {
-               trackdata.push_back((*events[i])[j][k]);
-            }
-         } else {
-            // non-sysex type of message, so just output the
-            // bytes of the message:
-            for (k=0; k<(int)(*events[i])[j].size(); k++) {
-               trackdata.push_back((*events[i])[j][k]);
-            }
-         }
-      }
-      size = (int)trackdata.size();
-      if ((size < 3) || !((trackdata[size-3] == 0xff)
-            && (trackdata[size-2] == 0x2f))) {
-         trackdata.push_back(endoftrack[0]);
-         trackdata.push_back(endoftrack[1]);
-         trackdata.push_back(endoftrack[2]);
-         trackdata.push_back(endoftrack[3]);
+   for (i=0; i<tracks; i++) {
+      // first write the track ID marker "MTrk", leaving space for the
+      // size of the MIDI data to follow:
+      memcpy(ptr, "MTrk", 4);
+      ptr += 4;
+      uchar* sizeptr = ptr;
+      ptr += 4;
+
+      uchar* start = ptr;
+      ptr = writeTrackData(i, ptr);
+      if ((ptr - start < 3) || !((ptr[-3] == 0xff) && (ptr[-2] == 0x2f))) {
+         memcpy(ptr, endoftrack, 4);
+         ptr += 4;
       }
-
-      // now ready to write to MIDI file.
-
-      // first write the track ID marker "MTrk":
-      ch = 'M'; out << ch;
-      ch = 'T'; out << ch;
-      ch = 'r'; out << ch;
-      ch = 'k'; out << ch;
-
-      // A. write the size of the MIDI data to follow:
-      longdata = trackdata.size();
-      writeBigEndianULong(out, longdata);
-
-      // B. write the actual data
-      out.write((char*)trackdata.data(), trackdata.size());
-   }
-
-   if (oldTimeState == TIME_STATE_ABSOLUTE) {
-      absoluteTicks();
+      writeBigEndian4Bytes(sizeptr, (ulong)(ptr - start));
    }
 
+   out.write((char*)buffer.data(), ptr - buffer.data());
    return 1;
 }
 
@@ -904,7 +957,8 @@ void MidiFile::clearSequence(void) {
 //   tracks into separate units again.  The style of the
 //   MidiFile when read from a file is with tracks split.
 //   The original track index is stored in the MidiEvent::track
-//   variable.
+//   variable.  The sorted tracks are merged rather than concatenated
+//   and resorted (see mergeTracksByKey).
 //
 
 void MidiFile::joinTracks(void) {
@@ -916,7 +970,7 @@ void MidiFile::joinTracks(void) {
    }
 
    MidiEventList* joinedTrack;
-   joinedTrack = new MidiEventList;
+   joinedTrack = new MidiEventList(arena);
 
    int messagesum = 0;
    int length = getNumTracks();
@@ -930,9 +984,13 @@ void MidiFile::joinTracks(void) {
    if (oldTimeState == TIME_STATE_DELTA) {
       absoluteTicks();
    }
-   for (i=0; i<length; i++) {
-      for (j=0; j<(int)events[i]->size(); j++) {
-         joinedTrack->push_back_no_copy(&(*events[i])[j]);
+
+   int merged = mergeTracksByKey(*joinedTrack);
+   if (!merged) {
+      for (i=0; i<length; i++) {
+         for (j=0; j<(int)events[i]->size(); j++) {
+            joinedTrack->push_back_no_copy(&(*events[i])[j]);
+         }
       }
    }
 
@@ -941,7 +999,9 @@ void MidiFile::joinTracks(void) {
    delete events[0];
    events.resize(0);
    events.push_back(joinedTrack);
-   sortTracks();
+   if (!merged) {
+      sortTracks();
+   }
    if (oldTimeState == TIME_STATE_DELTA) {
       deltaTicks();
    }
@@ -984,7 +1044,7 @@ void MidiFile::splitTracks(void) {
    events[0] = NULL;
    events.resize(trackCount);
    for (i=0; i<trackCount; i++) {
-      events[i] = new MidiEventList;
+      events[i] = new MidiEventList(arena);
    }
 
    int trackValue = 0;
@@ -1049,7 +1109,7 @@ void MidiFile::splitTracksByChannel(void) {
    events[0] = NULL;
    events.resize(trackCount);
    for (i=0; i<trackCount; i++) {
-      events[i] = new MidiEventList;
+      events[i] = new MidiEventList(arena);
    }
 
    int trackValue = 0;
@@ -1413,7 +1473,7 @@ int MidiFile::addMetaEvent(int aTrack, int aTick, int aType,
 //
 
 int MidiFile::addCopyright(int aTrack, int aTick, const string& text) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeCopyright(text);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1428,7 +1488,7 @@ int MidiFile::addCopyright(int aTrack, int aTick, const string& text) {
 //
 
 int MidiFile::addTrackName(int aTrack, int aTick, const string& name) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeTrackName(name);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1443,7 +1503,7 @@ int MidiFile::addTrackName(int aTrack, int aTick, const string& name) {
 //
 
 int MidiFile::addInstrumentName(int aTrack, int aTick, const string& name) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeInstrumentName(name);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1458,7 +1518,7 @@ int MidiFile::addInstrumentName(int aTrack, int aTick, const string& name) {
 //
 
 int MidiFile::addLyric(int aTrack, int aTick, const string& text) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeLyric(text);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1473,7 +1533,7 @@ int MidiFile::addLyric(int aTrack, int aTick, const string& text) {
 //
 
 int MidiFile::addMarker(int aTrack, int aTick, const string& text) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeMarker(text);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1488,7 +1548,7 @@ int MidiFile::addMarker(int aTrack, int aTick, const string& text) {
 //
 
 int MidiFile::addCue(int aTrack, int aTick, const string& text) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeCue(text);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1503,7 +1563,7 @@ int MidiFile::addCue(int aTrack, int aTick, const string& text) {
 //
 
 int MidiFile::addTempo(int aTrack, int aTick, double aTempo) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeTempo(aTempo);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1537,7 +1597,7 @@ int MidiFile::addTempo(int aTrack, int aTick, double aTempo) {
 
 int MidiFile::addTimeSignature(int aTrack, int aTick, int top, int bottom,
       int clocksPerClick, int num32ndsPerQuarter) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeTimeSignature(top, bottom, clocksPerClick, num32ndsPerQuarter);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1566,6 +1626,86 @@ int MidiFile::addCompoundTimeSignature(int aTrack, int aTick, int top,
 
 
 
+//////////////////////////////
+//
+// MidiFile::getTrackWriteSize -- Return the number of bytes which
+//    writeTrackData() will store for the given track.
+//
+
+ulong MidiFile::getTrackWriteSize(int track) {
+   MidiEventList& list = *events[track];
+   int delta = (getTickState() == TIME_STATE_DELTA);
+   int lasttick = 0;
+   ulong size = 0;
+   for (int j=0; j<list.size(); j++) {
+      MidiEvent& event = list[j];
+      int tick = delta ? event.tick : event.tick - lasttick;
+      lasttick = event.tick;
+      if (event.isEndOfTrack()) {
+         continue;
+      }
+      size += getVLValueSize(tick) + event.size();
+      if ((event.getCommandByte() == 0xf0) ||
+          (event.getCommandByte() == 0xf7)) {
+         size += getVLValueSize(event.size() - 1);
+      }
+   }
+   return size;
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::writeTrackData -- Encode the events of a track into the
+//    output buffer, and return a pointer to the byte after the data.
+//    Delta ticks are calculated as the events are written, so absolute
+//    tick times in the file are not changed.
+//
+
+uchar* MidiFile::writeTrackData(int track, uchar* ptr) {
+   MidiEventList& list = *events[track];
+   int delta = (getTickState() == TIME_STATE_DELTA);
+   int lasttick = 0;
+   for (int j=0; j<list.size(); j++) {
+      MidiEvent& event = list[j];
+      int tick = delta ? event.tick : event.tick - lasttick;
+      lasttick = event.tick;
+      if (event.isEndOfTrack()) {
+         // suppress end-of-track meta messages (one will be added
+         // automatically after all track data has been written).
+         continue;
+      }
+      ptr = writeVLValue(tick, ptr);
+      if ((event.getCommandByte() == 0xf0) ||
+          (event.getCommandByte() == 0xf7)) {
+         // 0xf0 == Complete sysex message (0xf0 is part of the raw MIDI).
+         // 0xf7 == Raw byte message (0xf7 not part of the raw MIDI).
+         // Print the first byte of the message (0xf0 or 0xf7), then
+         // print a VLV length for the rest of the bytes in the message.
+         // In other words, when creating a 0xf0 or 0xf7 MIDI message,
+         // do not insert the VLV byte length yourself, as this code will
+         // do it for you automatically.
+         *ptr++ = event[0]; // 0xf0 or 0xf7;
+         ptr = writeVLValue(event.size() - 1, ptr);
+         if (event.size() > 1) {
+            memcpy(ptr, event.data() + 1, event.size() - 1);
+            ptr += event.size() - 1;
+         }
+      } else {
+         // non-sysex type of message, so just output the
+         // bytes of the message:
+         if (event.size() > 0) {
+            memcpy(ptr, event.data(), event.size());
+            ptr += event.size();
+         }
+      }
+   }
+   return ptr;
+}
+
+
+
 //////////////////////////////
 //
 // MidiFile::makeVLV --
@@ -1623,7 +1763,7 @@ int MidiFile::makeVLV(uchar *buffer, int number) {
 //
 
 int MidiFile::addNoteOn(int aTrack, int aTick, int aChannel, int key, int vel) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeNoteOn(aChannel, key, vel);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1639,7 +1779,7 @@ int MidiFile::addNoteOn(int aTrack, int aTick, int aChannel, int key, int vel) {
 
 int MidiFile::addNoteOff(int aTrack, int aTick, int aChannel, int key,
       int vel) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeNoteOff(aChannel, key, vel);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1655,7 +1795,7 @@ int MidiFile::addNoteOff(int aTrack, int aTick, int aChannel, int key,
 //
 
 int MidiFile::addNoteOff(int aTrack, int aTick, int aChannel, int key) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeNoteOff(aChannel, key);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1672,7 +1812,7 @@ int MidiFile::addNoteOff(int aTrack, int aTick, int aChannel, int key) {
 
 int MidiFile::addController(int aTrack, int aTick, int aChannel,
       int num, int value) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makeController(aChannel, num, value);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1689,7 +1829,7 @@ int MidiFile::addController(int aTrack, int aTick, int aChannel,
 
 int MidiFile::addPatchChange(int aTrack, int aTick, int aChannel,
       int patchnum) {
-   MidiEvent* me = new MidiEvent;
+   MidiEvent* me = events[aTrack]->newEvent();
    me->makePatchChange(aChannel, patchnum);
    me->tick = aTick;
    events[aTrack]->push_back_no_copy(me);
@@ -1763,7 +1903,7 @@ int MidiFile::addPitchBend(int aTrack, int aTick, int aChannel, double amount) {
 int MidiFile::addTrack(void) {
    int length = getNumTracks();
    events.resize(length+1);
-   events[length] = new MidiEventList;
+   events[length] = new MidiEventList(arena);
    events[length]->reserve(10000);
    events[length]->clear();
    return length;
@@ -1774,7 +1914,7 @@ int MidiFile::addTrack(int count) {
    events.resize(length+count);
    int i;
    for (i=0; i<count; i++) {
-      events[length + i] = new MidiEventList;
+      events[length + i] = new MidiEventList(arena);
       events[length + i]->reserve(10000);
       events[length + i]->clear();
    }
@@ -1825,7 +1965,8 @@ void MidiFile::deleteTrack(int aTrack) {
 //////////////////////////////
 //
 // MidiFile::clear -- make the MIDI file empty with one
-//     track with no data in it.
+//     track with no data in it.  All events are owned by the file's
+//     arena, so they are released together when it is reset.
 //
 
 void MidiFile::clear(void) {
@@ -1834,8 +1975,9 @@ void MidiFile::clear(void) {
       delete events[i];
       events[i] = NULL;
    }
+   arena->reset();
    events.resize(1);
-   events[0] = new MidiEventList;
+   events[0] = new MidiEventList(arena);
    timemapvalid=0;
    timemap.clear();
    theTrackState = TRACK_STATE_SPLIT;
@@ -1918,7 +2060,7 @@ int MidiFile::getNumEvents(int aTrack) {
 
 void MidiFile::mergeTracks(int aTrack1, int aTrack2) {
    MidiEventList* mergedTrack;
-   mergedTrack = new MidiEventList;
+   mergedTrack = new MidiEventList(arena);
    int oldTimeState = getTickState();
    if (oldTimeState == TIME_STATE_DELTA) {
       absoluteTicks();
@@ -1992,11 +2134,215 @@ void MidiFile::setMillisecondTicks(void) {
 
 //////////////////////////////
 //
-// MidiFile::sortTrack --
+// MidiFile::sortTrack -- Sort the events of a track into the order
+//    defined by eventcompare().  Each event gets a packed 64-bit key
+//    which is sorted with a stable LSD radix sort; a track which is
+//    already in order (such as one just read from a file) costs a
+//    single pass.  Tracks with negative ticks or values too large to
+//    pack fall back to a comparison sort on the same ordering.
 //
 
 void MidiFile::sortTrack(MidiEventList& trackData) {
-   qsort(trackData.data(), trackData.size(), sizeof(MidiEvent*), eventcompare);
+   MidiEvent** list = trackData.data();
+   int count = trackData.size();
+   int mintick = 0;
+   int maxtick = 0;
+   int minseq = 0;
+   int maxseq = 0;
+   int i;
+   for (i=0; i<count; i++) {
+      if (list[i]->tick < mintick) { mintick = list[i]->tick; }
+      if (list[i]->tick > maxtick) { maxtick = list[i]->tick; }
+      if (list[i]->seq  < minseq)  { minseq  = list[i]->seq;  }
+      if (list[i]->seq  > maxseq)  { maxseq  = list[i]->seq;  }
+   }
+   int shift = getSortKeyShift(maxtick, maxseq);
+   if ((mintick >= 0) && (minseq >= 0) && (shift >= 0)) {
+      sortByKey(list, count, shift);
+      return;
+   }
+
+   std::stable_sort(list, list + count,
+         [](const MidiEvent* a, const MidiEvent* b) -> bool {
+      if (a->tick != b->tick) {
+         return a->tick < b->tick;
+      } else if (a->seq != b->seq) {
+         return a->seq < b->seq;
+      }
+      return getSortClass(*a) < getSortClass(*b);
+   });
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::mergeTracksByKey -- Append the events of all tracks to the
+//    given list in the order that sorting their concatenation would
+//    give.  Each track is sorted first (a single pass for tracks which
+//    are already in order), then the tracks are merged with a min-heap
+//    of their next sort keys, ties going to the lower track number.
+//    Returns 0 without changing anything if the ticks or seq values
+//    cannot be packed into sort keys.
+//
+
+int MidiFile::mergeTracksByKey(MidiEventList& output) {
+   int length = getNumTracks();
+   int maxtick = 0;
+   int maxseq = 0;
+   int i, j;
+   for (i=0; i<length; i++) {
+      for (j=0; j<(int)events[i]->size(); j++) {
+         MidiEvent& event = (*events[i])[j];
+         if ((event.tick < 0) || (event.seq < 0)) {
+            return 0;
+         }
+         if (event.tick > maxtick) { maxtick = event.tick; }
+         if (event.seq > maxseq)   { maxseq = event.seq;   }
+      }
+   }
+   int shift = getSortKeyShift(maxtick, maxseq);
+   if (shift < 0) {
+      return 0;
+   }
+
+   typedef pair<uint64_t, int> HeapEntry;   // key of next event, track
+   vector<HeapEntry> heap;
+   vector<int> position(length, 0);
+   heap.reserve(length);
+   for (i=0; i<length; i++) {
+      sortByKey(events[i]->data(), events[i]->size(), shift);
+      if (events[i]->size() > 0) {
+         MidiEvent& event = (*events[i])[0];
+         heap.push_back(HeapEntry(((uint64_t)event.tick << shift) |
+               ((uint64_t)event.seq << 3) | getSortClass(event), i));
+      }
+   }
+   std::make_heap(heap.begin(), heap.end(), std::greater<HeapEntry>());
+
+   while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), std::greater<HeapEntry>());
+      int track = heap.back().second;
+      heap.pop_back();
+      output.push_back_no_copy(&(*events[track])[position[track]++]);
+      if (position[track] < events[track]->size()) {
+         MidiEvent& event = (*events[track])[position[track]];
+         heap.push_back(HeapEntry(((uint64_t)event.tick << shift) |
+               ((uint64_t)event.seq << 3) | getSortClass(event), track));
+         std::push_heap(heap.begin(), heap.end(), std::greater<HeapEntry>());
+      }
+   }
+   return 1;
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::getSortClass -- Rank of an event among events with the same
+//    tick and seq values, following the rules of eventcompare():
+//    0 = meta message, 1 = other MIDI messages, 2 = note-off,
+//    3 = note-on, 4 = end-of-track.
+//
+
+int MidiFile::getSortClass(const MidiEvent& event) {
+   if (event.size() < 1) {
+      return 1;
+   } else if (event[0] == 0xff) {
+      return ((event.size() > 1) && (event[1] == 0x2f)) ? 4 : 0;
+   }
+   int command = event[0] & 0xf0;
+   if ((command == 0x90) && (event.size() > 2) && (event[2] != 0)) {
+      return 3;
+   } else if ((command == 0x90) || (command == 0x80)) {
+      return 2;
+   }
+   return 1;
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::getSortKeyShift -- Return the left shift which places the
+//    tick above the seq and class fields of a sort key, or -1 if
+//    ticks and seq values up to the given maxima do not fit in 64 bits.
+//
+
+int MidiFile::getSortKeyShift(int maxtick, int maxseq) {
+   int tickbits = 0;
+   int seqbits = 0;
+   while ((tickbits < 32) && ((uint64_t)maxtick >> tickbits)) {
+      tickbits++;
+   }
+   while ((seqbits < 32) && ((uint64_t)maxseq >> seqbits)) {
+      seqbits++;
+   }
+   if (tickbits + seqbits + 3 > 64) {
+      return -1;
+   }
+   return seqbits + 3;
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::sortByKey -- Stable LSD radix sort of an event list, one
+//    byte of the packed key per pass.  Only the bytes which differ
+//    between events are sorted.  Returns 1 if the list was already in
+//    order.
+//
+
+int MidiFile::sortByKey(MidiEvent** list, int count, int shift) {
+   vector<_SortKey> keys(count);
+   int sorted = 1;
+   int i;
+   for (i=0; i<count; i++) {
+      keys[i].key = ((uint64_t)list[i]->tick << shift) |
+            ((uint64_t)list[i]->seq << 3) | getSortClass(*list[i]);
+      keys[i].event = list[i];
+      if ((i > 0) && (keys[i].key < keys[i-1].key)) {
+         sorted = 0;
+      }
+   }
+   if (sorted) {
+      return 1;
+   }
+
+   // histogram every byte of the key in one pass:
+   vector<int> counts(8 * 256, 0);
+   for (i=0; i<count; i++) {
+      for (int b=0; b<8; b++) {
+         counts[b * 256 + ((keys[i].key >> (8 * b)) & 0xff)]++;
+      }
+   }
+
+   vector<_SortKey> buffer(count);
+   _SortKey* from = keys.data();
+   _SortKey* to = buffer.data();
+   for (int b=0; b<8; b++) {
+      int* bucket = counts.data() + b * 256;
+      if (bucket[(keys[0].key >> (8 * b)) & 0xff] == count) {
+         // every key has the same byte here, so the pass changes nothing
+         continue;
+      }
+      int sum = 0;
+      for (i=0; i<256; i++) {
+         int n = bucket[i];
+         bucket[i] = sum;
+         sum += n;
+      }
+      for (i=0; i<count; i++) {
+         to[bucket[(from[i].key >> (8 * b)) & 0xff]++] = from[i];
+      }
+      std::swap(from, to);
+   }
+
+   for (i=0; i<count; i++) {
+      list[i] = from[i].event;
+   }
+   return 0;
 }
 
 
@@ -2042,7 +2388,8 @@ int MidiFile::getTrackCountAsType1(void) {
 //////////////////////////////
 //
 // MidiFile::getTimeInSeconds -- return the time in seconds for
-//     the current message.
+//     the current message.  Returns -1.0 if the tick is before the
+//     start or after the last event of the file.
 //
 
 double MidiFile::getTimeInSeconds(int aTrack, int anIndex) {
@@ -2053,29 +2400,14 @@ double MidiFile::getTimeInSeconds(int aTrack, int anIndex) {
 double MidiFile::getTimeInSeconds(int tickvalue) {
    if (timemapvalid == 0) {
       buildTimeMap();
-      if (timemapvalid == 0) {
-         return -1.0;    // something went wrong
-      }
    }
-
-   _TickTime key;
-   key.tick    = tickvalue;
-   key.seconds = -1;
-
-   void* ptr = bsearch(&key, timemap.data(), timemap.size(),
-         sizeof(_TickTime), ticksearch);
-
-   if (ptr == NULL) {
-      // The specific tick value was not found, so do a linear
-      // search for the two tick values which occur before and
-      // after the tick value, and do a linear interpolation of
-      // the time in seconds values to figure out the final
-      // time in seconds.
-      // Since the code is not yet written, kill the program at this point:
-      return linearSecondInterpolationAtTick(tickvalue);
-   } else {
-      return ((_TickTime*)ptr)->seconds;
+   if ((tickvalue < 0) || (tickvalue > timemapend)) {
+      return -1.0;
    }
+
+   _TempoSegment& segment = timemap[findTempoSegment(tickvalue)];
+   return segment.seconds + (tickvalue - segment.tick) *
+         segment.secondsPerTick;
 }
 
 
@@ -2083,37 +2415,29 @@ double MidiFile::getTimeInSeconds(int tickvalue) {
 //////////////////////////////
 //
 // MidiFile::getAbsoluteTickTime -- return the tick value represented
-//    by the input time in seconds.  If there is not tick entry at
-//    the given time in seconds, then interpolate between two values.
+//    by the input time in seconds, truncated to an integer.  Returns -1
+//    if the time is before the start or after the last event of the file.
 //
 
 int MidiFile::getAbsoluteTickTime(double starttime) {
    if (timemapvalid == 0) {
       buildTimeMap();
-      if (timemapvalid == 0) {
-         if (timemapvalid == 0) {
-            return -1.0;    // something went wrong
-         }
-      }
    }
-
-   _TickTime key;
-   key.tick    = -1;
-   key.seconds = starttime;
-
-   void* ptr = bsearch(&key, timemap.data(), timemap.size(),
-         sizeof(_TickTime), secondsearch);
-
-   if (ptr == NULL) {
-      // The specific seconds value was not found, so do a linear
-      // search for the two time values which occur before and
-      // after the given time value, and do a linear interpolation of
-      // the time in tick values to figure out the final time in ticks.
-      return linearTickInterpolationAtSecond(starttime);
-   } else {
-      return ((_TickTime*)ptr)->tick;
+   if ((starttime < 0.0) || (starttime > getTimeInSeconds(timemapend))) {
+      return -1;
    }
 
+   // last segment which starts at or before the given time:
+   auto it = upper_bound(timemap.begin(), timemap.end(), starttime,
+         [](double seconds, const _TempoSegment& segment) {
+            return seconds < segment.seconds;
+         });
+   _TempoSegment& segment = *(it - 1);
+   if (segment.secondsPerTick <= 0.0) {
+      return segment.tick;
+   }
+   return (int)(segment.tick + (starttime - segment.seconds) /
+         segment.secondsPerTick);
 }
 
 
@@ -2121,24 +2445,14 @@ int MidiFile::getAbsoluteTickTime(double starttime) {
 //////////////////////////////
 //
 // MidiFile::getTotalTimeInSeconds -- Returns the duration of the MidiFile
-//    event list in seconds.  If doTimeAnalysis() is not called before this
-//    function is called, it will be called automatically.
+//    event list in seconds, which is the time of its last event.
 //
 
 double MidiFile::getTotalTimeInSeconds(void) {
    if (timemapvalid == 0) {
       buildTimeMap();
-      if (timemapvalid == 0) {
-         return -1.0;    // something went wrong
-      }
    }
-   double output = 0.0;
-   for (int i=0; i<(int)events.size(); i++) {
-      if (events[i]->last().seconds > output) {
-         output = events[i]->last().seconds;
-      }
-   }
-   return output;
+   return getTimeInSeconds(timemapend);
 }
 
 
@@ -2191,11 +2505,12 @@ double MidiFile::getTotalTimeInQuarters(void) {
 //
 // MidiFile::doTimeAnalysis -- Identify the real-time position of
 //    all events by monitoring the tempo in relations to the tick
-//    times in the file.
+//    times in the file.  Each track is walked once alongside the
+//    time map, so the tracks are left in their current state.
 //
 
 void MidiFile::doTimeAnalysis(void) {
-    buildTimeMap();
+   buildTimeMap();
 }
 
 
@@ -2204,17 +2519,49 @@ void MidiFile::doTimeAnalysis(void) {
 //
 // MidiFile::linkNotePairs --  Link note-ons to note-offs separately
 //     for each track.  Returns the total number of note message pairs
-//     that were linked.
+//     that were linked.  Existing links are cleared first, since they
+//     may join events in different tracks; after that the linking of a
+//     track only touches its own events, so tracks are linked on
+//     separate threads when setThreadCount() allows it.
 //
 
 int MidiFile::linkNotePairs(void) {
    int i;
-   int sum = 0;
-   for (i=0; i<getTrackCount(); i++) {
-      if (events[i] == NULL) {
-         continue;
+   int tracks = getTrackCount();
+   int workers = threadCount < tracks ? threadCount : tracks;
+   if (workers <= 1) {
+      int sum = 0;
+      for (i=0; i<tracks; i++) {
+         if (events[i] == NULL) {
+            continue;
+         }
+         sum += events[i]->linkNotePairs();
       }
-      sum += events[i]->linkNotePairs();
+      return sum;
+   }
+
+   clearLinks();
+   vector<int> counts(tracks, 0);
+   vector<thread> threads;
+   atomic<int> next(0);
+   auto work = [&]() {
+      int t;
+      while ((t = next++) < tracks) {
+         if (events[t] != NULL) {
+            counts[t] = events[t]->linkNotePairs();
+         }
+      }
+   };
+   for (i=1; i<workers; i++) {
+      threads.push_back(thread(work));
+   }
+   work();
+   int sum = 0;
+   for (i=0; i<(int)threads.size(); i++) {
+      threads[i].join();
+   }
+   for (i=0; i<tracks; i++) {
+      sum += counts[i];
    }
    return sum;
 }
@@ -2248,257 +2595,428 @@ void MidiFile::clearLinks(void) {
 
 //////////////////////////////
 //
-// MidiFile::linearTickInterpolationAtSecond -- return the tick value at the
-//    given input time.
+// MidiFile::buildTimeMap -- build an index of the spans of constant
+//      tempo in a MIDI file, and the time in seconds at which each span
+//      starts.  Only the tempo messages are needed, so the tracks are
+//      scanned in place whatever their tick or track state.  If no
+//      tempo messages are given (or until they are given, then the
+//      tempo is set to 120 beats per minute).  A tempo change takes
+//      effect after its tick, and if there are several tempo messages
+//      at the same tick, the last one in sorted order is used.  The
+//      seconds of every event are filled in as well, so that they are
+//      set whenever the map is built, including lazily by
+//      getTimeInSeconds().
 //
 
-int MidiFile::linearTickInterpolationAtSecond(double seconds) {
-   if (timemapvalid == 0) {
-      buildTimeMap();
-      if (timemapvalid == 0) {
-         return -1.0;    // something went wrong
+void MidiFile::buildTimeMap(void) {
+   int tpq = getTicksPerQuarterNote();
+   double defaultTempo = 120.0;
+
+   vector<MidiEvent*> tempos;
+   vector<int> ticks;
+   int delta = (getTickState() == TIME_STATE_DELTA);
+   int i, j;
+
+   timemapend = 0;
+   for (i=0; i<getTrackCount(); i++) {
+      MidiEventList& list = *events[i];
+      int tick = 0;
+      for (j=0; j<list.size(); j++) {
+         tick = delta ? tick + list[j].tick : list[j].tick;
+         if (tick > timemapend) {
+            timemapend = tick;
+         }
+         if (list[j].isTempo()) {
+            tempos.push_back(&list[j]);
+            ticks.push_back(tick);
+         }
       }
    }
 
-   int i;
-   double lasttime = timemap[timemap.size()-1].seconds;
-   // give an error value of -1 if time is out of range of data.
-   if (seconds < 0.0) {
-      return -1;
-   }
-   if (seconds > timemap[timemap.size()-1].seconds) {
-      return -1;
+   // order the tempo messages as they would be in joined tracks:
+   vector<int> order(tempos.size());
+   for (i=0; i<(int)order.size(); i++) {
+      order[i] = i;
    }
+   stable_sort(order.begin(), order.end(),
+         [&tempos, &ticks](int a, int b) {
+            if (ticks[a] != ticks[b]) {
+               return ticks[a] < ticks[b];
+            }
+            return tempos[a]->seq < tempos[b]->seq;
+         });
 
-   // Guess which side of the list is closest to target:
-   // Could do a more efficient algorithm since time values are sorted,
-   // but good enough for now...
-   int startindex = -1;
-   if (seconds < lasttime / 2) {
-      for (i=0; i<(int)timemap.size(); i++) {
-         if (timemap[i].seconds > seconds) {
-            startindex = i-1;
-            break;
-         } else if (timemap[i].seconds == seconds) {
-            startindex = i;
-            break;
-         }
+   _TempoSegment segment;
+   segment.tick = 0;
+   segment.seconds = 0.0;
+   segment.secondsPerTick = 60.0 / (defaultTempo * tpq);
+   timemap.clear();
+   timemap.push_back(segment);
+
+   for (i=0; i<(int)order.size(); i++) {
+      _TempoSegment& last = timemap.back();
+      int tick = ticks[order[i]];
+      double spt = tempos[order[i]]->getTempoSPT(tpq);
+      if (tick <= last.tick) {
+         last.secondsPerTick = spt;
+         continue;
       }
-   } else {
-      for (i=(int)timemap.size()-1; i>0; i--) {
-         if (timemap[i].seconds < seconds) {
-            startindex = i+1;
-            break;
-         } else if (timemap[i].seconds == seconds) {
-            startindex = i;
-            break;
+      segment.tick = tick;
+      segment.seconds = last.seconds + (tick - last.tick) * last.secondsPerTick;
+      segment.secondsPerTick = spt;
+      timemap.push_back(segment);
+   }
+
+   timemapvalid = 1;
+   fillEventSeconds();
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::fillEventSeconds -- Store the time in seconds of each event
+//      in MidiEvent::seconds, walking each track once alongside the
+//      time map.
+//
+
+void MidiFile::fillEventSeconds(void) {
+   int delta = (getTickState() == TIME_STATE_DELTA);
+   for (int i=0; i<getTrackCount(); i++) {
+      MidiEventList& list = *events[i];
+      int segment = 0;
+      int tick = 0;
+      for (int j=0; j<list.size(); j++) {
+         tick = delta ? tick + list[j].tick : list[j].tick;
+         if (tick < timemap[segment].tick) {
+            // the track is not in time order
+            segment = findTempoSegment(tick);
+         } else {
+            while ((segment + 1 < (int)timemap.size()) &&
+                  (timemap[segment+1].tick <= tick)) {
+               segment++;
+            }
          }
+         list[j].seconds = timemap[segment].seconds +
+               (tick - timemap[segment].tick) *
+               timemap[segment].secondsPerTick;
       }
    }
+}
 
-   if (startindex < 0) {
-      return -1;
-   }
-   if (startindex >= (int)timemap.size()-1) {
-      return -1;
-   }
 
-   double x1 = timemap[startindex].seconds;
-   double x2 = timemap[startindex+1].seconds;
-   double y1 = timemap[startindex].tick;
-   double y2 = timemap[startindex+1].tick;
-   double xi = seconds;
 
-   return (xi-x1) * ((y2-y1)/(x2-x1)) + y1;
+//////////////////////////////
+//
+// MidiFile::findTempoSegment -- Return the index of the time map segment
+//      which contains the given tick.
+//
+
+int MidiFile::findTempoSegment(int tick) {
+   auto it = upper_bound(timemap.begin(), timemap.end(), tick,
+         [](int value, const _TempoSegment& segment) {
+            return value < segment.tick;
+         });
+   if (it == timemap.begin()) {
+      return 0;
+   }
+   return (int)(it - timemap.begin()) - 1;
 }
 
 
 
 //////////////////////////////
 //
-// MidiFile::linearSecondInterpolationAtTick -- return the time in seconds
-//    value at the given input tick time. (Ticks input could be made double).
+// MidiFile::readHeader -- Read the MThd chunk at the start of the data,
+//    checking that it describes a type-0 or type-1 file.  Returns 0 after
+//    printing the reason if the header cannot be used.
 //
 
-double MidiFile::linearSecondInterpolationAtTick(int ticktime) {
-   if (timemapvalid == 0) {
-      buildTimeMap();
-      if (timemapvalid == 0) {
-         return -1.0;    // something went wrong
-      }
+int MidiFile::readHeader(const uchar*& ptr, const uchar* end, int& type,
+      int& tracks, int& tpq) {
+   const char* filename = getFilename();
+   ulong  longdata;
+   ushort shortdata;
+
+   // Read the MIDI header (4 bytes of ID, 4 byte data size,
+   // anticipated 6 bytes of data.
+
+   if (!readChunkTag(ptr, end, "MThd", "", filename)) {
+      return 0;
    }
 
-   int i;
-   double lasttick = timemap[timemap.size()-1].tick;
-   // give an error value of -1 if time is out of range of data.
-   if (ticktime < 0.0) {
-      return -1;
+   // read header size (allow larger header size?)
+   if (!readBigEndian4Bytes(ptr, end, longdata)) {
+      return 0;
    }
-   if (ticktime > timemap.back().tick) {
-      return -1;  // don't try to extrapolate
+   if (longdata != 6) {
+      cerr << "File " << filename
+           << " is not a MIDI 1.0 Standard MIDI file." << endl;
+      cerr << "The header size is " << longdata << " bytes." << endl;
+      return 0;
    }
 
-   // Guess which side of the list is closest to target:
-   // Could do a more efficient algorithm since time values are sorted,
-   // but good enough for now...
-   int startindex = -1;
-   if (ticktime < lasttick / 2) {
-      for (i=0; i<(int)timemap.size(); i++) {
-         if (timemap[i].tick > ticktime) {
-            startindex = i-1;
-            break;
-         } else if (timemap[i].tick == ticktime) {
-            startindex = i;
-            break;
-         }
-      }
-   } else {
-      for (i=(int)timemap.size()-1; i>0; i--) {
-         if (timemap[i].tick < ticktime) {
-            startindex = i;
-            break;
-         } else if (timemap[i].tick == ticktime) {
-            startindex = i;
-            break;
-         }
-      }
+   // Header parameter #1: format type
+   if (!readBigEndian2Bytes(ptr, end, shortdata)) {
+      return 0;
+   }
+   switch (shortdata) {
+      case 0:
+         type = 0;
+         break;
+      case 1:
+         type = 1;
+         break;
+      case 2:    // Type-2 MIDI files should probably be allowed as well.
+      default:
+         cerr << "Error: cannot handle a type-" << shortdata
+              << " MIDI file" << endl;
+         return 0;
    }
 
-   if (startindex < 0) {
-      return -1;
+   // Header parameter #2: track count
+   if (!readBigEndian2Bytes(ptr, end, shortdata)) {
+      return 0;
    }
-   if (startindex >= (int)timemap.size()-1) {
-      return -1;
+   if (type == 0 && shortdata != 1) {
+      cerr << "Error: Type 0 MIDI file can only contain one track" << endl;
+      cerr << "Instead track count is: " << shortdata << endl;
+      return 0;
+   } else {
+      tracks = shortdata;
    }
 
-   if (timemap[startindex].tick == ticktime) {
-      return timemap[startindex].seconds;
+   // Header parameter #3: Ticks per quarter note
+   if (!readBigEndian2Bytes(ptr, end, shortdata)) {
+      return 0;
    }
+   if (shortdata >= 0x8000) {
+      int framespersecond = ((!(shortdata >> 8))+1) & 0x00ff;
+      int resolution      = shortdata & 0x00ff;
+      switch (framespersecond) {
+         case 232:  framespersecond = 24; break;
+         case 231:  framespersecond = 25; break;
+         case 227:  framespersecond = 29; break;
+         case 226:  framespersecond = 30; break;
+         default:
+               cerr << "Warning: unknown FPS: " << framespersecond << endl;
+               framespersecond = 255 - framespersecond + 1;
+               cerr << "Setting FPS to " << framespersecond << endl;
+      }
+      // actually ticks per second (except for frame=29 (drop frame)):
+      tpq = shortdata;
 
-   double x1 = timemap[startindex].tick;
-   double x2 = timemap[startindex+1].tick;
-   double y1 = timemap[startindex].seconds;
-   double y2 = timemap[startindex+1].seconds;
-   double xi = ticktime;
+      cerr << "SMPTE ticks: " << tpq << " ticks/sec" << endl;
+      cerr << "SMPTE frames per second: " << framespersecond << endl;
+      cerr << "SMPTE frame resolution per frame: " << resolution << endl;
+   }  else {
+      tpq = shortdata;
+   }
 
-   return (xi-x1) * ((y2-y1)/(x2-x1)) + y1;
+   return 1;
 }
 
 
 
 //////////////////////////////
 //
-// MidiFile::buildTimeMap -- build an index of the absolute tick values
-//      found in a MIDI file, and their corresponding time values in
-//      seconds, taking into consideration tempo change messages.  If no
-//      tempo messages are given (or until they are given, then the
-//      tempo is set to 120 beats per minute).  If SMPTE time code is
-//      used, then ticks are actually time values.  So don't build
-//      a time map for SMPTE ticks, and just calculate the time in
-//      seconds from the tick value (1000 ticks per second SMPTE
-//      is the only mode tested (25 frames per second and 40 subframes
-//      per frame).
+// MidiFile::visitMessage -- Pass one decoded message (other than
+//    end-of-track) to the matching visitor callback.
 //
 
-void MidiFile::buildTimeMap(void) {
+void MidiFile::visitMessage(MidiEventVisitor& visitor, int track, int tick,
+      const vector<uchar>& bytes) {
+   int command = bytes[0] & 0xf0;
+   int channel = bytes[0] & 0x0f;
+   switch (command) {
+      case 0x80:
+         visitor.onNoteOff(track, tick, channel, bytes[1], bytes[2]);
+         return;
+      case 0x90:
+         if (bytes[2] == 0) {
+            visitor.onNoteOff(track, tick, channel, bytes[1], bytes[2]);
+         } else {
+            visitor.onNoteOn(track, tick, channel, bytes[1], bytes[2]);
+         }
+         return;
+      case 0xB0:
+         visitor.onController(track, tick, channel, bytes[1], bytes[2]);
+         return;
+      case 0xE0:
+         visitor.onPitchBend(track, tick, channel,
+               bytes[1] | (bytes[2] << 7));
+         return;
+   }
+   if (bytes[0] == 0xff) {
+      visitor.onMeta(track, tick, bytes[1], bytes.data() + 3,
+            (int)bytes.size() - 3);
+   } else {
+      visitor.onMessage(track, tick, bytes.data(), (int)bytes.size());
+   }
+}
 
-   // convert the MIDI file to absolute time representation
-   // in single track mode (and undo if the MIDI file was not
-   // in that state when this function was called.
-   //
-   int trackstate = getTrackState();
-   int timestate  = getTickState();
 
-   absoluteTicks();
-   joinTracks();
 
-   int allocsize = getNumEvents(0);
-   timemap.reserve(allocsize+10);
-   timemap.clear();
+//////////////////////////////
+//
+// MidiFile::readTrack -- Decode the events of one MTrk chunk, starting
+//    just after its length field, up to and including the end-of-track
+//    message.  Events are allocated from the given arena so that tracks
+//    can be decoded on separate threads.  Returns 0 on a read error.
+//    If quiet is set, nothing is printed and anything that would have
+//    been reported counts as an error.
+//
 
-   _TickTime value;
+int MidiFile::readTrack(const uchar*& ptr, const uchar* end,
+      MidiEventList& track, int index, MidiEventArena& storage, int quiet) {
+   uchar runningCommand = 0;
+   vector<uchar> bytes;
+   MidiEvent* event;
+   ulong delta;
+   int absticks = 0;
 
-   int lasttick = 0;
-   int curtick;
-   int tickinit = 0;
+   while (1) {
+      if (!readVLValue(ptr, end, delta, quiet)) {
+         return 0;
+      }
+      absticks += delta;
+      if (!extractMidiData(ptr, end, bytes, runningCommand, quiet)) {
+         return 0;
+      }
+      event = storage.allocate();
+      event->setMessage(bytes);
+      event->tick = absticks;
+      event->track = index;
+      track.push_back_no_copy(event);
+      if (bytes[0] == 0xff && bytes[1] == 0x2f) {
+         // end of track message
+         return 1;
+      }
+   }
+}
 
-   int i;
-   int tpq = getTicksPerQuarterNote();
-   double defaultTempo = 120.0;
-   double secondsPerTick = 60.0 / (defaultTempo * tpq);
 
-   double lastsec = 0.0;
-   double cursec = 0.0;
 
-   for (i=0; i<getNumEvents(0); i++) {
-      curtick = getEvent(0, i).tick;
-      getEvent(0, i).seconds = cursec;
-      if ((curtick > lasttick) || !tickinit) {
-         tickinit = 1;
+//////////////////////////////
+//
+// MidiFile::readTracksParallel -- Locate every MTrk chunk from the
+//    lengths in the chunk headers, then decode the chunks on separate
+//    threads.  Each thread allocates from its own arena, which is
+//    merged into the file's arena afterwards.  Returns 0 if the chunk
+//    lengths are inconsistent with the data or a track fails to decode,
+//    in which case the caller reads the tracks sequentially.  The
+//    threads decode quietly, so errors are only reported from there.
+//
 
-         // calculate the current time in seconds:
-         cursec = lastsec + (curtick - lasttick) * secondsPerTick;
-         getEvent(0, i).seconds = cursec;
+int MidiFile::readTracksParallel(const uchar*& ptr, const uchar* end,
+      int tracks) {
+   vector<const uchar*> starts(tracks);
+   vector<const uchar*> stops(tracks);
+   const uchar* scan = ptr;
+   ulong length = 0;
+   int i;
 
-         // store the new tick to second mapping
-         value.tick = curtick;
-         value.seconds = cursec;
-         timemap.push_back(value);
-         lasttick   = curtick;
-         lastsec    = cursec;
+   for (i=0; i<tracks; i++) {
+      if ((end - scan < 8) || (memcmp(scan, "MTrk", 4) != 0)) {
+         return 0;
       }
-
-      // update the tempo if needed:
-      if (getEvent(0,i).isTempo()) {
-         secondsPerTick = getEvent(0,i).getTempoSPT(getTicksPerQuarterNote());
+      scan += 4;
+      if (!readBigEndian4Bytes(scan, end, length)) {
+         return 0;
+      }
+      // A chunk must hold at least its end-of-track message, which has
+      // to be its last three bytes.
+      if ((length < 4) || ((ulong)(end - scan) < length) ||
+            (memcmp(scan + length - 3, "\xff\x2f\x00", 3) != 0)) {
+         return 0;
       }
+      starts[i] = scan;
+      stops[i] = scan + length;
+      events[i]->reserve((int)length/2);
+      scan += length;
+   }
+
+   int workers = threadCount < tracks ? threadCount : tracks;
+   vector<MidiEventArena*> arenas(workers);
+   vector<int> status(tracks, 1);
+   vector<thread> threads;
+   atomic<int> next(0);
+
+   for (i=0; i<workers; i++) {
+      arenas[i] = new MidiEventArena;
+   }
+   auto work = [&](int worker) {
+      int t;
+      while ((t = next++) < tracks) {
+         const uchar* tptr = starts[t];
+         status[t] = readTrack(tptr, stops[t], *events[t], t,
+               *arenas[worker], 1);
+         if (tptr != stops[t]) {
+            // end-of-track found early: chunk length was wrong.
+            status[t] = 0;
+         }
+      }
+   };
+   for (i=1; i<workers; i++) {
+      threads.push_back(thread(work, i));
    }
-
-   // reset the states of the tracks or time values if necessary here:
-   if (timestate == TIME_STATE_DELTA) {
-      deltaTicks();
+   work(0);
+   for (i=0; i<(int)threads.size(); i++) {
+      threads[i].join();
    }
-   if (trackstate == TRACK_STATE_SPLIT) {
-      splitTracks();
+   for (i=0; i<workers; i++) {
+      arena->adopt(*arenas[i]);
+      delete arenas[i];
    }
 
-   timemapvalid = 1;
-
+   for (i=0; i<tracks; i++) {
+      if (!status[i]) {
+         return 0;
+      }
+   }
+   ptr = scan;
+   return 1;
 }
 
 
 
 //////////////////////////////
 //
-// MidiFile::extractMidiData -- Extract MIDI data from input
-//    stream.  Return value is 0 if failure; otherwise, returns 1.
+// MidiFile::extractMidiData -- Extract MIDI data from an input
+//    buffer, advancing ptr past the message.  Return value is 0 if
+//    failure; otherwise, returns 1.  If quiet is set, errors are not
+//    printed.
 //
 
-int MidiFile::extractMidiData(istream& input, vector<uchar>& array,
-   uchar& runningCommand) {
+int MidiFile::extractMidiData(const uchar*& ptr, const uchar* end,
+      vector<uchar>& array, uchar& runningCommand, int quiet) {
 
-   int character;
    uchar byte;
    array.clear();
    int runningQ;
 
-   character = input.get();
-   if (character == EOF) {
-      cerr << "Error: unexpected end of file." << endl;
+   if (ptr >= end) {
+      if (!quiet) {
+         cerr << "Error: unexpected end of file." << endl;
+      }
       return 0;
-   } else {
-      byte = (uchar)character;
    }
+   byte = *ptr++;
 
    if (byte < 0x80) {
       runningQ = 1;
       if (runningCommand == 0) {
-         cerr << "Error: running command with no previous command" << endl;
+         if (!quiet) {
+            cerr << "Error: running command with no previous command"
+                 << endl;
+         }
          return 0;
       }
       if (runningCommand >= 0xf0) {
-         cerr << "Error: running status not permitted with meta and sysex"
-              << " event." << endl;
+         if (!quiet) {
+            cerr << "Error: running status not permitted with meta and"
+                 << " sysex event." << endl;
+         }
          return 0;
       }
    } else {
@@ -2511,43 +3029,33 @@ int MidiFile::extractMidiData(istream& input, vector<uchar>& array,
       array.push_back(byte);
    }
 
-   int i;
-   uchar metai;
+   int count = 0;
    switch (runningCommand & 0xf0) {
       case 0x80:        // note off (2 more bytes)
       case 0x90:        // note on (2 more bytes)
       case 0xA0:        // aftertouch (2 more bytes)
       case 0xB0:        // cont. controller (2 more bytes)
       case 0xE0:        // pitch wheel (2 more bytes)
-         byte = MidiFile::readByte(input);
-         array.push_back(byte);
-         if (!runningQ) {
-            byte = MidiFile::readByte(input);
-            array.push_back(byte);
-         }
+         count = runningQ ? 1 : 2;
          break;
       case 0xC0:        // patch change (1 more byte)
       case 0xD0:        // channel pressure (1 more byte)
-         if (!runningQ) {
-            byte = MidiFile::readByte(input);
-            array.push_back(byte);
-         }
+         count = runningQ ? 0 : 1;
          break;
       case 0xF0:
          switch (runningCommand) {
             case 0xff:                 // meta event
-               {
-               if (!runningQ) {
-                  byte = MidiFile::readByte(input); // meta type
-               array.push_back(byte);
-               }
-               metai = MidiFile::readByte(input); // meta type
-               array.push_back(metai);
-               for (uchar j=0; j<metai; j++) {
-                  byte = MidiFile::readByte(input); // meta type
-                  array.push_back(byte);
-               }
+               // meta type and a one-byte data length:
+               if (end - ptr < 2) {
+                  if (!quiet) {
+                     cerr << "Error: unexpected end of file." << endl;
+                  }
+                  return 0;
                }
+               array.push_back(ptr[0]);
+               array.push_back(ptr[1]);
+               count = ptr[1];
+               ptr += 2;
                break;
             // The 0xf0 and 0xf7 meta commands deal with system-exclusive
             // messages. 0xf0 is used to either start a message or to store
@@ -2563,11 +3071,11 @@ int MidiFile::extractMidiData(istream& input, vector<uchar>& array,
                                       // that this is a raw byte message.
             case 0xf0:                // System Exclusive message
                {                      // (complete, or start of message).
-               int length = (int)readVLValue(input);
-               for (i=0; i<length; i++) {
-                  byte = MidiFile::readByte(input);
-                  array.push_back(byte);
+               ulong length;
+               if (!readVLValue(ptr, end, length, quiet)) {
+                  return 0;
                }
+               count = (int)length;
                }
                break;
              // other "F" MIDI commands are not expected, but can be
@@ -2575,10 +3083,21 @@ int MidiFile::extractMidiData(istream& input, vector<uchar>& array,
          }
          break;
       default:
-         cout << "Error reading midifile" << endl;
-         cout << "Command byte was " << (int)runningCommand << endl;
+         if (!quiet) {
+            cout << "Error reading midifile" << endl;
+            cout << "Command byte was " << (int)runningCommand << endl;
+         }
          return 0;
    }
+
+   if ((count < 0) || (end - ptr < count)) {
+      if (!quiet) {
+         cerr << "Error: unexpected end of file." << endl;
+      }
+      return 0;
+   }
+   array.insert(array.end(), ptr, ptr + count);
+   ptr += count;
    return 1;
 }
 
@@ -2587,62 +3106,113 @@ int MidiFile::extractMidiData(istream& input, vector<uchar>& array,
 //////////////////////////////
 //
 // MidiFile::readVLValue -- The VLV value is expected to be unpacked into
-//   a 4-byte integer, so only up to 5 bytes will be considered.
+//   a 4-byte integer, so only up to 5 bytes will be considered.  Returns
+//   0 if the buffer ends before the value does.  If quiet is set, nothing
+//   is printed and a value that is too long also returns 0, so that the
+//   caller can read it again and have the warning reported.
 //
 
-ulong MidiFile::readVLValue(istream& input) {
-   uchar b[5] = {0};
-
+int MidiFile::readVLValue(const uchar*& ptr, const uchar* end, ulong& value,
+      int quiet) {
+   value = 0;
    for (int i=0; i<5; i++) {
-      b[i] = MidiFile::readByte(input);
-      if (b[i] < 0x80) {
-         break;
+      if (ptr >= end) {
+         if (!quiet) {
+            cerr << "Error: unexpected end of file." << endl;
+         }
+         return 0;
+      }
+      value = (value << 7) | (*ptr & 0x7f);
+      if (*ptr++ < 0x80) {
+         return 1;
       }
    }
 
-   return unpackVLV(b[0], b[1], b[2], b[3], b[4]);
+   value = 0;
+   if (quiet) {
+      return 0;
+   }
+   cerr << "Error: VLV value was too long" << endl;
+   return 1;
 }
 
 
 
 //////////////////////////////
 //
-// MidiFile::unpackVLV -- converts a VLV value to an unsigned long value.
-// default values: a = b = c = d = e = 0;
+// MidiFile::readChunkTag -- Match the four-character ID at the start of
+//    a chunk ("MThd" or "MTrk").  Prints the reason and returns 0 if the
+//    tag does not match.
 //
 
-ulong MidiFile::unpackVLV(uchar a, uchar b, uchar c, uchar d, uchar e) {
-   if (e > 0x7f) {
-      cerr << "Error: VLV value was too long" << endl;
-      return 0;
+int MidiFile::readChunkTag(const uchar*& ptr, const uchar* end,
+      const char* tag, const char* where, const char* filename) {
+   for (int i=0; i<4; i++) {
+      if (ptr >= end) {
+         cerr << "In file " << filename << ": unexpected end of file." << endl;
+         cerr << "Expecting '" << tag[i] << "' at first byte" << where
+              << ", but found nothing." << endl;
+         return 0;
+      } else if (*ptr != tag[i]) {
+         cerr << "File " << filename << " is not a MIDI file" << endl;
+         cerr << "Expecting '" << tag[i] << "' at first byte" << where
+              << " but got '" << (int)*ptr << "'" << endl;
+         return 0;
+      }
+      ptr++;
    }
+   return 1;
+}
 
-   uchar bytes[5] = {a, b, c, d, e};
-   int count = 0;
-   while (bytes[count] > 0x7f && count < 5) {
-      count++;
-   }
-   count++;
 
-   ulong output = 0;
-   for (int i=0; i<count; i++) {
-      output = output << 7;
-      output = output | (bytes[i] & 0x7f);
+
+//////////////////////////////
+//
+// MidiFile::readBigEndian4Bytes -- Read a four-byte big-endian
+//    value from the buffer.
+//
+
+int MidiFile::readBigEndian4Bytes(const uchar*& ptr, const uchar* end,
+      ulong& value) {
+   if (end - ptr < 4) {
+      cerr << "Error: unexpected end of file." << endl;
+      return 0;
    }
+   value = ((ulong)ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+   ptr += 4;
+   return 1;
+}
 
-   return output;
+
+
+//////////////////////////////
+//
+// MidiFile::readBigEndian2Bytes -- Read a two-byte big-endian
+//    value from the buffer.
+//
+
+int MidiFile::readBigEndian2Bytes(const uchar*& ptr, const uchar* end,
+      ushort& value) {
+   if (end - ptr < 2) {
+      cerr << "Error: unexpected end of file." << endl;
+      return 0;
+   }
+   value = (ushort)((ptr[0] << 8) | ptr[1]);
+   ptr += 2;
+   return 1;
 }
 
 
 
 //////////////////////////////
 //
-// MidiFile::writeVLValue -- write a number to the midifile
+// MidiFile::writeVLValue -- write a number to the output buffer
 //    as a variable length value which segments a file into 7-bit
-//    values.  Maximum size of aValue is 0x7fffffff
+//    values, and return a pointer to the byte after it.  Maximum
+//    size of aValue is 0x7fffffff
 //
 
-void MidiFile::writeVLValue(long aValue, vector<uchar>& outdata) {
+uchar* MidiFile::writeVLValue(long aValue, uchar* ptr) {
    uchar bytes[5] = {0};
    bytes[0] = (uchar)(((ulong)aValue >> 28) & 0x7f);  // most significant 5 bits
    bytes[1] = (uchar)(((ulong)aValue >> 21) & 0x7f);  // next largest 7 bits
@@ -2654,10 +3224,56 @@ void MidiFile::writeVLValue(long aValue, vector<uchar>& outdata) {
    while (start<5 && bytes[start] == 0)  start++;
 
    for (int i=start; i<4; i++) {
-      bytes[i] = bytes[i] | 0x80;
-      outdata.push_back(bytes[i]);
+      *ptr++ = bytes[i] | 0x80;
    }
-   outdata.push_back(bytes[4]);
+   *ptr++ = bytes[4];
+   return ptr;
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::getVLValueSize -- Return the number of bytes which
+//    writeVLValue() uses for a number.
+//
+
+int MidiFile::getVLValueSize(long aValue) {
+   int size = 5;
+   while ((size > 1) && ((((ulong)aValue >> (7 * (size-1))) & 0x7f) == 0)) {
+      size--;
+   }
+   return size;
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::writeBigEndian4Bytes -- Store a four-byte big-endian
+//    value in the buffer, and return a pointer to the byte after it.
+//
+
+uchar* MidiFile::writeBigEndian4Bytes(uchar* ptr, ulong value) {
+   ptr[0] = (uchar)((value >> 24) & 0xff);
+   ptr[1] = (uchar)((value >> 16) & 0xff);
+   ptr[2] = (uchar)((value >>  8) & 0xff);
+   ptr[3] = (uchar)(value & 0xff);
+   return ptr + 4;
+}
+
+
+
+//////////////////////////////
+//
+// MidiFile::writeBigEndian2Bytes -- Store a two-byte big-endian
+//    value in the buffer, and return a pointer to the byte after it.
+//
+
+uchar* MidiFile::writeBigEndian2Bytes(uchar* ptr, ushort value) {
+   ptr[0] = (uchar)((value >> 8) & 0xff);
+   ptr[1] = (uchar)(value & 0xff);
+   return ptr + 2;
 }
 
 
@@ -2678,7 +3294,7 @@ void MidiFile::clear_no_deallocate(void) {
       events[i] = NULL;
    }
    events.resize(1);
-   events[0] = new MidiEventList;
+   events[0] = new MidiEventList(arena);
    timemapvalid=0;
    timemap.clear();
    // events.resize(0);   // causes a memory leak [20150205 Jorden Thatcher]
@@ -2770,43 +3386,6 @@ ostream& operator<<(ostream& out, MidiFile& aMidiFile) {
 
 
 
-//////////////////////////////
-//
-// MidiFile::ticksearch -- for finding a tick entry in the time map.
-//
-
-int MidiFile::ticksearch(const void* A, const void* B) {
-   _TickTime& a = *((_TickTime*)A);
-   _TickTime& b = *((_TickTime*)B);
-
-   if (a.tick < b.tick) {
-      return -1;
-   } else if (a.tick > b.tick) {
-      return 1;
-   }
-   return 0;
-}
-
-
-
-//////////////////////////////
-//
-// MidiFile::secondsearch -- for finding a second entry in the time map.
-//
-
-int MidiFile::secondsearch(const void* A, const void* B) {
-   _TickTime& a = *((_TickTime*)A);
-   _TickTime& b = *((_TickTime*)B);
-
-   if (a.seconds < b.seconds) {
-      return -1;
-   } else if (a.seconds > b.seconds) {
-      return 1;
-   }
-   return 0;
-}
-
-
 ///////////////////////////////////////////////////////////////////////////
 //
 // Static functions:
@@ -3076,11 +3655,24 @@ ostream& MidiFile::writeLittleEndianDouble(ostream& out, double value) {
 
 //////////////////////////////
 //
-// MidiFile::operator=(MidiFile) -- Assignment.
+// MidiFile::operator=(MidiFile) -- Assignment.  The events are owned by
+//    the arena they came with, so the two are swapped together along with
+//    the rest of the file's state.
 //
 
 MidiFile& MidiFile::operator=(MidiFile other) {
    events.swap(other.events);
+   std::swap(arena, other.arena);
+   std::swap(ticksPerQuarterNote, other.ticksPerQuarterNote);
+   std::swap(trackCount, other.trackCount);
+   std::swap(theTrackState, other.theTrackState);
+   std::swap(theTimeState, other.theTimeState);
+   readFileName.swap(other.readFileName);
+   std::swap(timemapvalid, other.timemapvalid);
+   timemap.swap(other.timemap);
+   std::swap(timemapend, other.timemapend);
+   std::swap(rwstatus, other.rwstatus);
+   std::swap(threadCount, other.threadCount);
    return *this;
 }
 
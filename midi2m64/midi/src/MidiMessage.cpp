@@ -15,7 +15,9 @@
 
 #include <vector>
 #include <iostream>
-#include <iterator>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
 
 using namespace std;
 
@@ -26,17 +28,22 @@ using namespace std;
 //
 
 MidiMessage::MidiMessage(void) {
-   // do nothing
+   count    = 0;
+   capacity = INLINE_BYTES;
 }
 
 
 MidiMessage::MidiMessage(int command) {
+   count    = 0;
+   capacity = INLINE_BYTES;
    this->resize(1);
    (*this)[0] = (uchar)command;
 }
 
 
 MidiMessage::MidiMessage(int command, int p1) {
+   count    = 0;
+   capacity = INLINE_BYTES;
    this->resize(2);
    (*this)[0] = (uchar)command;
    (*this)[1] = (uchar)p1;
@@ -44,6 +51,8 @@ MidiMessage::MidiMessage(int command, int p1) {
 
 
 MidiMessage::MidiMessage(int command, int p1, int p2) {
+   count    = 0;
+   capacity = INLINE_BYTES;
    this->resize(3);
    (*this)[0] = (uchar)command;
    (*this)[1] = (uchar)p1;
@@ -52,21 +61,32 @@ MidiMessage::MidiMessage(int command, int p1, int p2) {
 
 
 MidiMessage::MidiMessage(const MidiMessage& message) {
-   (*this) = message;
+   count    = 0;
+   capacity = INLINE_BYTES;
+   resize(message.size());
+   if (count > 0) {
+      memcpy(data(), message.data(), count);
+   }
 }
 
 
 MidiMessage::MidiMessage(const vector<uchar>& message) {
+   count    = 0;
+   capacity = INLINE_BYTES;
    setMessage(message);
 }
 
 
 MidiMessage::MidiMessage(const vector<char>& message) {
+   count    = 0;
+   capacity = INLINE_BYTES;
    setMessage(message);
 }
 
 
 MidiMessage::MidiMessage(const vector<int>& message) {
+   count    = 0;
+   capacity = INLINE_BYTES;
    setMessage(message);
 }
 
@@ -78,7 +98,11 @@ MidiMessage::MidiMessage(const vector<int>& message) {
 //
 
 MidiMessage::~MidiMessage() {
-   resize(0);
+   if (capacity > INLINE_BYTES) {
+      delete [] storage.heap;
+   }
+   count    = 0;
+   capacity = INLINE_BYTES;
 }
 
 
@@ -92,15 +116,15 @@ MidiMessage& MidiMessage::operator=(const MidiMessage& message) {
    if (this == &message) {
       return *this;
    }
-   (*this) = message;
+   resize(message.size());
+   if (count > 0) {
+      memcpy(data(), message.data(), count);
+   }
    return *this;
 }
 
 
 MidiMessage& MidiMessage::operator=(const vector<uchar>& bytes) {
-   if (this == &bytes) {
-      return *this;
-   }
    setMessage(bytes);
    return *this;
 }
@@ -141,6 +165,166 @@ int MidiMessage::getSize(void) const {
 
 
 
+//////////////////////////////
+//
+// MidiMessage::size -- Return the number of bytes in the message.
+//
+
+int MidiMessage::size(void) const {
+   return count;
+}
+
+
+
+//////////////////////////////
+//
+// MidiMessage::empty -- Returns true if there are no bytes in the message.
+//
+
+int MidiMessage::empty(void) const {
+   return count == 0;
+}
+
+
+
+//////////////////////////////
+//
+// MidiMessage::resize -- Change the number of bytes in the message.
+//   Any newly added bytes are set to 0.  The storage is moved to the
+//   heap only when the size exceeds the inline capacity.
+//
+
+void MidiMessage::resize(int asize) {
+   if (asize < 0) {
+      asize = 0;
+   }
+   if (asize > capacity) {
+      grow(asize > 2 * capacity ? asize : 2 * capacity);
+   }
+   if (asize > count) {
+      memset(data() + count, 0, asize - count);
+   }
+   count = asize;
+}
+
+
+
+//////////////////////////////
+//
+// MidiMessage::reserve -- Pre-allocate storage for the given number of
+//   bytes without changing the size of the message.
+//
+
+void MidiMessage::reserve(int asize) {
+   if (asize > capacity) {
+      grow(asize);
+   }
+}
+
+
+
+//////////////////////////////
+//
+// MidiMessage::clear -- Remove all bytes from the message.  Heap storage
+//   is kept for reuse.
+//
+
+void MidiMessage::clear(void) {
+   count = 0;
+}
+
+
+
+//////////////////////////////
+//
+// MidiMessage::push_back -- Append a byte to the end of the message.
+//
+
+void MidiMessage::push_back(uchar value) {
+   if (count >= capacity) {
+      grow(2 * capacity);
+   }
+   data()[count++] = value;
+}
+
+
+
+//////////////////////////////
+//
+// MidiMessage::operator[] -- Access a byte of the message.  The index is
+//   not bounds checked.
+//
+
+uchar& MidiMessage::operator[](int index) {
+   return data()[index];
+}
+
+
+const uchar& MidiMessage::operator[](int index) const {
+   return data()[index];
+}
+
+
+
+//////////////////////////////
+//
+// MidiMessage::back -- Return the last byte of the message.
+//
+
+uchar& MidiMessage::back(void) {
+   return data()[count-1];
+}
+
+
+
+//////////////////////////////
+//
+// MidiMessage::data -- Return a pointer to the message bytes.
+//
+
+uchar* MidiMessage::data(void) {
+   return capacity > INLINE_BYTES ? storage.heap : storage.local;
+}
+
+
+const uchar* MidiMessage::data(void) const {
+   return capacity > INLINE_BYTES ? storage.heap : storage.local;
+}
+
+
+
+//////////////////////////////
+//
+// MidiMessage::begin -- Iterator to the first byte of the message.
+//
+
+uchar* MidiMessage::begin(void) {
+   return data();
+}
+
+
+const uchar* MidiMessage::begin(void) const {
+   return data();
+}
+
+
+
+//////////////////////////////
+//
+// MidiMessage::end -- Iterator to one past the last byte of the message.
+//
+
+uchar* MidiMessage::end(void) {
+   return data() + count;
+}
+
+
+const uchar* MidiMessage::end(void) const {
+   return data() + count;
+}
+
+
+
 //////////////////////////////
 //
 // MidiMessage::setSizeToCommand -- Set the number of parameters if the
@@ -1337,7 +1521,9 @@ void MidiMessage::makeMetaMessage(int mnum, const string& data) {
       }
    } else {
       push_back(data.size());
-      std::copy(data.begin(), data.end(), std::back_inserter(*this));
+      for (int i=0; i<dsize; i++) {
+         push_back(data[i]);
+      }
    }
 }
 
@@ -1421,3 +1607,35 @@ void MidiMessage::makeCue(const string& text) {
 
 
 
+///////////////////////////////////////////////////////////////////////////
+//
+// private functions
+//
+
+
+//////////////////////////////
+//
+// MidiMessage::grow -- Move the message bytes into a heap buffer of
+//   the given capacity, which must be larger than both the inline
+//   buffer and the current message, and fit in an int.
+//
+
+void MidiMessage::grow(size_t newcapacity) {
+   if ((newcapacity <= INLINE_BYTES) || (newcapacity <= (size_t)count) ||
+         (newcapacity > INT_MAX)) {
+      cerr << "Error: bad MidiMessage capacity: " << newcapacity << endl;
+      exit(1);
+   }
+   uchar* newbytes = new uchar[newcapacity];
+   if (count > 0) {
+      memcpy(newbytes, data(), count);
+   }
+   if (capacity > INLINE_BYTES) {
+      delete [] storage.heap;
+   }
+   storage.heap = newbytes;
+   capacity = newcapacity;
+}
+
+
+
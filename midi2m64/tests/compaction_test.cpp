@@ -0,0 +1,397 @@
+// Checks that the single-scan compaction in Track::convert_clock_base,
+// ControllerSource::convert_clock_base and Sequence::optimize keeps the
+// same events as the erase-based passes they replaced, on generated
+// dense controller streams and notes which collide on the same tick.
+
+// main.cpp is compiled into the test so that its classes can be used
+// directly; its entry point is renamed out of the way.
+#define main midi2m64_main
+#include "../main.cpp"
+#undef main
+
+#include "test_check.h"
+#include <random>
+
+#define TEST_RUN_N 2000
+
+// the erase-based passes, as they were before the compaction
+
+void reference_convert_events(vector<ControllerEvent>& events,
+	int _from_base, int _total_ticks)
+{
+	float divisor;
+	int i;
+	int d_duration;
+	int prev_duration;
+	divisor = 48.0f / (float)_from_base;
+	i = 0;
+	while(i < events.size())
+	{
+		if (i < (events.size() - 1))
+		{
+			d_duration = (events[i + 1].ticks - events[i].ticks)*divisor;
+		}
+		else
+		{
+			d_duration = (_total_ticks - events[i].ticks)*divisor;
+		}
+		events[i].ticks *= divisor;
+		if (i > 0)
+		{
+			if (events[i].ticks == events[i - 1].ticks)
+			{
+				if (d_duration > prev_duration)
+				{
+					events.erase(events.begin() + i - 1);
+					prev_duration = d_duration;
+				}
+				else
+				{
+					events.erase(events.begin() + i);
+				}
+			}
+			else
+			{
+				prev_duration = d_duration;
+				i++;
+			}
+		}
+		else
+		{
+			prev_duration = d_duration;
+			i++;
+		}
+	}
+}
+
+void reference_convert_notes(vector<NoteEvent>& notes,
+	int _from_base, int _total_ticks)
+{
+	float divisor;
+	int i;
+	int d_duration;
+	int prev_duration;
+	divisor = 48.0f / (float)_from_base;
+	i = 0;
+	while (i < notes.size())
+	{
+		if (i < (notes.size() - 1))
+		{
+			d_duration = (notes[i + 1].ticks - notes[i].ticks)*divisor;
+		}
+		else
+		{
+			d_duration = (_total_ticks - notes[i].ticks)*divisor;
+		}
+		notes[i].ticks *= divisor;
+		if (i > 0)
+		{
+			if (notes[i].ticks == notes[i - 1].ticks)
+			{
+				if (((d_duration > prev_duration) ||
+					((notes[i].type == NoteType::Note) &&
+						(notes[i - 1].type == NoteType::Rest))) &&
+					!((notes[i].type == NoteType::Rest) &&
+						(notes[i - 1].type == NoteType::Note)))
+				{
+					notes.erase(notes.begin() + i - 1);
+					prev_duration = d_duration;
+				}
+				else
+				{
+					notes.erase(notes.begin() + i);
+				}
+			}
+			else
+			{
+				prev_duration = d_duration;
+				i++;
+			}
+		}
+		else
+		{
+			prev_duration = d_duration;
+			i++;
+		}
+	}
+}
+
+// the old optimize read _events[0] after the trailing rest check even if
+// that had removed the only event; here it stops there instead
+void reference_optimize(vector<NoteEvent>& _notes,
+	vector<QuantizedEvent>& _events)
+{
+	int cur_event;
+	int this_note;
+	int last_rest_ticks;
+	int last_value;
+	bool passed_note;
+	NoteType last_type;
+
+	this_note = 0;
+	last_type = NoteType::Note;
+	cur_event = 0;
+
+	while(cur_event < _events.size())
+	{
+		passed_note = false;
+		while (_notes[this_note].ticks <= _events[cur_event].ticks)
+		{
+			if (_notes[this_note].type == NoteType::Note)
+			{
+				passed_note = true;
+			}
+			this_note++;
+			if (this_note >= _notes.size()) break;
+		}
+		this_note--;
+		if (!passed_note)
+		{
+			if (last_type == NoteType::Rest)
+			{
+				_events.erase(_events.begin() + cur_event - 1);
+			}
+			else
+			{
+				cur_event++;
+			}
+		}
+		else
+		{
+			cur_event++;
+		}
+		last_type = _notes[this_note].type;
+	}
+	cur_event--;
+	if (_notes[_notes.size() - 1].type != NoteType::Note)
+	{
+		last_rest_ticks = _notes[_notes.size() - 1].ticks;
+		if (_events[cur_event].ticks >= last_rest_ticks)
+		{
+			_events.pop_back();
+		}
+	}
+	if (_events.empty())
+	{
+		return;
+	}
+
+	last_value = _events[0].value;
+	cur_event = 1;
+	while (cur_event < _events.size())
+	{
+		if (_events[cur_event].value == last_value)
+		{
+			_events.erase(_events.begin() + cur_event);
+		}
+		else
+		{
+			last_value = _events[cur_event].value;
+			cur_event++;
+		}
+	}
+}
+
+bool same_events(const vector<ControllerEvent>& _a,
+	const vector<ControllerEvent>& _b)
+{
+	int i;
+	if (_a.size() != _b.size())
+	{
+		return false;
+	}
+	for (i = 0; i < _a.size(); i++)
+	{
+		if ((_a[i].ticks != _b[i].ticks) || (_a[i].value != _b[i].value))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool same_notes(const vector<NoteEvent>& _a, const vector<NoteEvent>& _b)
+{
+	int i;
+	if (_a.size() != _b.size())
+	{
+		return false;
+	}
+	for (i = 0; i < _a.size(); i++)
+	{
+		if ((_a[i].type != _b[i].type) || (_a[i].ticks != _b[i].ticks) ||
+			(_a[i].note != _b[i].note) || (_a[i].velocity != _b[i].velocity))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool same_quantized(const vector<QuantizedEvent>& _a,
+	const vector<QuantizedEvent>& _b)
+{
+	int i;
+	if (_a.size() != _b.size())
+	{
+		return false;
+	}
+	for (i = 0; i < _a.size(); i++)
+	{
+		if ((_a[i].ticks != _b[i].ticks) || (_a[i].value != _b[i].value))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// a bend or CC stream several events per tick after scaling down from
+// _from_base to 48 ticks per quarter
+void make_controller_stream(mt19937& _rng, int _from_base,
+	vector<ControllerEvent>& _events, int& _total_ticks)
+{
+	int n;
+	int tick;
+	int i;
+	n = 1 + _rng() % 400;
+	tick = _rng() % 8;
+	_events.clear();
+	for (i = 0; i < n; i++)
+	{
+		_events.push_back(ControllerEvent(tick,
+			(float)(_rng() % 128) / 127.0f));
+		tick += _rng() % ((_from_base / 48) + 2);
+	}
+	_total_ticks = tick + _rng() % 64;
+}
+
+// notes and rests, many of them starting on the same tick after scaling
+void make_notes(mt19937& _rng, int _from_base, vector<NoteEvent>& _notes,
+	int& _total_ticks)
+{
+	int n;
+	int tick;
+	int i;
+	n = 1 + _rng() % 200;
+	tick = 0;
+	_notes.clear();
+	for (i = 0; i < n; i++)
+	{
+		_notes.push_back(NoteEvent(
+			(_rng() % 3 == 0) ? NoteType::Rest : NoteType::Note, tick,
+			(float)(_rng() % 128) / 127.0f, 40 + _rng() % 40));
+		tick += _rng() % (2 * (_from_base / 48) + 2);
+	}
+	_total_ticks = tick + _rng() % 64;
+}
+
+// a layer starting at tick 0 and quantized events on it, with few enough
+// values that repeats are common
+void make_layer_events(mt19937& _rng, vector<NoteEvent>& _notes,
+	vector<QuantizedEvent>& _events)
+{
+	QuantizedEvent event;
+	int n;
+	int tick;
+	int i;
+	n = 1 + _rng() % 100;
+	tick = 0;
+	_notes.clear();
+	for (i = 0; i < n; i++)
+	{
+		_notes.push_back(NoteEvent(
+			(_rng() % 2 == 0) ? NoteType::Rest : NoteType::Note, tick));
+		tick += 1 + _rng() % 24;
+	}
+	n = 1 + _rng() % 300;
+	tick = 0;
+	_events.clear();
+	for (i = 0; i < n; i++)
+	{
+		event.ticks = tick;
+		event.value = _rng() % 4;
+		_events.push_back(event);
+		tick += _rng() % 6;
+	}
+}
+
+void test_controller_clock_base(mt19937& _rng)
+{
+	ControllerSource source;
+	vector<ControllerEvent> expected;
+	int from_base;
+	int total_ticks;
+	int run;
+	for (run = 0; run < TEST_RUN_N; run++)
+	{
+		from_base = 48 * (1 + _rng() % 20);
+		make_controller_stream(_rng, from_base, source.events, total_ticks);
+		expected = source.events;
+		reference_convert_events(expected, from_base, total_ticks);
+		source.convert_clock_base(from_base, total_ticks);
+		CHECK(same_events(source.events, expected));
+	}
+}
+
+void test_track_clock_base(mt19937& _rng)
+{
+	Track track;
+	vector<NoteEvent> expected;
+	int from_base;
+	int total_ticks;
+	int run;
+	for (run = 0; run < TEST_RUN_N; run++)
+	{
+		from_base = 48 * (1 + _rng() % 20);
+		make_notes(_rng, from_base, track.notes, total_ticks);
+		expected = track.notes;
+		reference_convert_notes(expected, from_base, total_ticks);
+		track.convert_clock_base(from_base, total_ticks);
+		CHECK(same_notes(track.notes, expected));
+	}
+}
+
+void test_optimize(mt19937& _rng)
+{
+	Sequence seq;
+	Track track;
+	vector<QuantizedEvent> events;
+	vector<QuantizedEvent> expected;
+	int run;
+	for (run = 0; run < TEST_RUN_N; run++)
+	{
+		make_layer_events(_rng, track.notes, events);
+		expected = events;
+		reference_optimize(track.notes, expected);
+		seq.optimize(track, events);
+		CHECK(same_quantized(events, expected));
+	}
+}
+
+// the only event falls in the trailing rest, so the rest check removes it
+// and nothing is left for the duplicate pass
+void test_optimize_trailing_rest()
+{
+	Sequence seq;
+	Track track;
+	vector<QuantizedEvent> events;
+	QuantizedEvent event;
+	track.notes.push_back(NoteEvent(NoteType::Note, 0));
+	track.notes.push_back(NoteEvent(NoteType::Rest, 10));
+	event.ticks = 20;
+	event.value = 5;
+	events.push_back(event);
+	seq.optimize(track, events);
+	CHECK(events.empty());
+}
+
+int main()
+{
+	mt19937 rng(64);
+	test_controller_clock_base(rng);
+	test_track_clock_base(rng);
+	test_optimize(rng);
+	test_optimize_trailing_rest();
+	return test_result("compaction_test");
+}
@@ -0,0 +1,1107 @@
+// Converts the sample MIDI files as main() does and decodes the m64 data
+// that comes out. However the encoder chooses to write them, the notes,
+// their timing and the controller commands of every channel must be the
+// ones the Sequence held when create_m64() was called.
+
+// main.cpp is compiled into the test so that its classes can be used
+// directly; its entry point is renamed out of the way.
+#define main midi2m64_main
+#include "../main.cpp"
+#undef main
+
+#include "m64_decoder.h"
+#include "test_check.h"
+#include <random>
+#include <set>
+#include <sstream>
+
+#define TEST_RUN_N 2000
+
+const char* sample_names[] = {
+	"LastImpactElectro.mid",
+	"Legacy64.mid",
+	"pitchtest.mid",
+	"smrpgtest.mid"
+};
+#define SAMPLE_N 4
+
+string sample_dir;
+
+// the steps main() takes from the parsed MIDI file to the m64 data
+void convert_parsed(Sequence& _seq, vector<uchar>& _m64)
+{
+	int i;
+	for (i = 0; i < _seq.sources.size(); i++)
+	{
+		if (_seq.sources[i].type == ControllerSourceType::Tempo)
+		{
+			_seq.tempo_source = i;
+			break;
+		}
+		_seq.sources[i].owner_track_id = -1;
+	}
+	for (i = 0; i < _seq.tracks.size(); i++)
+	{
+		Track& track = _seq.tracks[i];
+		if (track.fine_pitch_source != PARAM_SOURCE_NONE)
+		{
+			_seq.sources[track.fine_pitch_source].owner_track_id = i;
+		}
+		if (track.pan_source != PARAM_SOURCE_NONE)
+		{
+			_seq.sources[track.pan_source].owner_track_id = i;
+		}
+		if (track.volume_source != PARAM_SOURCE_NONE)
+		{
+			_seq.sources[track.volume_source].owner_track_id = i;
+		}
+	}
+	_seq.convert_clock_base();
+	_seq.cut_loop();
+	_seq.trim_events();
+	_seq.thread_count = 4;
+	_seq.refactor_all_pitch_bends();
+	_seq.thin_sources();
+	_seq.quantize_sources();
+	_seq.optimize_all();
+	_seq.simplify_sources();
+	_m64 = _seq.create_m64();
+}
+
+bool convert(const string& _path, Sequence& _seq, vector<uchar>& _m64)
+{
+	SequenceBuilder builder(_seq);
+	MidiFile midifile;
+	midifile.parse(_path, builder);
+	if (!midifile.status())
+	{
+		return false;
+	}
+	builder.finish();
+	convert_parsed(_seq, _m64);
+	return true;
+}
+
+bool same_commands(const vector<M64Command>& _a,
+	const vector<M64Command>& _b)
+{
+	int i;
+	if (_a.size() != _b.size())
+	{
+		return false;
+	}
+	for (i = 0; i < _a.size(); i++)
+	{
+		if ((_a[i].ticks != _b[i].ticks) || (_a[i].code != _b[i].code) ||
+			(_a[i].value != _b[i].value))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void add_command(vector<M64Command>& _commands, int _ticks, int _code,
+	int _value)
+{
+	M64Command command;
+	command.ticks = _ticks;
+	command.code = _code;
+	command.value = _value;
+	_commands.push_back(command);
+}
+
+// the tempo commands of the sequence script
+vector<M64Command> expected_tempos(Sequence& _seq)
+{
+	vector<M64Command> commands;
+	int i;
+	if (_seq.tempo_source == PARAM_SOURCE_NONE)
+	{
+		add_command(commands, 0, 0xDD, 0x78);
+	}
+	for (i = 0; (_seq.tempo_source != PARAM_SOURCE_NONE) &&
+		(i < _seq.tempo_events.size()); i++)
+	{
+		add_command(commands, _seq.tempo_events[i].ticks, 0xDD,
+			_seq.tempo_events[i].value & 0xFF);
+	}
+	return commands;
+}
+
+// the controller commands of a channel: the values of parameters which
+// never change, then the events of the others merged by tick, earlier
+// parameters first on the same tick; values are written as one byte
+vector<M64Command> expected_commands(Sequence& _seq, Track& _track)
+{
+	Sequence::ChannelParam params[CHANNEL_PARAM_N];
+	vector<M64Command> commands;
+	bool fixed[CHANNEL_PARAM_N];
+	int value;
+	int j;
+	int k;
+	_seq.get_channel_params(params);
+	for (j = 0; j < CHANNEL_PARAM_N; j++)
+	{
+		fixed[j] = _seq.get_fixed_value(_track, params, j, value);
+		if (fixed[j])
+		{
+			add_command(commands, 0, params[j].event_code, value & 0xFF);
+		}
+	}
+	for (j = 0; j < CHANNEL_PARAM_N; j++)
+	{
+		if (fixed[j])
+		{
+			continue;
+		}
+		for (k = 0; k < _track.param_events[j].size(); k++)
+		{
+			add_command(commands, _track.param_events[j][k].ticks,
+				params[j].event_code,
+				_track.param_events[j][k].value & 0xFF);
+		}
+	}
+	stable_sort(commands.begin(), commands.end(),
+		[](const M64Command& _a, const M64Command& _b)
+		{
+			return _a.ticks < _b.ticks;
+		});
+	return commands;
+}
+
+// the notes of a track's layer: each starts on its tick with the key and
+// velocity the layer writes, and sounds until the next note or rest; the
+// gate byte may lengthen it by less than a tick
+bool same_notes(Sequence& _seq, const Track& _track, M64Layer& _layer)
+{
+	const vector<NoteEvent>& notes = _track.notes;
+	float velocity;
+	int end;
+	int key;
+	int i;
+	int j;
+	j = 0;
+	for (i = 0; i < notes.size(); i++)
+	{
+		if (notes[i].type != NoteType::Note)
+		{
+			continue;
+		}
+		if (j >= _layer.notes.size())
+		{
+			return false;
+		}
+		M64Note& note = _layer.notes[j++];
+		end = (i + 1 < notes.size()) ? notes[i + 1].ticks :
+			_seq.total_ticks;
+		key = _track.map_directly ? notes[i].note :
+			notes[i].note - NOTE_BIAS;
+		velocity = notes[i].velocity * _track.velocity_multiplier;
+		velocity = min(max(velocity, 0.0f), 1.0f);
+		if ((note.ticks != notes[i].ticks) || (note.key != key) ||
+			(note.velocity != (uchar)(velocity * 100.0)) ||
+			(note.duration < end - notes[i].ticks) ||
+			(note.duration >= end - notes[i].ticks + 1))
+		{
+			return false;
+		}
+	}
+	return j == _layer.notes.size();
+}
+
+// layer _k of a track as a track of its own
+Track voice_track(Track& _track, int _k)
+{
+	Track voice(_track);
+	voice.notes = _track.voice(_k);
+	voice.voices.clear();
+	return voice;
+}
+
+void test_convert()
+{
+	Sequence* seq;
+	vector<uchar> m64;
+	vector<uchar> plain;
+	M64Song song;
+	int i;
+	int j;
+	int k;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		seq = new Sequence;
+		CHECK(convert(sample_dir + "/" + sample_names[i], *seq, m64));
+		seq->use_subroutines = false;
+		plain = seq->create_m64();
+		CHECK(m64.size() <= plain.size());
+		M64Decoder decoder(m64);
+		if (!decoder.decode(song))
+		{
+			cerr << sample_names[i] << ": " << decoder.error << "\n";
+			CHECK(false);
+			delete seq;
+			continue;
+		}
+		CHECK(song.bank == seq->bank);
+		CHECK(song.total_ticks == seq->total_ticks);
+		CHECK(same_commands(song.tempos, expected_tempos(*seq)));
+		CHECK(song.channels.size() == seq->tracks.size());
+		for (j = 0; (j < song.channels.size()) &&
+			(j < seq->tracks.size()); j++)
+		{
+			Track& track = seq->tracks[j];
+			M64Channel& channel = song.channels[j];
+			CHECK(channel.instrument == track.instrument);
+			CHECK(channel.total_ticks == seq->total_ticks);
+			CHECK(same_commands(channel.commands,
+				expected_commands(*seq, track)));
+			CHECK(channel.layers.size() == track.voice_count());
+			for (k = 0; (k < channel.layers.size()) &&
+				(k < track.voice_count()); k++)
+			{
+				CHECK(same_notes(*seq, voice_track(track, k),
+					channel.layers[k]));
+				CHECK(channel.layers[k].total_ticks == seq->total_ticks);
+			}
+		}
+		delete seq;
+	}
+}
+
+// a track of notes with keys spread over most of the transposable range,
+// with rests between some of them, as the builder writes them, and
+// lengths up to past a gate's reach; returns where the track ends
+int make_notes(mt19937& _rng, Track& _track)
+{
+	NoteType type;
+	int n;
+	int tick;
+	int i;
+	n = 1 + _rng() % 200;
+	tick = 0;
+	type = NoteType::Rest;
+	for (i = 0; i < n; i++)
+	{
+		type = ((type == NoteType::Note) && (_rng() % 4 == 0)) ?
+			NoteType::Rest : NoteType::Note;
+		_track.notes.push_back(NoteEvent(type, tick,
+			(float)(_rng() % 128) / 127.0f, _rng() % 200));
+		tick += 1 + _rng() % ((_rng() % 8 == 0) ? 400 : 24);
+	}
+	return tick;
+}
+
+void make_track(mt19937& _rng, Sequence& _seq)
+{
+	Track track;
+	_seq.total_ticks = make_notes(_rng, track);
+	_seq.tracks.clear();
+	_seq.tracks.push_back(track);
+}
+
+// layers of random notes, whose keys need the layer to be transposed often
+void test_random_layers(mt19937& _rng)
+{
+	Sequence seq;
+	vector<uchar> m64;
+	M64Song song;
+	int run;
+	for (run = 0; run < TEST_RUN_N; run++)
+	{
+		make_track(_rng, seq);
+		m64 = seq.create_m64();
+		M64Decoder decoder(m64);
+		if (!decoder.decode(song))
+		{
+			cerr << "random layer " << run << ": " << decoder.error << "\n";
+			CHECK(false);
+			continue;
+		}
+		CHECK(song.channels.size() == 1);
+		if ((song.channels.size() == 1) &&
+			(song.channels[0].layers.size() == 1))
+		{
+			CHECK(same_notes(seq, seq.tracks[0],
+				song.channels[0].layers[0]));
+			CHECK(song.channels[0].layers[0].total_ticks == seq.total_ticks);
+		}
+	}
+}
+
+// layers made of a few random bars, each repeated and shifted in key, so
+// that runs of the layer are moved into subroutines
+void test_repeated_layers(mt19937& _rng)
+{
+	Sequence seq;
+	Track track;
+	vector<vector<NoteEvent> > bars;
+	vector<uchar> m64;
+	vector<uchar> plain;
+	M64Song song;
+	int smaller;
+	int run;
+	int tick;
+	int bar;
+	int shift;
+	int i;
+	int j;
+	smaller = 0;
+	for (run = 0; run < TEST_RUN_N / 10; run++)
+	{
+		bars.resize(1 + _rng() % 4);
+		for (i = 0; i < bars.size(); i++)
+		{
+			bars[i].clear();
+			tick = 0;
+			for (j = 1 + _rng() % 16; j > 0; j--)
+			{
+				bars[i].push_back(NoteEvent((_rng() % 5 == 0) ?
+					NoteType::Rest : NoteType::Note, tick,
+					(float)(_rng() % 4) / 3.0f, 40 + _rng() % 60));
+				tick += 6 * (1 + _rng() % 8);
+			}
+			bars[i].push_back(NoteEvent(NoteType::Rest, tick));
+		}
+		track.clear();
+		tick = 0;
+		for (i = 4 + _rng() % 40; i > 0; i--)
+		{
+			bar = _rng() % bars.size();
+			shift = (_rng() % 3 == 0) ? _rng() % 12 : 0;
+			for (j = 0; j + 1 < bars[bar].size(); j++)
+			{
+				track.notes.push_back(bars[bar][j]);
+				track.notes.back().ticks += tick;
+				track.notes.back().note += shift;
+			}
+			tick += bars[bar].back().ticks;
+		}
+		// runs of rests as the builder writes them, with one at the end
+		for (i = track.notes.size(); i-- > 1;)
+		{
+			if ((track.notes[i].type == NoteType::Rest) &&
+				(track.notes[i - 1].type == NoteType::Rest))
+			{
+				track.notes.erase(track.notes.begin() + i);
+			}
+		}
+		seq.tracks.clear();
+		seq.tracks.push_back(track);
+		seq.total_ticks = tick;
+
+		seq.use_subroutines = false;
+		plain = seq.create_m64();
+		seq.use_subroutines = true;
+		m64 = seq.create_m64();
+		CHECK(m64.size() <= plain.size());
+		smaller += (m64.size() < plain.size()) ? 1 : 0;
+		M64Decoder decoder(m64);
+		if (!decoder.decode(song))
+		{
+			cerr << "repeated layer " << run << ": " << decoder.error << "\n";
+			CHECK(false);
+			continue;
+		}
+		CHECK(song.channels.size() == 1);
+		if ((song.channels.size() == 1) &&
+			(song.channels[0].layers.size() == 1))
+		{
+			CHECK(same_notes(seq, seq.tracks[0],
+				song.channels[0].layers[0]));
+			CHECK(song.channels[0].layers[0].total_ticks == seq.total_ticks);
+		}
+	}
+	CHECK(smaller > TEST_RUN_N / 20);
+}
+
+// a track of random notes and a copy of it, delayed and transposed, which
+// is cut off at the end of the song; the copy's channel is transposed to
+// play the other's layers, which it shares when it is not delayed. Some
+// tracks have a second layer, a fifth away from the first.
+void test_layer_copies(mt19937& _rng)
+{
+	Sequence seq;
+	Track track;
+	vector<uchar> m64;
+	vector<uchar> single;
+	M64Song song;
+	int delay;
+	int transpose;
+	int run;
+	int i;
+	int j;
+	int k;
+	for (run = 0; run < TEST_RUN_N / 4; run++)
+	{
+		make_track(_rng, seq);
+		if (run % 3 == 2)
+		{
+			seq.tracks[0].voices.push_back(seq.tracks[0].notes);
+			for (i = 0; i < seq.tracks[0].voices[0].size(); i++)
+			{
+				NoteEvent& note = seq.tracks[0].voices[0][i];
+				note.note += (note.note < 128) ? 7 : -7;
+			}
+		}
+		delay = (run % 2 == 0) ? 0 : _rng() % (seq.total_ticks / 2 + 1);
+		transpose = (int)(_rng() % 25) - 12;
+		track = seq.tracks[0];
+		for (k = 0; k < track.voice_count(); k++)
+		{
+			for (i = 0; i < track.voice(k).size(); i++)
+			{
+				j = track.voice(k)[i].note + transpose;
+				if ((j < 0) || (j > 255))
+				{
+					transpose = 0;
+				}
+			}
+		}
+		for (k = 0; k < track.voice_count(); k++)
+		{
+			vector<NoteEvent>& notes = seq.tracks[0].voice(k);
+			track.voice(k).clear();
+			if (delay > 0)
+			{
+				track.voice(k).push_back(NoteEvent(NoteType::Rest, 0));
+			}
+			for (i = 0; (i < notes.size()) &&
+				(notes[i].ticks + delay < seq.total_ticks); i++)
+			{
+				track.voice(k).push_back(notes[i]);
+				track.voice(k).back().ticks += delay;
+				track.voice(k).back().note += transpose;
+			}
+		}
+		seq.use_subroutines = (run % 4 < 2);
+		single = seq.create_m64();
+		seq.tracks.push_back(track);
+		m64 = seq.create_m64();
+		seq.use_subroutines = true;
+		CHECK(seq.layer_copies.size() == 2);
+		if (seq.layer_copies.size() == 2)
+		{
+			CHECK(seq.layer_copies[0].source < 0);
+			CHECK(seq.layer_copies[1].source == 0);
+			CHECK(seq.layer_copies[1].delay == delay);
+			CHECK(seq.layer_copies[1].transpose == transpose);
+		}
+		if (delay == 0)
+		{
+			// only the copy's channel script is added
+			CHECK(m64.size() <= single.size() + 32);
+		}
+		M64Decoder decoder(m64);
+		if (!decoder.decode(song))
+		{
+			cerr << "layer copy " << run << ": " << decoder.error << "\n";
+			CHECK(false);
+			continue;
+		}
+		CHECK(song.channels.size() == 2);
+		for (i = 0; i < song.channels.size(); i++)
+		{
+			CHECK(song.channels[i].layers.size() == track.voice_count());
+			for (k = 0; (k < song.channels[i].layers.size()) &&
+				(k < track.voice_count()); k++)
+			{
+				CHECK(same_notes(seq, voice_track(seq.tracks[i], k),
+					song.channels[i].layers[k]));
+				CHECK(song.channels[i].layers[k].total_ticks ==
+					seq.total_ticks);
+			}
+		}
+	}
+}
+
+// the value each command code holds after the commands on or before
+// _ticks, starting from the values in _state
+map<int, int> state_at(map<int, int> _state,
+	const vector<M64Command>& _commands, int _ticks)
+{
+	int i;
+	for (i = 0; (i < _commands.size()) && (_commands[i].ticks <= _ticks); i++)
+	{
+		_state[_commands[i].code] = _commands[i].value;
+	}
+	return _state;
+}
+
+// whether two lists of commands hold the same values on every tick,
+// starting from the values in _state
+bool same_values(const map<int, int>& _state, const vector<M64Command>& _a,
+	const vector<M64Command>& _b)
+{
+	set<int> ticks;
+	set<int>::iterator tick;
+	int i;
+	for (i = 0; i < _a.size(); ticks.insert(_a[i++].ticks));
+	for (i = 0; i < _b.size(); ticks.insert(_b[i++].ticks));
+	for (tick = ticks.begin(); tick != ticks.end(); tick++)
+	{
+		if (state_at(_state, _a, *tick) != state_at(_state, _b, *tick))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// whether a loop played again holds the same values on every tick as it
+// did the first time, starting from the values left at its end; the
+// first time starts from the values in _state
+bool same_loop_values(const map<int, int>& _state,
+	const vector<M64Command>& _first, const vector<M64Command>& _again,
+	int _loop_ticks)
+{
+	map<int, int> end_state;
+	set<int> ticks;
+	set<int>::iterator tick;
+	int i;
+	end_state = state_at(_state, _first, INT_MAX);
+	ticks.insert(_loop_ticks);
+	for (i = 0; i < _first.size(); i++)
+	{
+		if (_first[i].ticks >= _loop_ticks)
+		{
+			ticks.insert(_first[i].ticks);
+		}
+	}
+	for (i = 0; i < _again.size(); ticks.insert(_again[i++].ticks));
+	for (tick = ticks.begin(); tick != ticks.end(); tick++)
+	{
+		if (state_at(_state, _first, *tick) !=
+			state_at(end_state, _again, *tick))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// whether a layer plays the notes of its loop again as it did the first
+// time
+bool same_loop_notes(M64Layer& _layer)
+{
+	int i;
+	int j;
+	for (i = 0; (i < _layer.notes.size()) &&
+		(_layer.notes[i].ticks < _layer.loop_ticks); i++);
+	if (_layer.notes.size() - i != _layer.loop_notes.size())
+	{
+		return false;
+	}
+	for (j = 0; j < _layer.loop_notes.size(); i++, j++)
+	{
+		if ((_layer.notes[i].ticks != _layer.loop_notes[j].ticks) ||
+			(_layer.notes[i].key != _layer.loop_notes[j].key) ||
+			(_layer.notes[i].velocity != _layer.loop_notes[j].velocity) ||
+			(_layer.notes[i].duration != _layer.loop_notes[j].duration))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// events of a channel parameter or the tempo, on random ticks
+void make_events(mt19937& _rng, vector<QuantizedEvent>& _events,
+	int _total_ticks)
+{
+	QuantizedEvent event;
+	_events.clear();
+	for (event.ticks = _rng() % 30; event.ticks < _total_ticks;
+		event.ticks += 1 + _rng() % 60)
+	{
+		event.value = _rng() % 128;
+		_events.push_back(event);
+	}
+}
+
+// checks a looping song against the sequence it was made from; a value
+// is taken to be its parameter's default until it is first set
+void check_loop(Sequence& _seq, vector<uchar>& _m64, const string& _name)
+{
+	Sequence::ChannelParam params[CHANNEL_PARAM_N];
+	map<int, int> tempo;
+	map<int, int> defaults;
+	M64Song song;
+	int j;
+	int k;
+	_seq.get_channel_params(params);
+	for (j = 0; j < CHANNEL_PARAM_N; j++)
+	{
+		defaults[params[j].event_code] = params[j].default_value;
+	}
+	tempo[0xDD] = 0x78;
+	M64Decoder decoder(_m64);
+	if (!decoder.decode(song))
+	{
+		cerr << _name << ": " << decoder.error << "\n";
+		CHECK(false);
+		return;
+	}
+	CHECK(song.loop_ticks == _seq.loop_start_ticks);
+	CHECK(song.total_ticks == _seq.total_ticks);
+	CHECK(same_values(tempo, song.tempos, expected_tempos(_seq)));
+	CHECK(same_loop_values(tempo, song.tempos, song.loop_tempos,
+		song.loop_ticks));
+	CHECK(song.channels.size() == _seq.tracks.size());
+	for (j = 0; (j < song.channels.size()) && (j < _seq.tracks.size()); j++)
+	{
+		M64Channel& channel = song.channels[j];
+		CHECK(channel.loop_ticks == _seq.loop_start_ticks);
+		CHECK(channel.total_ticks == _seq.total_ticks);
+		CHECK(same_values(defaults, channel.commands,
+			expected_commands(_seq, _seq.tracks[j])));
+		CHECK(same_loop_values(defaults, channel.commands,
+			channel.loop_commands, channel.loop_ticks));
+		CHECK(channel.layers.size() == _seq.tracks[j].voice_count());
+		for (k = 0; (k < channel.layers.size()) &&
+			(k < _seq.tracks[j].voice_count()); k++)
+		{
+			CHECK(same_notes(_seq, voice_track(_seq.tracks[j], k),
+				channel.layers[k]));
+			CHECK(channel.layers[k].loop_ticks == _seq.loop_start_ticks);
+			CHECK(channel.layers[k].total_ticks == _seq.total_ticks);
+			CHECK(same_loop_notes(channel.layers[k]));
+		}
+	}
+}
+
+// a MIDI file with loop markers ends on the loop end, and every script
+// of its m64 data jumps back to the loop start
+void test_loop_markers()
+{
+	MidiFile generated;
+	stringstream output;
+	string bytes;
+	Sequence seq;
+	SequenceBuilder builder(seq);
+	vector<uchar> m64;
+	int i;
+	int j;
+	generated.setTicksPerQuarterNote(96);
+	generated.addTrack(2);
+	generated.addMarker(0, 384, "Loop Start");
+	generated.addMarker(0, 1536, "loopEnd");
+	for (i = 0; i < 24; i++)
+	{
+		generated.addNoteOn(1, i * 96, 0, 60 + i % 5, 100);
+		generated.addNoteOff(1, i * 96 + 80, 0, 60 + i % 5);
+		generated.addNoteOn(2, i * 300, 1, 40, 90);
+		generated.addNoteOff(2, i * 300 + 290, 1, 40);
+		generated.addController(2, i * 100, 1, 0x07, 127 - i);
+	}
+	generated.sortTracks();
+	generated.write(output);
+	bytes = output.str();
+	CHECK(generated.parse((const uchar*)bytes.data(), bytes.size(),
+		builder) != 0);
+	builder.finish();
+	convert_parsed(seq, m64);
+	CHECK(seq.loop_start_ticks == 192);
+	CHECK(seq.total_ticks == 768);
+	CHECK(seq.tracks.size() == 2);
+	for (i = 0; i < seq.tracks.size(); i++)
+	{
+		for (j = 0; (j < seq.tracks[i].notes.size()) &&
+			(seq.tracks[i].notes[j].ticks != 192); j++);
+		CHECK(j < seq.tracks[i].notes.size());
+		CHECK(seq.tracks[i].notes.back().ticks < 768);
+	}
+	check_loop(seq, m64, "loop markers");
+}
+
+// the layer _k of the tracks converted from one MIDI track: the first
+// VOICE_MAX layers on the first track, then on each track spilled after
+Track& spilled_track(Sequence& _seq, int _k)
+{
+	return _seq.tracks[_k / VOICE_MAX];
+}
+
+// a MIDI track of up to eight lines of notes at once, at times legato or
+// in chords, keeps every note in full on as many layers as the lines
+// need; the channel's four come first, and the layers past those spill
+// onto further channels which share the track's instrument and
+// controllers. No layer is left with a note that never sounds.
+void test_voices(mt19937& _rng)
+{
+	vector<int> starts;
+	vector<int> ends;
+	vector<int> keys;
+	vector<uchar> m64;
+	M64Song song;
+	int lines;
+	int overlap;
+	int tick;
+	int length;
+	int key;
+	int run;
+	int i;
+	int j;
+	int k;
+	for (run = 0; run < TEST_RUN_N / 10; run++)
+	{
+		MidiFile generated;
+		stringstream output;
+		stringstream warnings;
+		streambuf* errors;
+		string bytes;
+		Sequence seq;
+		SequenceBuilder builder(seq);
+		starts.clear();
+		ends.clear();
+		keys.clear();
+		generated.setTicksPerQuarterNote(48);
+		generated.addTrack(1);
+		generated.addTrackName(1, 0, "Pad");
+		lines = 1 + _rng() % 8;
+		for (i = 0; i < lines; i++)
+		{
+			key = 0;
+			for (tick = (run % 5 == 0) ? 0 : _rng() % 50; tick < 1000;
+				tick += length +
+					((run % 5 == 0) ? 24 * (_rng() % 2) : _rng() % 40))
+			{
+				// the lines have keys of their own, and a line never
+				// strikes a key again as it lets it go
+				length = 1 + _rng() % 100;
+				key = (key + 1 + _rng() % 11) % 12;
+				if (run % 5 == 0)
+				{
+					length = 24;
+				}
+				starts.push_back(tick);
+				ends.push_back(tick + length);
+				keys.push_back(24 + 12 * i + key);
+				generated.addNoteOn(1, tick, 0, keys.back(),
+					1 + _rng() % 127);
+				generated.addNoteOff(1, tick + length, 0, keys.back());
+			}
+		}
+		generated.addController(1, 0, 0, 0x0A, 20);
+		generated.addPitchBend(1, 0, 0, 0.25);
+		generated.sortTracks();
+		generated.write(output);
+		bytes = output.str();
+		errors = cerr.rdbuf(warnings.rdbuf());
+		CHECK(generated.parse((const uchar*)bytes.data(), bytes.size(),
+			builder) != 0);
+		builder.finish();
+		convert_parsed(seq, m64);
+		cerr.rdbuf(errors);
+		overlap = 0;
+		for (i = 0; i < starts.size(); i++)
+		{
+			for (k = 0, j = 0; j < starts.size(); j++)
+			{
+				k += ((starts[j] <= starts[i]) && (ends[j] > starts[i]));
+			}
+			overlap = max(overlap, k);
+		}
+		CHECK(warnings.str().find("Track \"Pad\"") == string::npos);
+		CHECK(seq.tracks.size() == (overlap + VOICE_MAX - 1) / VOICE_MAX);
+		if (seq.tracks.size() != (overlap + VOICE_MAX - 1) / VOICE_MAX)
+		{
+			continue;
+		}
+		for (i = 0; i < seq.tracks.size(); i++)
+		{
+			CHECK(seq.tracks[i].voice_count() ==
+				min(overlap - i * VOICE_MAX, VOICE_MAX));
+			CHECK(seq.tracks[i].name ==
+				((i == 0) ? string("Pad") :
+					"Pad (" + to_string(i + 1) + ")"));
+			CHECK(seq.tracks[i].instrument == seq.tracks[0].instrument);
+			CHECK(seq.tracks[i].pan_source == seq.tracks[0].pan_source);
+			CHECK((seq.tracks[i].fine_pitch_source != PARAM_SOURCE_NONE) &&
+				((i == 0) || (seq.tracks[i].fine_pitch_source !=
+					seq.tracks[0].fine_pitch_source)));
+		}
+		for (k = 0; k < overlap; k++)
+		{
+			vector<NoteEvent>& notes =
+				spilled_track(seq, k).voice(k % VOICE_MAX);
+			for (j = 1; j < notes.size(); j++)
+			{
+				CHECK(notes[j - 1].ticks < notes[j].ticks);
+			}
+		}
+		for (i = 0; i < starts.size(); i++)
+		{
+			// the note, and the next event on its layer not before its end
+			for (k = 0; k < overlap; k++)
+			{
+				vector<NoteEvent>& notes =
+					spilled_track(seq, k).voice(k % VOICE_MAX);
+				for (j = 0; (j < notes.size()) &&
+					((notes[j].ticks != starts[i]) ||
+						(notes[j].type != NoteType::Note) ||
+						(notes[j].note != keys[i])); j++);
+				if (j < notes.size())
+				{
+					break;
+				}
+			}
+			CHECK(k < overlap);
+			if (k < overlap)
+			{
+				vector<NoteEvent>& notes =
+					spilled_track(seq, k).voice(k % VOICE_MAX);
+				CHECK((j + 1 == notes.size()) ||
+					(notes[j + 1].ticks >= ends[i]));
+			}
+		}
+		M64Decoder decoder(m64);
+		if (!decoder.decode(song))
+		{
+			cerr << "voices " << run << ": " << decoder.error << "\n";
+			CHECK(false);
+			continue;
+		}
+		CHECK(song.channels.size() == seq.tracks.size());
+		for (i = 0; (i < song.channels.size()) && (i < seq.tracks.size());
+			i++)
+		{
+			Track& track = seq.tracks[i];
+			CHECK(song.channels[i].layers.size() == track.voice_count());
+			for (k = 0; (k < song.channels[i].layers.size()) &&
+				(k < track.voice_count()); k++)
+			{
+				CHECK(same_notes(seq, voice_track(track, k),
+					song.channels[i].layers[k]));
+			}
+		}
+	}
+}
+
+// an eight-note pad chord plays in full: four notes on the track's
+// channel and four on a second channel, with no note cut short
+void test_dense_chord()
+{
+	MidiFile generated;
+	stringstream output;
+	stringstream warnings;
+	streambuf* errors;
+	string bytes;
+	Sequence seq;
+	SequenceBuilder builder(seq);
+	vector<uchar> m64;
+	int i;
+	generated.setTicksPerQuarterNote(48);
+	generated.addTrack(1);
+	generated.addTrackName(1, 0, "Strings");
+	for (i = 0; i < 8; i++)
+	{
+		generated.addNoteOn(1, 0, 0, 48 + i * 4, 100);
+		generated.addNoteOff(1, 96, 0, 48 + i * 4);
+	}
+	generated.addNoteOn(1, 192, 0, 60, 100);
+	generated.addNoteOff(1, 240, 0, 60);
+	generated.sortTracks();
+	generated.write(output);
+	bytes = output.str();
+	errors = cerr.rdbuf(warnings.rdbuf());
+	CHECK(generated.parse((const uchar*)bytes.data(), bytes.size(),
+		builder) != 0);
+	cerr.rdbuf(errors);
+	builder.finish();
+	convert_parsed(seq, m64);
+	CHECK(warnings.str().empty());
+	CHECK(seq.tracks.size() == 2);
+	if (seq.tracks.size() != 2)
+	{
+		return;
+	}
+	CHECK(seq.tracks[1].name == "Strings (2)");
+	for (i = 0; i < 8; i++)
+	{
+		vector<NoteEvent>& notes = spilled_track(seq, i).voice(i % VOICE_MAX);
+		CHECK(spilled_track(seq, i).voice_count() == VOICE_MAX);
+		CHECK((notes.size() >= 2) && (notes[0].ticks == 0) &&
+			(notes[0].type == NoteType::Note) &&
+			(notes[0].note == 48 + i * 4) &&
+			(notes[1].ticks == 96));
+	}
+}
+
+// sources whose only events lie at the end of the song are dropped by
+// finish(), and the tracks which follow still point at their own sources
+void test_late_sources()
+{
+	MidiFile generated;
+	stringstream output;
+	string bytes;
+	Sequence seq;
+	SequenceBuilder builder(seq);
+	int i;
+	generated.setTicksPerQuarterNote(48);
+	generated.addTracks(2);
+	for (i = 1; i <= 2; i++)
+	{
+		generated.addTrackName(i, 0, "T" + to_string(i));
+		generated.addNoteOn(i, 0, 0, 60, 100);
+		generated.addNoteOff(i, 96, 0, 60);
+		generated.addController(i, 10, 0, 0x07, 100);
+	}
+	generated.addPitchBend(1, 96, 0, 0.5);
+	generated.addController(1, 96, 0, 0x0A, 20);
+	generated.sortTracks();
+	generated.write(output);
+	bytes = output.str();
+	CHECK(generated.parse((const uchar*)bytes.data(), bytes.size(),
+		builder) != 0);
+	builder.finish();
+	CHECK(seq.total_ticks == 96);
+	CHECK(seq.sources.size() == 2);
+	CHECK(seq.tracks.size() == 2);
+	if ((seq.sources.size() != 2) || (seq.tracks.size() != 2))
+	{
+		return;
+	}
+	for (i = 0; i < 2; i++)
+	{
+		CHECK(seq.tracks[i].fine_pitch_source == PARAM_SOURCE_NONE);
+		CHECK(seq.tracks[i].pan_source == PARAM_SOURCE_NONE);
+		CHECK(seq.tracks[i].volume_source == i);
+		CHECK(seq.sources[i].type == ControllerSourceType::Volume);
+		CHECK(seq.sources[i].owner_track_name == "T" + to_string(i + 1));
+		CHECK(seq.sources[i].events.size() == 1);
+	}
+}
+
+// songs of random tracks with controller events, tempo changes and a
+// loop, which is sometimes only marked at one end
+void test_random_loops(mt19937& _rng)
+{
+	Sequence* seq;
+	vector<uchar> m64;
+	int tracks;
+	int run;
+	int i;
+	for (run = 0; run < TEST_RUN_N / 10; run++)
+	{
+		seq = new Sequence;
+		seq->total_ticks = 1;
+		for (tracks = 1 + _rng() % 3; tracks > 0; tracks--)
+		{
+			seq->tracks.push_back(Track());
+			seq->total_ticks = max(seq->total_ticks,
+				make_notes(_rng, seq->tracks.back()));
+		}
+		seq->loop_start_ticks = (_rng() % 4 == 0) ? -1 :
+			_rng() % seq->total_ticks;
+		seq->loop_end_ticks = (_rng() % 4 == 0) ? -1 :
+			max(seq->loop_start_ticks, 0) + 1 +
+				_rng() % (seq->total_ticks - max(seq->loop_start_ticks, 0));
+		seq->cut_loop();
+		if (seq->loop_start_ticks < 0)
+		{
+			delete seq;
+			continue;
+		}
+		seq->tempo_source = 0;
+		make_events(_rng, seq->tempo_events, seq->total_ticks);
+		for (i = 0; i < seq->tracks.size(); i++)
+		{
+			seq->tracks[i].pan_source = 0;
+			seq->tracks[i].volume_source = 0;
+			make_events(_rng, seq->tracks[i].param_events[2],
+				seq->total_ticks);
+			make_events(_rng, seq->tracks[i].param_events[4],
+				seq->total_ticks);
+		}
+		seq->use_subroutines = (run % 2 == 0);
+		m64 = seq->create_m64();
+		check_loop(*seq, m64, "random loop " + to_string(run));
+		delete seq;
+	}
+}
+
+// tracks with the same volume automation, as from cloned sources, and
+// fixed pans; the automation is written once, in a subroutine the
+// channels share, and the pans as the channels start
+void test_shared_controllers(mt19937& _rng)
+{
+	Sequence seq;
+	vector<QuantizedEvent> volume;
+	vector<uchar> m64;
+	vector<uchar> alone;
+	M64Song song;
+	int run;
+	int i;
+	for (run = 0; run < TEST_RUN_N / 10; run++)
+	{
+		seq.tracks.clear();
+		seq.total_ticks = 1;
+		for (i = 2 + _rng() % 3; i > 0; i--)
+		{
+			seq.tracks.push_back(Track());
+			seq.total_ticks = max(seq.total_ticks,
+				make_notes(_rng, seq.tracks.back()));
+		}
+		make_events(_rng, volume, seq.total_ticks);
+		for (i = 0; i < seq.tracks.size(); i++)
+		{
+			seq.tracks[i].pan_source = 0;
+			seq.tracks[i].param_events[2].assign(1, QuantizedEvent());
+			seq.tracks[i].param_events[2][0].ticks = 0;
+			seq.tracks[i].param_events[2][0].value = _rng() % 128;
+			seq.tracks[i].volume_source = (i == 0) ? 0 : PARAM_SOURCE_NONE;
+			seq.tracks[i].param_events[4] = (i == 0) ? volume :
+				vector<QuantizedEvent>();
+		}
+		alone = seq.create_m64();
+		for (i = 1; i < seq.tracks.size(); i++)
+		{
+			seq.tracks[i].volume_source = 0;
+			seq.tracks[i].param_events[4] = volume;
+		}
+		m64 = seq.create_m64();
+		// each channel calls the automation, split into as many
+		// subroutines as a pattern's length allows
+		CHECK(m64.size() <= alone.size() + (seq.tracks.size() + 1) *
+			(4 + 3 * (volume.size() * 2 / PATTERN_MAX_N)));
+		M64Decoder decoder(m64);
+		if (!decoder.decode(song))
+		{
+			cerr << "shared controllers " << run << ": " << decoder.error
+				<< "\n";
+			CHECK(false);
+			continue;
+		}
+		CHECK(song.channels.size() == seq.tracks.size());
+		for (i = 0; (i < song.channels.size()) &&
+			(i < seq.tracks.size()); i++)
+		{
+			CHECK(same_commands(song.channels[i].commands,
+				expected_commands(seq, seq.tracks[i])));
+			CHECK(song.channels[i].commands[2].code == 0xDD);
+			CHECK(song.channels[i].commands[2].ticks == 0);
+		}
+	}
+}
+
+int main(int _argc, char** _argv)
+{
+	mt19937 rng(64);
+	if (_argc != 2)
+	{
+		cerr << "Usage: convert_test <sample directory>\n";
+		return 1;
+	}
+	sample_dir = _argv[1];
+	test_convert();
+	test_random_layers(rng);
+	test_repeated_layers(rng);
+	test_layer_copies(rng);
+	test_loop_markers();
+	test_voices(rng);
+	test_dense_chord();
+	test_late_sources();
+	test_random_loops(rng);
+	test_shared_controllers(rng);
+	return test_result("convert_test");
+}
@@ -0,0 +1,581 @@
+// Decodes the m64 data written by Sequence::create_m64() back into the
+// streams it plays: the tempo changes of the sequence script, and for each
+// channel its controller commands and the notes of each of its layers,
+// all on absolute ticks. Only the commands the converter writes are
+// understood; anything else makes the decode fail. A layer ends with FF,
+// or where the next script starts or the data ends, as the converter does
+// not end its layers unless subroutines follow them; a channel's
+// subroutines count as scripts too. Channels and layers may call
+// subroutines with FC, which return with FF. A script that jumps
+// back to its loop start with FB is played through the loop once more,
+// into its loop_ lists, and ends at the second jump.
+
+#ifndef _M64_DECODER_H_INCLUDED
+#define _M64_DECODER_H_INCLUDED
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// how deep the sound driver lets a script's calls nest
+#define M64_STACK_N 4
+
+// a command with a one byte argument, such as a tempo or a channel volume
+class M64Command
+{
+public:
+	int ticks;
+	int code;
+	int value;
+};
+
+// a played note: its key is the note byte plus the layer's and the
+// channel's transpose, and it sounds for its delay less the part the gate byte cuts off
+class M64Note
+{
+public:
+	int ticks;
+	int key;
+	int velocity;
+	int delay;
+	int gate;
+	double duration;
+};
+
+// the ticks of a script's loop start are -1 if it does not loop
+class M64Layer
+{
+public:
+	std::vector<M64Note> notes;
+	std::vector<M64Note> loop_notes;
+	int total_ticks;
+	int loop_ticks;
+};
+
+class M64Channel
+{
+public:
+	int instrument;
+	int transpose;
+	std::vector<M64Command> commands;
+	std::vector<M64Command> loop_commands;
+	std::vector<M64Layer> layers;
+	int total_ticks;
+	int loop_ticks;
+};
+
+class M64Song
+{
+public:
+	int bank;
+	int channel_mask;
+	int volume;
+	std::vector<M64Command> tempos;
+	std::vector<M64Command> loop_tempos;
+	std::vector<M64Channel> channels;
+	int total_ticks;
+	int loop_ticks;
+};
+
+class M64Decoder
+{
+public:
+	M64Decoder(const std::vector<unsigned char>& _data) : data(_data)
+	{
+	}
+	// decodes the whole sequence; on failure, error says why and where
+	bool decode(M64Song& _song)
+	{
+		int pc;
+		int cmd;
+		int ticks;
+		bool done;
+		std::vector<int> channels;
+		std::vector<std::vector<int> > layers;
+		std::map<int, int> ticks_at;
+		std::vector<M64Command>* tempos;
+		int i;
+		int j;
+
+		error.clear();
+		starts.clear();
+		starts.insert(0);
+		_song.tempos.clear();
+		_song.loop_tempos.clear();
+		_song.loop_ticks = -1;
+		tempos = &_song.tempos;
+		done = false;
+		_song.channels.clear();
+		_song.bank = -1;
+		_song.channel_mask = 0;
+		_song.volume = -1;
+		pc = 0;
+		ticks = 0;
+		while (!done)
+		{
+			if (_song.loop_ticks < 0)
+			{
+				ticks_at[pc] = ticks;
+			}
+			if (!read(pc, cmd))
+			{
+				return false;
+			}
+			if (cmd == 0xFF)
+			{
+				break;
+			}
+			else if (cmd == 0xFB)
+			{
+				if (!jump(pc, ticks, ticks_at, _song.loop_ticks,
+					_song.total_ticks, done))
+				{
+					return false;
+				}
+				tempos = &_song.loop_tempos;
+			}
+			else if ((cmd & 0xF0) == 0x90)
+			{
+				if (!read_w(pc, i))
+				{
+					return false;
+				}
+				if ((cmd & 0x0F) != channels.size())
+				{
+					return fail(pc, "channel pointers out of order");
+				}
+				channels.push_back(i);
+			}
+			else if (cmd == 0xD3)
+			{
+				if (!read(pc, _song.bank))
+				{
+					return false;
+				}
+			}
+			else if (cmd == 0xD7)
+			{
+				if (!read_w(pc, _song.channel_mask))
+				{
+					return false;
+				}
+			}
+			else if (cmd == 0xDB)
+			{
+				if (!read(pc, _song.volume))
+				{
+					return false;
+				}
+			}
+			else if (cmd == 0xDD)
+			{
+				if (!add_command(pc, cmd, ticks, *tempos))
+				{
+					return false;
+				}
+			}
+			else if (cmd == 0xFD)
+			{
+				if (!read_delay(pc, ticks))
+				{
+					return false;
+				}
+			}
+			else
+			{
+				return fail(pc - 1, "unknown sequence command");
+			}
+		}
+		if (_song.loop_ticks < 0)
+		{
+			_song.total_ticks = ticks;
+		}
+		starts.insert(channels.begin(), channels.end());
+		_song.channels.resize(channels.size());
+		layers.resize(channels.size());
+		for (i = 0; i < channels.size(); i++)
+		{
+			if (!decode_channel(channels[i], _song.channels[i], layers[i]))
+			{
+				return false;
+			}
+		}
+		// the layers once all scripts are known, so each stops at the
+		// start of the next
+		for (i = 0; i < channels.size(); i++)
+		{
+			_song.channels[i].layers.resize(layers[i].size());
+			for (j = 0; j < layers[i].size(); j++)
+			{
+				if (!decode_layer(layers[i][j], _song.channels[i].transpose,
+					_song.channels[i].layers[j]))
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+	std::string error;
+private:
+	// decodes a channel script, and gives where its layers start
+	bool decode_channel(int _pc, M64Channel& _channel,
+		std::vector<int>& _layers)
+	{
+		int pc;
+		int cmd;
+		int ticks;
+		int layer;
+		bool done;
+		std::vector<int> stack;
+		std::map<int, int> ticks_at;
+		std::vector<M64Command>* commands;
+
+		_channel.instrument = -1;
+		_channel.transpose = 0;
+		_channel.commands.clear();
+		_channel.loop_commands.clear();
+		_channel.loop_ticks = -1;
+		commands = &_channel.commands;
+		done = false;
+		pc = _pc;
+		ticks = 0;
+		while (!done)
+		{
+			if ((_channel.loop_ticks < 0) && stack.empty())
+			{
+				ticks_at[pc] = ticks;
+			}
+			if (!read(pc, cmd))
+			{
+				return false;
+			}
+			if (cmd == 0xFF)
+			{
+				if (stack.empty())
+				{
+					break;
+				}
+				pc = stack.back();
+				stack.pop_back();
+			}
+			else if (cmd == 0xFC)
+			{
+				if (!call(pc, stack))
+				{
+					return false;
+				}
+				// a channel's subroutine is a script a layer may run into
+				starts.insert(pc);
+			}
+			else if (cmd == 0xFB)
+			{
+				if (!stack.empty())
+				{
+					return fail(pc - 1, "jump in a subroutine");
+				}
+				if (!jump(pc, ticks, ticks_at, _channel.loop_ticks,
+					_channel.total_ticks, done))
+				{
+					return false;
+				}
+				commands = &_channel.loop_commands;
+			}
+			else if (cmd == 0xC4)
+			{
+				// starts the channel; it takes no argument
+			}
+			else if ((cmd & 0xF0) == 0x90)
+			{
+				if (!read_w(pc, layer))
+				{
+					return false;
+				}
+				if ((cmd & 0x0F) != _layers.size())
+				{
+					return fail(pc, "layer pointers out of order");
+				}
+				_layers.push_back(layer);
+				starts.insert(layer);
+			}
+			else if (cmd == 0xC1)
+			{
+				if (!read(pc, _channel.instrument))
+				{
+					return false;
+				}
+			}
+			else if (cmd == 0xDB)
+			{
+				if (!read(pc, _channel.transpose))
+				{
+					return false;
+				}
+				_channel.transpose = (signed char)_channel.transpose;
+			}
+			else if ((cmd == 0xD3) || (cmd == 0xD4) || (cmd == 0xD8) ||
+				(cmd == 0xDD) || (cmd == 0xDF))
+			{
+				if (!add_command(pc, cmd, ticks, *commands))
+				{
+					return false;
+				}
+			}
+			else if (cmd == 0xFD)
+			{
+				if (!read_delay(pc, ticks))
+				{
+					return false;
+				}
+			}
+			else
+			{
+				return fail(pc - 1, "unknown channel command");
+			}
+		}
+		if (_channel.loop_ticks < 0)
+		{
+			_channel.total_ticks = ticks;
+		}
+		return true;
+	}
+	// decodes a layer of a channel transposed by _channel_transpose
+	bool decode_layer(int _pc, int _channel_transpose, M64Layer& _layer)
+	{
+		M64Note note;
+		int pc;
+		int cmd;
+		int ticks;
+		int transpose;
+		int held_delay;
+		bool done;
+		std::vector<int> stack;
+		std::map<int, int> ticks_at;
+		std::vector<M64Note>* notes;
+
+		_layer.notes.clear();
+		_layer.loop_notes.clear();
+		_layer.loop_ticks = -1;
+		notes = &_layer.notes;
+		done = false;
+		pc = _pc;
+		ticks = 0;
+		transpose = 0;
+		held_delay = 0;
+		while ((!done) && (pc < data.size()) &&
+			((pc == _pc) || (starts.count(pc) == 0)))
+		{
+			if ((_layer.loop_ticks < 0) && stack.empty())
+			{
+				ticks_at[pc] = ticks;
+			}
+			if (!read(pc, cmd))
+			{
+				return false;
+			}
+			if (cmd == 0xFF)
+			{
+				if (stack.empty())
+				{
+					break;
+				}
+				pc = stack.back();
+				stack.pop_back();
+			}
+			else if (cmd == 0xFC)
+			{
+				if (!call(pc, stack))
+				{
+					return false;
+				}
+			}
+			else if (cmd == 0xFB)
+			{
+				if (!stack.empty())
+				{
+					return fail(pc - 1, "jump in a subroutine");
+				}
+				if (!jump(pc, ticks, ticks_at, _layer.loop_ticks,
+					_layer.total_ticks, done))
+				{
+					return false;
+				}
+				notes = &_layer.loop_notes;
+			}
+			else if (cmd == 0xC0)
+			{
+				if (!read_delay(pc, ticks))
+				{
+					return false;
+				}
+			}
+			else if (cmd == 0xC2)
+			{
+				if (!read(pc, transpose))
+				{
+					return false;
+				}
+				transpose = (signed char)transpose;
+			}
+			else if (cmd < 0xC0)
+			{
+				note.ticks = ticks;
+				note.key = (cmd & 0x3F) + transpose + _channel_transpose;
+				note.gate = 0;
+				if (cmd < 0x80)
+				{
+					if (!read_v(pc, held_delay))
+					{
+						return false;
+					}
+				}
+				else if (held_delay == 0)
+				{
+					return fail(pc - 1, "mode 3 note with no delay");
+				}
+				note.delay = held_delay;
+				if (!read(pc, note.velocity))
+				{
+					return false;
+				}
+				if ((cmd < 0x40) || (cmd >= 0x80))
+				{
+					if (!read(pc, note.gate))
+					{
+						return false;
+					}
+				}
+				note.duration = note.delay - note.delay * note.gate / 255.0;
+				notes->push_back(note);
+				ticks += note.delay;
+			}
+			else
+			{
+				return fail(pc - 1, "unknown layer command");
+			}
+		}
+		if (_layer.loop_ticks < 0)
+		{
+			_layer.total_ticks = ticks;
+		}
+		return true;
+	}
+	// jumps to the subroutine whose pointer is at _pc, keeping where to
+	// return to
+	bool call(int& _pc, std::vector<int>& _stack)
+	{
+		int target;
+		if (!read_w(_pc, target))
+		{
+			return false;
+		}
+		if (_stack.size() >= M64_STACK_N)
+		{
+			return fail(_pc - 3, "calls nested too deep");
+		}
+		_stack.push_back(_pc);
+		_pc = target;
+		return true;
+	}
+	// follows the jump whose pointer is at _pc back to a command already
+	// played, on _loop_ticks, ending the first pass on _end_ticks; at the
+	// second jump the loop has been played again and _done is set
+	bool jump(int& _pc, int& _ticks, std::map<int, int>& _ticks_at,
+		int& _loop_ticks, int& _end_ticks, bool& _done)
+	{
+		int target;
+		if (!read_w(_pc, target))
+		{
+			return false;
+		}
+		if (_loop_ticks >= 0)
+		{
+			_done = true;
+			if (_ticks != _end_ticks)
+			{
+				return fail(_pc - 3, "loop played again ends elsewhere");
+			}
+			return true;
+		}
+		if (_ticks_at.count(target) == 0)
+		{
+			return fail(_pc - 3, "jump to no command played before");
+		}
+		_end_ticks = _ticks;
+		_loop_ticks = _ticks_at[target];
+		_ticks = _loop_ticks;
+		_pc = target;
+		return true;
+	}
+	bool add_command(int& _pc, int _code, int _ticks,
+		std::vector<M64Command>& _commands)
+	{
+		M64Command command;
+		command.ticks = _ticks;
+		command.code = _code;
+		if (!read(_pc, command.value))
+		{
+			return false;
+		}
+		_commands.push_back(command);
+		return true;
+	}
+	bool read_delay(int& _pc, int& _ticks)
+	{
+		int delay;
+		if (!read_v(_pc, delay))
+		{
+			return false;
+		}
+		_ticks += delay;
+		return true;
+	}
+	bool read(int& _pc, int& _x)
+	{
+		if ((_pc < 0) || (_pc >= data.size()))
+		{
+			return fail(_pc, "read past the end of the data");
+		}
+		_x = data[_pc++];
+		return true;
+	}
+	bool read_w(int& _pc, int& _x)
+	{
+		int low;
+		if (!read(_pc, _x) || !read(_pc, low))
+		{
+			return false;
+		}
+		_x = (_x << 8) | low;
+		return true;
+	}
+	// a value of one byte below 0x80, or a word with the top bit set
+	bool read_v(int& _pc, int& _x)
+	{
+		if (!read(_pc, _x))
+		{
+			return false;
+		}
+		if (_x & 0x80)
+		{
+			_pc--;
+			if (!read_w(_pc, _x))
+			{
+				return false;
+			}
+			_x &= 0x7FFF;
+		}
+		return true;
+	}
+	bool fail(int _pc, const std::string& _what)
+	{
+		error = _what + " at offset " + std::to_string(_pc);
+		return false;
+	}
+	const std::vector<unsigned char>& data;
+	// where each script starts
+	std::set<int> starts;
+};
+
+#endif
@@ -0,0 +1,237 @@
+// Checks the storage of MidiMessage bytes, which are inline up to eight
+// bytes and on the heap beyond that, and the ownership of MidiEvents by
+// event lists, which either own their events one by one or leave them to
+// a MidiEventArena.
+
+#include "MidiEventList.h"
+#include "MidiEventArena.h"
+#include "test_check.h"
+#include <string>
+#include <utility>
+
+using namespace std;
+
+#define EVENT_N 5000
+#define MESSAGE_SIZE_MAX 40
+
+// a message of _n bytes filled with a pattern which depends on _seed
+MidiMessage make_message(int _n, int _seed)
+{
+	MidiMessage message;
+	int i;
+	message.resize(_n);
+	for (i = 0; i < _n; i++)
+	{
+		message[i] = (uchar)(_seed + 7 * i);
+	}
+	return message;
+}
+
+bool has_bytes(const MidiMessage& _message, int _n, int _seed)
+{
+	int i;
+	if (_message.size() != _n)
+	{
+		return false;
+	}
+	for (i = 0; i < _n; i++)
+	{
+		if (_message[i] != (uchar)(_seed + 7 * i))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// copies of short and long messages, and copies which are then changed
+void test_copy_messages()
+{
+	int n;
+	for (n = 0; n <= MESSAGE_SIZE_MAX; n++)
+	{
+		MidiMessage source = make_message(n, n);
+		MidiMessage copy(source);
+		CHECK(has_bytes(copy, n, n));
+		if (n > 0)
+		{
+			copy[0]++;
+			CHECK(has_bytes(source, n, n));
+		}
+		copy.push_back(0);
+		CHECK(has_bytes(source, n, n));
+		CHECK(copy.size() == n + 1);
+	}
+}
+
+// assignments between every pair of sizes, across the inline limit in
+// both directions, and onto the message itself
+void test_assign_messages()
+{
+	int from;
+	int to;
+	for (from = 0; from <= MESSAGE_SIZE_MAX; from += 3)
+	{
+		for (to = 0; to <= MESSAGE_SIZE_MAX; to += 3)
+		{
+			MidiMessage source = make_message(from, 1);
+			MidiMessage target = make_message(to, 2);
+			target = source;
+			CHECK(has_bytes(target, from, 1));
+			CHECK(has_bytes(source, from, 1));
+			source.clear();
+			CHECK(has_bytes(target, from, 1));
+		}
+		MidiMessage self = make_message(from, 3);
+		MidiMessage& alias = self;
+		self = alias;
+		CHECK(has_bytes(self, from, 3));
+	}
+}
+
+// growing keeps the bytes and zeroes the new ones; shrinking keeps the
+// front
+void test_resize_messages()
+{
+	MidiMessage message = make_message(6, 4);
+	int i;
+	message.resize(MESSAGE_SIZE_MAX);
+	CHECK(message.size() == MESSAGE_SIZE_MAX);
+	for (i = 0; i < 6; i++)
+	{
+		CHECK(message[i] == (uchar)(4 + 7 * i));
+	}
+	for (i = 6; i < MESSAGE_SIZE_MAX; i++)
+	{
+		CHECK(message[i] == 0);
+	}
+	message.resize(3);
+	CHECK(has_bytes(message, 3, 4));
+	message.makeMarker(string(MESSAGE_SIZE_MAX, 'x'));
+	CHECK(message.isMeta());
+	CHECK(message.size() == MESSAGE_SIZE_MAX + 3);
+	message.makeNoteOn(1, 60, 100);
+	CHECK(message.size() == 3);
+	CHECK(message.getKeyNumber() == 60);
+}
+
+// events with long messages copied through a list
+void test_copy_long_events()
+{
+	MidiEventArena arena;
+	MidiEventList list(&arena);
+	MidiEventList copy;
+	MidiEvent event;
+	int i;
+	for (i = 0; i < 100; i++)
+	{
+		event.makeMarker(string(i, 'a' + i % 26));
+		event.tick = i;
+		list.append(event);
+	}
+	copy = list;
+	list.clear();
+	arena.reset();
+	for (i = 0; i < 100; i++)
+	{
+		CHECK(copy[i].size() == i + 3);
+		CHECK((i == 0) || (copy[i][3] == 'a' + i % 26));
+	}
+}
+
+void fill(MidiEventList& _list, int _n)
+{
+	MidiEvent event;
+	int i;
+	for (i = 0; i < _n; i++)
+	{
+		event.makeNoteOn(0, i % 128, 100);
+		event.tick = i;
+		_list.append(event);
+	}
+}
+
+bool has_events(MidiEventList& _list, int _n)
+{
+	int i;
+	if (_list.size() != _n)
+	{
+		return false;
+	}
+	for (i = 0; i < _n; i++)
+	{
+		if ((_list[i].tick != i) || (_list[i].getKeyNumber() != i % 128))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// a moved arena list keeps the arena; the list moved from owns neither
+// the events nor the arena, so clearing it or adding to it afterwards
+// leaves the moved events alone
+void test_move_arena_list()
+{
+	MidiEventArena arena;
+	MidiEventList from(&arena);
+	fill(from, EVENT_N);
+	MidiEventList to(move(from));
+	CHECK(to.getArena() == &arena);
+	CHECK(from.getArena() == NULL);
+	CHECK(from.size() == 0);
+	from.clear();
+	fill(from, 10);
+	CHECK(has_events(from, 10));
+	from.clear();
+	CHECK(has_events(to, EVENT_N));
+	CHECK(arena.getSize() == EVENT_N);
+	to.clear();
+	CHECK(to.size() == 0);
+	arena.reset();
+	CHECK(arena.getSize() == 0);
+}
+
+// a heap list moved into and then assigned over an arena list
+void test_assign_lists()
+{
+	MidiEventArena arena;
+	MidiEventList arena_list(&arena);
+	MidiEventList heap_list;
+	fill(arena_list, EVENT_N);
+	fill(heap_list, 100);
+	arena_list = move(heap_list);
+	CHECK(arena_list.getArena() == NULL);
+	CHECK(has_events(arena_list, 100));
+	heap_list = arena_list;
+	CHECK(has_events(heap_list, 100));
+	arena_list.clear();
+	CHECK(has_events(heap_list, 100));
+}
+
+// a copy of an arena list owns its own events
+void test_copy_arena_list()
+{
+	MidiEventList* copy;
+	MidiEventArena* arena = new MidiEventArena;
+	MidiEventList* list = new MidiEventList(arena);
+	fill(*list, EVENT_N);
+	copy = new MidiEventList(*list);
+	CHECK(copy->getArena() == NULL);
+	delete list;
+	delete arena;
+	CHECK(has_events(*copy, EVENT_N));
+	delete copy;
+}
+
+int main()
+{
+	test_copy_messages();
+	test_assign_messages();
+	test_resize_messages();
+	test_copy_long_events();
+	test_move_arena_list();
+	test_assign_lists();
+	test_copy_arena_list();
+	return test_result("midievent_test");
+}
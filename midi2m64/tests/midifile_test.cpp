@@ -0,0 +1,368 @@
+// Checks MidiFile reading and writing on the sample files, whose bytes
+// are exactly what MidiFile::write() produces for them, so a file read
+// and written again must come back byte for byte.
+
+#include "MidiFile.h"
+#include "MidiEventVisitor.h"
+#include "test_check.h"
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+const char* sample_names[] = {
+	"LastImpactElectro.mid",
+	"Legacy64.mid",
+	"pitchtest.mid",
+	"smrpgtest.mid"
+};
+#define SAMPLE_N 4
+
+string sample_dir;
+
+string sample_path(int _sample)
+{
+	return sample_dir + "/" + sample_names[_sample];
+}
+
+string read_bytes(const string& _path)
+{
+	ifstream input(_path.c_str(), ios::binary);
+	stringstream bytes;
+	bytes << input.rdbuf();
+	return bytes.str();
+}
+
+bool same_events(MidiFile& _a, MidiFile& _b)
+{
+	int i;
+	int j;
+	int k;
+	if ((_a.getTrackCount() != _b.getTrackCount()) ||
+		(_a.getTicksPerQuarterNote() != _b.getTicksPerQuarterNote()))
+	{
+		return false;
+	}
+	for (i = 0; i < _a.getTrackCount(); i++)
+	{
+		if (_a[i].size() != _b[i].size())
+		{
+			return false;
+		}
+		for (j = 0; j < _a[i].size(); j++)
+		{
+			MidiEvent& a = _a[i][j];
+			MidiEvent& b = _b[i][j];
+			if ((a.tick != b.tick) || (a.track != b.track) ||
+				(a.size() != b.size()))
+			{
+				return false;
+			}
+			for (k = 0; k < a.size(); k++)
+			{
+				if (a[k] != b[k])
+				{
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// read from a path, written back out
+void test_round_trip()
+{
+	MidiFile file;
+	stringstream output;
+	int i;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		CHECK(file.read(sample_path(i)) != 0);
+		CHECK(file.write(output) != 0);
+		CHECK(output.str() == read_bytes(sample_path(i)));
+		output.str("");
+	}
+}
+
+// the stream and buffer overloads decode the same events as the path one
+void test_read_overloads()
+{
+	MidiFile from_path;
+	MidiFile from_stream;
+	MidiFile from_buffer;
+	string bytes;
+	int i;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		bytes = read_bytes(sample_path(i));
+		stringstream input(bytes);
+		CHECK(from_path.read(sample_path(i)) != 0);
+		CHECK(from_stream.read(input) != 0);
+		CHECK(from_buffer.read((const uchar*)bytes.data(),
+			(int)bytes.size()) != 0);
+		CHECK(same_events(from_path, from_stream));
+		CHECK(same_events(from_path, from_buffer));
+	}
+}
+
+// every read of a cut-off file stops at the end of the buffer and fails
+void test_truncated()
+{
+	MidiFile file;
+	string bytes;
+	streambuf* errors;
+	stringstream quiet;
+	int n;
+	bytes = read_bytes(sample_path(2));
+	errors = cerr.rdbuf(quiet.rdbuf());
+	for (n = 0; n < (int)bytes.size(); n += 7)
+	{
+		// a copy of exactly n bytes, so reading past it is caught
+		vector<uchar> cut(bytes.begin(), bytes.begin() + n);
+		CHECK(file.read(cut.data(), n) == 0);
+	}
+	cerr.rdbuf(errors);
+}
+
+// copies of a file own their events, whose storage is the source file's
+// arena until they are copied
+void test_copy()
+{
+	MidiFile reference;
+	MidiFile* file;
+	MidiFile* copy;
+	MidiFile assigned;
+	int i;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		file = new MidiFile;
+		CHECK(file->read(sample_path(i)) != 0);
+		copy = new MidiFile(*file);
+		assigned = *file;
+		delete file;
+		CHECK(reference.read(sample_path(i)) != 0);
+		CHECK(same_events(reference, *copy));
+		CHECK(same_events(reference, assigned));
+		file = new MidiFile(move(*copy));
+		delete copy;
+		CHECK(same_events(reference, *file));
+		delete file;
+	}
+}
+
+// the offset of the length field of MTrk chunk _track in _bytes
+int chunk_length_offset(const string& _bytes, int _track)
+{
+	size_t pos;
+	pos = 0;
+	do
+	{
+		pos = _bytes.find("MTrk", pos + 1);
+	} while (_track-- > 0);
+	return (int)pos + 4;
+}
+
+// reads _bytes with one and with several threads, which must decode the
+// same events and report the same errors
+void check_thread_counts(const string& _bytes)
+{
+	MidiFile sequential;
+	MidiFile parallel;
+	streambuf* errors;
+	stringstream sequential_errors;
+	stringstream parallel_errors;
+	int sequential_status;
+	int parallel_status;
+	sequential.setThreadCount(1);
+	parallel.setThreadCount(4);
+	errors = cerr.rdbuf(sequential_errors.rdbuf());
+	sequential_status = sequential.read((const uchar*)_bytes.data(),
+		(int)_bytes.size());
+	cerr.rdbuf(parallel_errors.rdbuf());
+	parallel_status = parallel.read((const uchar*)_bytes.data(),
+		(int)_bytes.size());
+	cerr.rdbuf(errors);
+	CHECK(sequential_status == parallel_status);
+	CHECK(sequential_errors.str() == parallel_errors.str());
+	if (sequential_status)
+	{
+		CHECK(same_events(sequential, parallel));
+	}
+}
+
+// the samples, a file with more tracks than threads, a file with a wrong
+// chunk length, which is read sequentially, and a file with a bad event
+void test_thread_counts()
+{
+	MidiFile generated;
+	stringstream output;
+	string bytes;
+	int offset;
+	int track;
+	int i;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		check_thread_counts(read_bytes(sample_path(i)));
+	}
+
+	generated.addTrack(40);
+	for (track = 1; track <= 40; track++)
+	{
+		for (i = 0; i < 200; i++)
+		{
+			generated.addNoteOn(track, i * 10, track % 16, 30 + i % 60, 90);
+			generated.addNoteOff(track, i * 10 + 5, track % 16, 30 + i % 60);
+		}
+	}
+	generated.sortTracks();
+	generated.write(output);
+	bytes = output.str();
+	check_thread_counts(bytes);
+
+	offset = chunk_length_offset(bytes, 3);
+	bytes[offset + 3]++;
+	check_thread_counts(bytes);
+	bytes[offset + 3]--;
+
+	// running status with no command as the first event of track 3
+	bytes[offset + 5] = 0x05;
+	check_thread_counts(bytes);
+}
+
+// a message as a visitor callback reports it: a note-on with velocity 0
+// is a note-off, and the end of a track is reported with no bytes
+class VisitedMessage
+{
+public:
+	int track;
+	int tick;
+	vector<uchar> bytes;
+	bool operator==(const VisitedMessage& _other) const
+	{
+		return (track == _other.track) && (tick == _other.tick) &&
+			(bytes == _other.bytes);
+	}
+};
+
+// records each callback as the message it stands for
+class RecordingVisitor : public MidiEventVisitor
+{
+public:
+	void onHeader(int _type, int _tracks, int _tpq)
+	{
+		tracks = _tracks;
+		tpq = _tpq;
+	}
+	void onTrackEnd(int _track, int _tick)
+	{
+		add(_track, _tick, vector<uchar>());
+	}
+	void onNoteOn(int _track, int _tick, int _channel, int _key,
+		int _velocity)
+	{
+		add(_track, _tick, { (uchar)(0x90 | _channel), (uchar)_key,
+			(uchar)_velocity });
+	}
+	void onNoteOff(int _track, int _tick, int _channel, int _key,
+		int _velocity)
+	{
+		add(_track, _tick, { (uchar)(0x80 | _channel), (uchar)_key,
+			(uchar)_velocity });
+	}
+	void onController(int _track, int _tick, int _channel, int _number,
+		int _value)
+	{
+		add(_track, _tick, { (uchar)(0xb0 | _channel), (uchar)_number,
+			(uchar)_value });
+	}
+	void onPitchBend(int _track, int _tick, int _channel, int _value)
+	{
+		add(_track, _tick, { (uchar)(0xe0 | _channel),
+			(uchar)(_value & 0x7f), (uchar)(_value >> 7) });
+	}
+	void onMeta(int _track, int _tick, int _type, const uchar* _data,
+		int _length)
+	{
+		vector<uchar> bytes = { 0xff, (uchar)_type, (uchar)_length };
+		bytes.insert(bytes.end(), _data, _data + _length);
+		add(_track, _tick, bytes);
+	}
+	void onMessage(int _track, int _tick, const uchar* _bytes, int _length)
+	{
+		add(_track, _tick, vector<uchar>(_bytes, _bytes + _length));
+	}
+	void add(int _track, int _tick, const vector<uchar>& _bytes)
+	{
+		VisitedMessage message;
+		message.track = _track;
+		message.tick = _tick;
+		message.bytes = _bytes;
+		messages.push_back(message);
+	}
+	int tracks;
+	int tpq;
+	vector<VisitedMessage> messages;
+};
+
+// parse() reports, in file order, the messages read() stores
+void test_parse()
+{
+	MidiFile file;
+	RecordingVisitor visitor;
+	vector<VisitedMessage> expected;
+	VisitedMessage message;
+	int i;
+	int j;
+	int k;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		visitor.messages.clear();
+		CHECK(file.read(sample_path(i)) != 0);
+		CHECK(file.parse(sample_path(i), visitor) != 0);
+		CHECK(visitor.tracks == file.getTrackCount());
+		CHECK(visitor.tpq == file.getTicksPerQuarterNote());
+		expected.clear();
+		for (j = 0; j < file.getTrackCount(); j++)
+		{
+			for (k = 0; k < file[j].size(); k++)
+			{
+				MidiEvent& event = file[j][k];
+				message.track = j;
+				message.tick = event.tick;
+				message.bytes.assign(event.begin(), event.end());
+				if (event.isEndOfTrack())
+				{
+					message.bytes.clear();
+				}
+				else if (event.isNoteOn() || event.isNoteOff())
+				{
+					message.bytes[0] = (uchar)(event.getChannelNibble() |
+						(event.isNoteOn() ? 0x90 : 0x80));
+				}
+				expected.push_back(message);
+			}
+		}
+		CHECK(visitor.messages == expected);
+	}
+}
+
+int main(int _argc, char** _argv)
+{
+	if (_argc != 2)
+	{
+		cerr << "Usage: midifile_test <sample directory>\n";
+		return 1;
+	}
+	sample_dir = _argv[1];
+	test_round_trip();
+	test_read_overloads();
+	test_truncated();
+	test_copy();
+	test_thread_counts();
+	test_parse();
+	return test_result("midifile_test");
+}
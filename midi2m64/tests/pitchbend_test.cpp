@@ -0,0 +1,245 @@
+// Checks that Sequence::refactor_notes_to_pitch_bend builds the same
+// notes and bend events as the loop it replaced, which inserted split
+// notes and bend events into the track and source while walking them,
+// on generated tracks and bend streams with wide fine pitch ranges.
+
+// main.cpp is compiled into the test so that its classes can be used
+// directly; its entry point is renamed out of the way.
+#define main midi2m64_main
+#include "../main.cpp"
+#undef main
+
+#include "test_check.h"
+#include <random>
+
+#define TEST_RUN_N 20000
+
+// the insert-based refactor, as it was written, with the sequence's
+// length and fine pitch range passed in
+void reference_refactor(Track& _track, ControllerSource& _source,
+	int total_ticks, float source_fine_pitch_range)
+{
+	int i;
+	int j;
+	int k;
+	int start_j;
+	int ticks;
+	int next_note_ticks;
+	float semitone_shift;
+	float semitone_offset;
+	float value_adjust;
+	bool has_events_flag;
+	j = 0;
+	for (i = 0; i < _track.notes.size(); i++)
+	{
+		k = 1;
+		if (_track.notes[i].type == NoteType::Note)
+		{
+			ticks = _track.notes[i].ticks;
+			if (i == (_track.notes.size() - 1))
+			{
+				next_note_ticks = total_ticks;
+			}
+			else
+			{
+				next_note_ticks = _track.notes[i + 1].ticks;
+			}
+			if (_source.events[j].ticks < ticks)
+			{
+				has_events_flag = false;
+				for (; j < _source.events.size(); j++)
+				{
+					if (_source.events[j].ticks > ticks)
+					{
+						j--;
+						has_events_flag = true;
+						break;
+					}
+				}
+				if (!has_events_flag) j--;
+				has_events_flag = true;
+			}
+			else
+			{
+				if (_source.events[j].ticks < next_note_ticks)
+				{
+					has_events_flag = true;
+				}
+				else
+				{
+					has_events_flag = false;
+				}
+			}
+
+			if (has_events_flag)
+			{
+				do
+				{
+					semitone_shift = (_source.events[j].value*2.0 - 1.0)*
+						source_fine_pitch_range;
+					if (fabs(semitone_shift) > 11.9)
+					{
+						semitone_offset =
+							floor((ceil(fabs(semitone_shift) - 1.0) /
+								12.0) + 0.5) * 12;
+						semitone_offset *= signbit(semitone_shift) ?
+							-1.0 : 1.0;
+						if (_source.events[j].ticks <= ticks)
+						{
+							_track.notes[i].note =
+								((int)_track.notes[i + k - 1].note) +
+									(int) semitone_offset;
+						}
+						else
+						{
+							_track.notes.insert(
+								_track.notes.begin() + i + k,
+								NoteEvent(
+									NoteType::Note,
+									_source.events[j].ticks,
+									_track.notes[i].velocity,
+									_track.notes[i + k - 1].note +
+										(int) semitone_offset));
+							k++;
+						}
+						if (_source.events[j].ticks < ticks)
+						{
+							_source.events.insert(
+								_source.events.begin() + j + 1,
+								ControllerEvent(
+									ticks,
+									_source.events[j].value));
+							j++;
+						}
+						start_j = j;
+						value_adjust = (semitone_offset /
+							source_fine_pitch_range)*0.5;
+						while (j < _source.events.size())
+						{
+							if (_source.events[j].ticks >= next_note_ticks)
+							{
+								break;
+							}
+							_source.events[j].value -= value_adjust;
+							j++;
+						}
+						j = start_j;
+					}
+					j++;
+					if (j >= _source.events.size()) break;
+					} while (_source.events[j].ticks < next_note_ticks);
+				j--;
+			}
+		}
+	}
+}
+
+bool same_notes(const vector<NoteEvent>& _a, const vector<NoteEvent>& _b)
+{
+	int i;
+	if (_a.size() != _b.size())
+	{
+		return false;
+	}
+	for (i = 0; i < _a.size(); i++)
+	{
+		if ((_a[i].type != _b[i].type) || (_a[i].ticks != _b[i].ticks) ||
+			(_a[i].note != _b[i].note) || (_a[i].velocity != _b[i].velocity))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool same_events(const vector<ControllerEvent>& _a,
+	const vector<ControllerEvent>& _b)
+{
+	int i;
+	if (_a.size() != _b.size())
+	{
+		return false;
+	}
+	for (i = 0; i < _a.size(); i++)
+	{
+		if ((_a[i].ticks != _b[i].ticks) || (_a[i].value != _b[i].value))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// notes and rests in tick order, some of them on the same tick
+void make_notes(mt19937& _rng, vector<NoteEvent>& _notes, int& _total_ticks)
+{
+	int n;
+	int tick;
+	int i;
+	n = 1 + _rng() % 60;
+	tick = _rng() % 20;
+	_notes.clear();
+	for (i = 0; i < n; i++)
+	{
+		_notes.push_back(NoteEvent(
+			(_rng() % 3 == 0) ? NoteType::Rest : NoteType::Note, tick,
+			(float)(_rng() % 128) / 127.0f, 30 + _rng() % 60));
+		tick += _rng() % 40;
+	}
+	_total_ticks = tick + _rng() % 40;
+}
+
+// a bend stream which often goes past an octave either way, with runs of
+// events between notes, under notes and past the end of the track
+void make_bend(mt19937& _rng, vector<ControllerEvent>& _events,
+	int _total_ticks)
+{
+	int n;
+	int tick;
+	int i;
+	n = 1 + _rng() % 200;
+	tick = _rng() % 30;
+	_events.clear();
+	for (i = 0; i < n; i++)
+	{
+		_events.push_back(ControllerEvent(tick,
+			(float)(_rng() % 16384) / 16383.0f));
+		tick += _rng() % (2 + 2 * _total_ticks / n);
+	}
+}
+
+// the refactor run once, and run again on its own output as it is when
+// several tracks share a bend source
+void test_refactor(mt19937& _rng)
+{
+	Sequence seq;
+	Track track;
+	Track expected_track;
+	ControllerSource source;
+	ControllerSource expected_source;
+	int run;
+	int pass;
+	for (run = 0; run < TEST_RUN_N; run++)
+	{
+		make_notes(_rng, track.notes, seq.total_ticks);
+		make_bend(_rng, source.events, seq.total_ticks);
+		seq.source_fine_pitch_range = (float)(1 + _rng() % 48);
+		expected_track.notes = track.notes;
+		expected_source.events = source.events;
+		for (pass = 0; pass < 1 + run % 2; pass++)
+		{
+			reference_refactor(expected_track, expected_source,
+				seq.total_ticks, seq.source_fine_pitch_range);
+			seq.refactor_notes_to_pitch_bend(track, source);
+			CHECK(same_notes(track.notes, expected_track.notes));
+			CHECK(same_events(source.events, expected_source.events));
+		}
+	}
+}
+
+int main()
+{
+	mt19937 rng(64);
+	test_refactor(rng);
+	return test_result("pitchbend_test");
+}
@@ -0,0 +1,856 @@
+// Compares MidiFile's track operations with the implementations they
+// replaced, which are kept here as the reference: each is run on the
+// sample files and on generated tracks with many events on the same
+// tick, and must give the same result.
+
+#include "MidiFile.h"
+#include "test_check.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const char* sample_names[] = {
+	"LastImpactElectro.mid",
+	"Legacy64.mid",
+	"pitchtest.mid",
+	"smrpgtest.mid"
+};
+#define SAMPLE_N 4
+#define GENERATED_N 200
+// events are told apart by their track times this plus their index
+#define TRACK_STRIDE 1000000
+
+string sample_dir;
+
+string sample_path(int _sample)
+{
+	return sample_dir + "/" + sample_names[_sample];
+}
+
+// a random message of each kind the sort tells apart
+vector<uchar> random_message(mt19937& _rng)
+{
+	int channel;
+	channel = _rng() % 16;
+	switch (_rng() % 8)
+	{
+	case 0:
+		return { (uchar)(0x90 | channel), (uchar)(_rng() % 128),
+			(uchar)(_rng() % 128) };
+	case 1:
+		return { (uchar)(0x90 | channel), (uchar)(_rng() % 128), 0 };
+	case 2:
+		return { (uchar)(0x80 | channel), (uchar)(_rng() % 128), 64 };
+	case 3:
+		return { (uchar)(0xb0 | channel), (uchar)(_rng() % 128),
+			(uchar)(_rng() % 128) };
+	case 4:
+		return { (uchar)(0xc0 | channel), (uchar)(_rng() % 128) };
+	case 5:
+		return { 0xff, 0x51, 0x03, (uchar)(_rng() % 16), 0x00, 0x00 };
+	case 6:
+		return { 0xff, 0x01, 0x02, 'a', (uchar)('a' + _rng() % 26) };
+	default:
+		return { 0xff, 0x2f, 0x00 };
+	}
+}
+
+// a file of _tracks tracks of random events in random order, with ticks
+// and seq numbers in a small range so that many of them tie; each
+// event's seconds field holds its track and index, to tell equal events
+// apart
+void make_random_file(mt19937& _rng, MidiFile& _file, int _tracks,
+	int _tick_max, int _seq_max)
+{
+	vector<uchar> message;
+	int n;
+	int i;
+	int j;
+	_file.clear();
+	_file.addTrack(_tracks - 1);
+	for (i = 0; i < _tracks; i++)
+	{
+		n = _rng() % 300;
+		for (j = 0; j < n; j++)
+		{
+			message = random_message(_rng);
+			_file.addEvent(i, _rng() % _tick_max, message);
+		}
+	}
+	for (i = 0; i < _tracks; i++)
+	{
+		for (j = 0; j < _file[i].size(); j++)
+		{
+			_file[i][j].seq = _rng() % _seq_max;
+			_file[i][j].seconds = i * TRACK_STRIDE + j;
+		}
+	}
+}
+
+// the event order of track _track, as the indices in the seconds fields
+vector<double> event_order(MidiFile& _file, int _track)
+{
+	vector<double> order;
+	int i;
+	for (i = 0; i < _file[_track].size(); i++)
+	{
+		order.push_back(_file[_track][i].seconds);
+	}
+	return order;
+}
+
+// the comparison sortTrack() used with qsort, as it was written
+int reference_compare(const MidiEvent& aevent, const MidiEvent& bevent)
+{
+	if (aevent.tick > bevent.tick) {
+		return +1;
+	} else if (aevent.tick < bevent.tick) {
+		return -1;
+	} else if (aevent.seq > bevent.seq) {
+		return +1;
+	} else if (aevent.seq < bevent.seq) {
+		return -1;
+	} else if (aevent[0] == 0xff && aevent[1] == 0x2f) {
+		return +1;
+	} else if (bevent[0] == 0xff && bevent[1] == 0x2f) {
+		return -1;
+	} else if (aevent[0] == 0xff && bevent[0] != 0xff) {
+		return -1;
+	} else if (aevent[0] != 0xff && bevent[0] == 0xff) {
+		return +1;
+	} else if (((aevent[0] & 0xf0) == 0x90) && (aevent[2] != 0)) {
+		return +1;
+	} else if (((bevent[0] & 0xf0) == 0x90) && (bevent[2] != 0)) {
+		return -1;
+	} else if (((aevent[0] & 0xf0) == 0x90) ||
+			((aevent[0] & 0xf0) == 0x80)) {
+		return +1;
+	} else if (((bevent[0] & 0xf0) == 0x90) ||
+			((bevent[0] & 0xf0) == 0x80)) {
+		return -1;
+	} else {
+		return 0;
+	}
+}
+
+// qsort left the order of events which compare equal unspecified; the
+// radix sort keeps them in their order, which is what a stable sort with
+// the same comparison gives
+vector<double> reference_sort(vector<MidiEvent*>& events)
+{
+	vector<double> order;
+	int i;
+	stable_sort(events.begin(), events.end(),
+		[](const MidiEvent* _a, const MidiEvent* _b)
+		{
+			return reference_compare(*_a, *_b) < 0;
+		});
+	for (i = 0; i < events.size(); i++)
+	{
+		order.push_back(events[i]->seconds);
+	}
+	return order;
+}
+
+vector<double> reference_sort(MidiFile& _file, int _track)
+{
+	vector<MidiEvent*> events;
+	int i;
+	for (i = 0; i < _file[_track].size(); i++)
+	{
+		events.push_back(&_file[_track][i]);
+	}
+	return reference_sort(events);
+}
+
+void check_sort(MidiFile& _file)
+{
+	vector<vector<double> > expected;
+	int i;
+	for (i = 0; i < _file.getTrackCount(); i++)
+	{
+		expected.push_back(reference_sort(_file, i));
+	}
+	_file.sortTracks();
+	for (i = 0; i < _file.getTrackCount(); i++)
+	{
+		CHECK(event_order(_file, i) == expected[i]);
+	}
+}
+
+// sortTracks() orders events as the qsort did, on files read from disk,
+// on random tracks, and on tracks whose ticks are too wide or negative to
+// pack into a key
+void test_sort(mt19937& _rng)
+{
+	MidiFile file;
+	int i;
+	int j;
+	int k;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		// reversed, so that the seq numbers of the read put them back
+		CHECK(file.read(sample_path(i)) != 0);
+		for (j = 0; j < file.getTrackCount(); j++)
+		{
+			reverse(file[j].data(), file[j].data() + file[j].size());
+			for (k = 0; k < file[j].size(); k++)
+			{
+				file[j][k].seconds = k;
+			}
+		}
+		check_sort(file);
+	}
+	for (i = 0; i < GENERATED_N; i++)
+	{
+		make_random_file(_rng, file, 1 + _rng() % 4, 1 + _rng() % 100,
+			1 + _rng() % 10);
+		check_sort(file);
+	}
+	make_random_file(_rng, file, 2, 50, 4);
+	file[0][0].tick = 1 << 30;
+	file[1][0].tick = -5;
+	check_sort(file);
+}
+
+// ids of the events of all tracks in the order joinTracks() used to give
+// them: the tracks one after the other, then sorted
+vector<double> reference_join(MidiFile& _file)
+{
+	vector<MidiEvent*> events;
+	int i;
+	int j;
+	for (i = 0; i < _file.getTrackCount(); i++)
+	{
+		for (j = 0; j < _file[i].size(); j++)
+		{
+			events.push_back(&_file[i][j]);
+		}
+	}
+	return reference_sort(events);
+}
+
+// joining gives the reference order, and splitting the joined track puts
+// each event back on its track in that order; splitting makes as many
+// tracks as it takes to reach the last one with events
+void check_join(MidiFile& _file, bool _delta)
+{
+	vector<double> expected;
+	vector<vector<double> > expected_split;
+	int tracks;
+	int i;
+	int j;
+	expected = reference_join(_file);
+	tracks = 1;
+	expected_split.resize(_file.getTrackCount());
+	for (i = 0; i < expected.size(); i++)
+	{
+		j = (int)expected[i] / TRACK_STRIDE;
+		expected_split[j].push_back(expected[i]);
+		tracks = max(tracks, j + 1);
+	}
+	for (i = 0; i < _file.getTrackCount(); i++)
+	{
+		for (j = 0; j < _file[i].size(); j++)
+		{
+			_file[i][j].track = i;
+		}
+	}
+	if (_delta)
+	{
+		_file.deltaTicks();
+	}
+	_file.joinTracks();
+	if (_delta)
+	{
+		_file.absoluteTicks();
+	}
+	CHECK(_file.getTrackCount() == 1);
+	CHECK(event_order(_file, 0) == expected);
+	_file.splitTracks();
+	CHECK(_file.getTrackCount() == tracks);
+	for (i = 0; (i < tracks) && (i < _file.getTrackCount()); i++)
+	{
+		CHECK(event_order(_file, i) == expected_split[i]);
+	}
+}
+
+// joinTracks() merges tracks in the order the sort of the concatenated
+// tracks gave, also when ticks are stored as deltas and when they cannot
+// be packed into a key
+void test_join(mt19937& _rng)
+{
+	MidiFile file;
+	int i;
+	int j;
+	int k;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		CHECK(file.read(sample_path(i)) != 0);
+		for (j = 0; j < file.getTrackCount(); j++)
+		{
+			for (k = 0; k < file[j].size(); k++)
+			{
+				file[j][k].seconds = j * TRACK_STRIDE + k;
+			}
+		}
+		check_join(file, i % 2 == 1);
+	}
+	for (i = 0; i < GENERATED_N; i++)
+	{
+		make_random_file(_rng, file, 1 + _rng() % 6, 1 + _rng() % 100,
+			1 + _rng() % 10);
+		file.sortTracks();
+		check_join(file, i % 2 == 1);
+	}
+	make_random_file(_rng, file, 3, 50, 4);
+	file.sortTracks();
+	file[1][0].tick = -5;
+	check_join(file, false);
+}
+
+// the switch controllers linkNotePairs() pairs, numbered as it did
+int reference_switch_index(int _controller)
+{
+	const int switches[18] = { 64, 65, 66, 67, 68, 69, 80, 81, 82, 83, 84,
+		85, 86, 87, 88, 89, 90, 122 };
+	int i;
+	for (i = 0; i < 18; i++)
+	{
+		if (switches[i] == _controller)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// links the events of _list as MidiEventList::linkNotePairs() did, with
+// a stack of open note-ons per channel and key, and the last on-state of
+// each switch controller per channel; returns the number of notes linked
+int reference_link(MidiEventList& _list)
+{
+	vector<MidiEvent*> noteons[16][128];
+	MidiEvent* contevents[18][16];
+	int oldstates[18][16];
+	MidiEvent* mev;
+	MidiEvent* noteon;
+	int channel;
+	int key;
+	int conti;
+	int contstate;
+	int counter;
+	int i;
+	int j;
+	for (i = 0; i < 18; i++)
+	{
+		for (j = 0; j < 16; j++)
+		{
+			contevents[i][j] = NULL;
+			oldstates[i][j] = -1;
+		}
+	}
+	counter = 0;
+	for (i = 0; i < _list.size(); i++)
+	{
+		mev = &_list[i];
+		mev->unlinkEvent();
+		if (mev->isNoteOn())
+		{
+			noteons[mev->getChannel()][mev->getKeyNumber()].push_back(mev);
+		}
+		else if (mev->isNoteOff())
+		{
+			key = mev->getKeyNumber();
+			channel = mev->getChannel();
+			if (noteons[channel][key].size() > 0)
+			{
+				noteon = noteons[channel][key].back();
+				noteons[channel][key].pop_back();
+				noteon->linkEvent(mev);
+				counter++;
+			}
+		}
+		else if (mev->isController() &&
+			(reference_switch_index(mev->getP1()) >= 0))
+		{
+			conti = reference_switch_index(mev->getP1());
+			channel = mev->getChannel();
+			contstate = mev->getP2() < 64 ? 0 : 1;
+			if ((oldstates[conti][channel] == -1) && contstate)
+			{
+				contevents[conti][channel] = mev;
+				oldstates[conti][channel] = contstate;
+			}
+			else if (oldstates[conti][channel] == contstate)
+			{
+			}
+			else if ((oldstates[conti][channel] == 0) && contstate)
+			{
+				contevents[conti][channel] = mev;
+				oldstates[conti][channel] = contstate;
+			}
+			else if ((oldstates[conti][channel] == 1) && (contstate == 0))
+			{
+				contevents[conti][channel]->linkEvent(mev);
+				oldstates[conti][channel] = contstate;
+				contevents[conti][channel] = mev;
+			}
+		}
+	}
+	return counter;
+}
+
+// the index in its track of the event each event is linked to, or -1 if
+// it is not linked to an event of the track
+vector<int> link_targets(MidiEventList& _list)
+{
+	map<const MidiEvent*, int> index;
+	vector<int> targets;
+	int i;
+	for (i = 0; i < _list.size(); i++)
+	{
+		index[&_list[i]] = i;
+	}
+	for (i = 0; i < _list.size(); i++)
+	{
+		auto target = index.find(_list[i].getLinkedEvent());
+		targets.push_back((target == index.end()) ? -1 : target->second);
+	}
+	return targets;
+}
+
+// a random note or switch controller, on few keys and channels so that
+// notes overlap and pedals repeat their state
+vector<uchar> random_link_message(mt19937& _rng)
+{
+	int channel;
+	channel = _rng() % 2;
+	switch (_rng() % 5)
+	{
+	case 0:
+	case 1:
+		return { (uchar)(0x90 | channel), (uchar)(60 + _rng() % 3),
+			(uchar)(_rng() % 4 == 0 ? 0 : 100) };
+	case 2:
+		return { (uchar)(0x80 | channel), (uchar)(60 + _rng() % 3), 0 };
+	case 3:
+		return { (uchar)(0xb0 | channel),
+			(uchar)(_rng() % 2 == 0 ? 64 : 122), (uchar)(_rng() % 128) };
+	default:
+		return { (uchar)(0xb0 | channel), 7, (uchar)(_rng() % 128) };
+	}
+}
+
+// links the tracks of _file with _threads threads and compares them with
+// the reference links of a copy of each track
+void check_links(MidiFile& _file, int _threads)
+{
+	vector<vector<int> > expected;
+	int expected_count;
+	int i;
+	expected_count = 0;
+	for (i = 0; i < _file.getTrackCount(); i++)
+	{
+		MidiEventList copy(_file[i]);
+		expected_count += reference_link(copy);
+		expected.push_back(link_targets(copy));
+	}
+	_file.setThreadCount(_threads);
+	CHECK(_file.linkNotePairs() == expected_count);
+	for (i = 0; i < _file.getTrackCount(); i++)
+	{
+		CHECK(link_targets(_file[i]) == expected[i]);
+	}
+}
+
+// linkNotePairs() pairs notes and pedals as it did, with one thread and
+// with several, and also after links were made across the joined tracks
+void test_link(mt19937& _rng)
+{
+	MidiFile file;
+	vector<uchar> message;
+	int tracks;
+	int n;
+	int i;
+	int j;
+	int k;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		CHECK(file.read(sample_path(i)) != 0);
+		check_links(file, 1 + i % 4);
+	}
+	for (i = 0; i < GENERATED_N; i++)
+	{
+		file.clear();
+		tracks = 1 + _rng() % 6;
+		file.addTrack(tracks - 1);
+		for (j = 0; j < tracks; j++)
+		{
+			n = _rng() % 200;
+			for (k = 0; k < n; k++)
+			{
+				message = random_link_message(_rng);
+				file.addEvent(j, k, message);
+			}
+		}
+		file.joinTracks();
+		file.linkNotePairs();
+		file.splitTracks();
+		check_links(file, 1 + i % 4);
+	}
+}
+
+// an event with the place it had in its track before the tracks were
+// joined
+class PlacedEvent
+{
+public:
+	MidiEvent* event;
+	int track;
+	int index;
+};
+
+// the seconds buildTimeMap() gave each event, as it was written: the
+// tracks joined, then walked in order with the tempo in effect after each
+// tempo event; _ticks and _seconds get each tick it mapped and its time
+vector<vector<double> > reference_seconds(MidiFile& _file,
+	vector<int>& _ticks, vector<double>& _seconds)
+{
+	vector<vector<double> > seconds;
+	vector<PlacedEvent> events;
+	PlacedEvent placed;
+	double seconds_per_tick;
+	double current;
+	int last_tick;
+	int i;
+	int j;
+	seconds.resize(_file.getTrackCount());
+	for (i = 0; i < _file.getTrackCount(); i++)
+	{
+		seconds[i].resize(_file[i].size());
+		for (j = 0; j < _file[i].size(); j++)
+		{
+			placed.event = &_file[i][j];
+			placed.track = i;
+			placed.index = j;
+			events.push_back(placed);
+		}
+	}
+	stable_sort(events.begin(), events.end(),
+		[](const PlacedEvent& _a, const PlacedEvent& _b)
+		{
+			return reference_compare(*_a.event, *_b.event) < 0;
+		});
+	_ticks.clear();
+	_seconds.clear();
+	seconds_per_tick = 60.0 / (120.0 * _file.getTicksPerQuarterNote());
+	current = 0.0;
+	last_tick = 0;
+	for (i = 0; i < events.size(); i++)
+	{
+		MidiEvent& event = *events[i].event;
+		if ((event.tick > last_tick) || (i == 0))
+		{
+			current += (event.tick - last_tick) * seconds_per_tick;
+			_ticks.push_back(event.tick);
+			_seconds.push_back(current);
+			last_tick = event.tick;
+		}
+		seconds[events[i].track][events[i].index] = current;
+		if (event.isTempo())
+		{
+			seconds_per_tick = event.getTempoSPT(
+				_file.getTicksPerQuarterNote());
+		}
+	}
+	return seconds;
+}
+
+bool same_time(double _a, double _b)
+{
+	return fabs(_a - _b) <= 1e-9 * max(1.0, fabs(_b));
+}
+
+bool has_seconds(MidiFile& _file, const vector<vector<double> >& _seconds)
+{
+	int i;
+	int j;
+	for (i = 0; i < _file.getTrackCount(); i++)
+	{
+		for (j = 0; j < _file[i].size(); j++)
+		{
+			if (!same_time(_file[i][j].seconds, _seconds[i][j]))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// the times of the ticks the old map held, and of ticks between them,
+// which it interpolated; past the last tick there is no time
+void check_time_map(MidiFile& _file)
+{
+	vector<vector<double> > expected;
+	vector<int> ticks;
+	vector<double> seconds;
+	double step;
+	int tick;
+	int i;
+	expected = reference_seconds(_file, ticks, seconds);
+	if (ticks.empty())
+	{
+		return;
+	}
+	// the map is built by the first lookup, which fills in the seconds
+	CHECK(same_time(_file.getTimeInSeconds(ticks[0]), seconds[0]));
+	CHECK(has_seconds(_file, expected));
+	for (i = 0; i < ticks.size(); i++)
+	{
+		CHECK(same_time(_file.getTimeInSeconds(ticks[i]), seconds[i]));
+		if (i + 1 < ticks.size())
+		{
+			tick = (ticks[i] + ticks[i + 1]) / 2;
+			step = (seconds[i + 1] - seconds[i]) /
+				(ticks[i + 1] - ticks[i]);
+			CHECK(same_time(_file.getTimeInSeconds(tick),
+				seconds[i] + (tick - ticks[i]) * step));
+		}
+	}
+	CHECK(_file.getTimeInSeconds(ticks.back() + 1) == -1.0);
+	CHECK(same_time(_file.getTotalTimeInSeconds(), seconds.back()));
+	for (i = 0; i < _file.getTrackCount(); i++)
+	{
+		if (_file[i].size() > 0)
+		{
+			_file[i][0].seconds = -1.0;
+		}
+	}
+	_file.doTimeAnalysis();
+	CHECK(has_seconds(_file, expected));
+}
+
+// the time map built from tempo segments gives the times the walk over
+// the joined tracks gave, on the samples and on random files with tempo
+// changes on every track, several at the same tick, and tracks out of
+// time order
+void test_time_map(mt19937& _rng)
+{
+	MidiFile file;
+	int i;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		CHECK(file.read(sample_path(i)) != 0);
+		check_time_map(file);
+	}
+	for (i = 0; i < GENERATED_N; i++)
+	{
+		make_random_file(_rng, file, 1 + _rng() % 6, 1 + _rng() % 5000,
+			1 + _rng() % 10);
+		file.setTicksPerQuarterNote(24 + _rng() % 480);
+		if (i % 2 == 0)
+		{
+			file.sortTracks();
+		}
+		check_time_map(file);
+	}
+}
+
+// a variable length value as writeVLValue() stored it
+void reference_vlv(long _value, vector<uchar>& _bytes)
+{
+	uchar groups[5];
+	int start;
+	int i;
+	for (i = 0; i < 5; i++)
+	{
+		groups[i] = (uchar)(((ulong)_value >> (28 - 7 * i)) & 0x7f);
+	}
+	start = 0;
+	while ((start < 5) && (groups[start] == 0))
+	{
+		start++;
+	}
+	for (i = start; i < 4; i++)
+	{
+		_bytes.push_back(groups[i] | 0x80);
+	}
+	_bytes.push_back(groups[4]);
+}
+
+void reference_long(unsigned int _value, int _bytes, string& _out)
+{
+	int i;
+	for (i = _bytes - 1; i >= 0; i--)
+	{
+		_out += (char)((_value >> (8 * i)) & 0xff);
+	}
+}
+
+// the bytes write() gave, as it was written: a copy of the file in delta
+// ticks, each track without its end-of-track messages and with one at the
+// end unless the data already ends like one
+string reference_write(MidiFile& _file)
+{
+	MidiFile file(_file);
+	vector<uchar> data;
+	string out;
+	int size;
+	int i;
+	int j;
+	if (file.getTickState() == TIME_STATE_ABSOLUTE)
+	{
+		file.deltaTicks();
+	}
+	out = "MThd";
+	reference_long(6, 4, out);
+	reference_long((file.getNumTracks() == 1) ? 0 : 1, 2, out);
+	reference_long(file.getNumTracks(), 2, out);
+	reference_long(file.getTicksPerQuarterNote(), 2, out);
+	for (i = 0; i < file.getNumTracks(); i++)
+	{
+		data.clear();
+		for (j = 0; j < file[i].size(); j++)
+		{
+			MidiEvent& event = file[i][j];
+			if (event.isEndOfTrack())
+			{
+				continue;
+			}
+			reference_vlv(event.tick, data);
+			if ((event[0] == 0xf0) || (event[0] == 0xf7))
+			{
+				data.push_back(event[0]);
+				reference_vlv(event.size() - 1, data);
+				data.insert(data.end(), event.begin() + 1, event.end());
+			}
+			else
+			{
+				data.insert(data.end(), event.begin(), event.end());
+			}
+		}
+		size = (int)data.size();
+		if ((size < 3) || (data[size - 3] != 0xff) ||
+			(data[size - 2] != 0x2f))
+		{
+			data.insert(data.end(), { 0x00, 0xff, 0x2f, 0x00 });
+		}
+		out += "MTrk";
+		reference_long((unsigned int)data.size(), 4, out);
+		out.append(data.begin(), data.end());
+	}
+	return out;
+}
+
+// a sysex message, complete or raw, long enough to need a two byte length
+vector<uchar> random_sysex(mt19937& _rng)
+{
+	vector<uchar> message;
+	int n;
+	int i;
+	n = _rng() % 300;
+	message.push_back((_rng() % 2 == 0) ? 0xf0 : 0xf7);
+	for (i = 0; i < n; i++)
+	{
+		message.push_back((uchar)(_rng() % 128));
+	}
+	message.push_back(0xf7);
+	return message;
+}
+
+vector<int> file_ticks(MidiFile& _file)
+{
+	vector<int> ticks;
+	int i;
+	int j;
+	for (i = 0; i < _file.getTrackCount(); i++)
+	{
+		for (j = 0; j < _file[i].size(); j++)
+		{
+			ticks.push_back(_file[i][j].tick);
+		}
+	}
+	return ticks;
+}
+
+// write() gives the bytes of the old writer and leaves the file as it was
+void check_write(MidiFile& _file)
+{
+	stringstream output;
+	string expected;
+	vector<int> ticks;
+	int state;
+	expected = reference_write(_file);
+	ticks = file_ticks(_file);
+	state = _file.getTickState();
+	CHECK(_file.write(output) != 0);
+	CHECK(output.str() == expected);
+	CHECK(_file.getTickState() == state);
+	CHECK(file_ticks(_file) == ticks);
+}
+
+// the samples in both tick states, and random files with sysex messages,
+// end-of-track messages in the middle of tracks, ticks out of order and
+// empty tracks
+void test_write(mt19937& _rng)
+{
+	MidiFile file;
+	vector<uchar> sysex;
+	int i;
+	int j;
+	int k;
+	for (i = 0; i < SAMPLE_N; i++)
+	{
+		CHECK(file.read(sample_path(i)) != 0);
+		check_write(file);
+		file.deltaTicks();
+		check_write(file);
+	}
+	for (i = 0; i < GENERATED_N; i++)
+	{
+		make_random_file(_rng, file, 1 + _rng() % 6, 1 + _rng() % 20000,
+			1 + _rng() % 10);
+		for (j = 0; j < file.getTrackCount(); j++)
+		{
+			for (k = _rng() % 4; k > 0; k--)
+			{
+				sysex = random_sysex(_rng);
+				file.addEvent(j, _rng() % 20000, sysex);
+			}
+		}
+		if (i % 3 != 0)
+		{
+			file.sortTracks();
+		}
+		if (i % 2 == 0)
+		{
+			file.deltaTicks();
+		}
+		check_write(file);
+	}
+}
+
+int main(int _argc, char** _argv)
+{
+	mt19937 rng(64);
+	if (_argc != 2)
+	{
+		cerr << "Usage: reference_test <sample directory>\n";
+		return 1;
+	}
+	sample_dir = _argv[1];
+	test_sort(rng);
+	test_join(rng);
+	test_link(rng);
+	test_time_map(rng);
+	test_write(rng);
+	return test_result("reference_test");
+}
@@ -0,0 +1,260 @@
+// Checks Sequence::simplify_sources: each source is simplified with the
+// tolerance of its own type, in steps of the quantized values written to
+// the m64 rather than of the raw source values, and a stream which stays
+// within the tolerance of its first value keeps that value alone.
+
+// main.cpp is compiled into the test so that its classes can be used
+// directly; its entry point is renamed out of the way.
+#define main midi2m64_main
+#include "../main.cpp"
+#undef main
+
+#include "test_check.h"
+#include <random>
+#include <sstream>
+
+#define TEST_RUN_N 500
+
+// the source types which can drive a channel parameter
+const ControllerSourceType channel_types[] = {
+	ControllerSourceType::FinePitch,
+	ControllerSourceType::Volume,
+	ControllerSourceType::Pan,
+	ControllerSourceType::Unknown,
+	ControllerSourceType::UserFixed
+};
+#define CHANNEL_TYPE_N 5
+
+// a source of _n events of any value, at least a tick apart
+ControllerSource make_source(mt19937& _rng, ControllerSourceType _type,
+	int _n)
+{
+	ControllerSource source;
+	int tick;
+	int i;
+	source.type = _type;
+	tick = 0;
+	for (i = 0; i < _n; i++)
+	{
+		source.events.push_back(ControllerEvent(tick,
+			(float)(_rng() % 1000) / 999.0f));
+		tick += 1 + _rng() % 20;
+	}
+	return source;
+}
+
+// whether _events are what simplify() leaves of _from: the first event,
+// then each event further than _tolerance from the last one kept
+bool simplified(const vector<QuantizedEvent>& _from,
+	const vector<QuantizedEvent>& _events, float _tolerance)
+{
+	vector<QuantizedEvent> expected;
+	int i;
+	for (i = 0; i < _from.size(); i++)
+	{
+		if ((i == 0) || (_tolerance <= 0) ||
+			(abs(_from[i].value - expected.back().value) > _tolerance))
+		{
+			expected.push_back(_from[i]);
+		}
+	}
+	if (expected.size() != _events.size())
+	{
+		return false;
+	}
+	for (i = 0; i < expected.size(); i++)
+	{
+		if ((expected[i].ticks != _events[i].ticks) ||
+			(expected[i].value != _events[i].value))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// one track for each channel source type and a tempo source; only the
+// streams of the type given a tolerance are simplified, and the report of
+// each track goes to stderr
+void test_tolerance_by_type(mt19937& _rng)
+{
+	Sequence seq;
+	Sequence::ChannelParam params[CHANNEL_PARAM_N];
+	vector<vector<QuantizedEvent> > before;
+	vector<QuantizedEvent> tempo_before;
+	stringstream report;
+	streambuf* errors;
+	ControllerSourceType type;
+	float tolerance;
+	int param;
+	int run;
+	int i;
+	seq.get_channel_params(params);
+	for (run = 0; run < TEST_RUN_N; run++)
+	{
+		seq.sources.clear();
+		seq.tracks.clear();
+		for (i = 0; i < CHANNEL_TYPE_N; i++)
+		{
+			seq.sources.push_back(make_source(_rng, channel_types[i],
+				1 + _rng() % 100));
+			seq.tracks.push_back(Track());
+			seq.tracks.back().name = "T" + to_string(i);
+			param = _rng() % CHANNEL_PARAM_N;
+			seq.tracks.back().*(params[param].source) = i;
+		}
+		seq.sources.push_back(make_source(_rng, ControllerSourceType::Tempo,
+			1 + _rng() % 100));
+		seq.tempo_source = seq.sources.size() - 1;
+		seq.quantize_sources();
+		before.clear();
+		for (i = 0; i < seq.tracks.size(); i++)
+		{
+			for (param = 0; seq.tracks[i].param_events[param].empty();
+				param++);
+			before.push_back(seq.tracks[i].param_events[param]);
+		}
+		tempo_before = seq.tempo_events;
+
+		type = (ControllerSourceType)(run % CONTROLLER_SOURCE_TYPE_N);
+		tolerance = 1 + _rng() % 40;
+		for (i = 0; i < CONTROLLER_SOURCE_TYPE_N; i++)
+		{
+			seq.simplify_tolerance[i] = ((int)type == i) ? tolerance : 0;
+		}
+		errors = cerr.rdbuf(report.rdbuf());
+		seq.simplify_sources();
+		cerr.rdbuf(errors);
+		for (i = 0; i < seq.tracks.size(); i++)
+		{
+			for (param = 0; seq.tracks[i].param_events[param].empty();
+				param++);
+			CHECK(simplified(before[i], seq.tracks[i].param_events[param],
+				(channel_types[i] == type) ? tolerance : 0));
+			CHECK(report.str().find("(T" + to_string(i) + "): " +
+				to_string(before[i].size()) + " -> " +
+				to_string(seq.tracks[i].param_events[param].size())) !=
+				string::npos);
+		}
+		CHECK(simplified(tempo_before, seq.tempo_events,
+			(type == ControllerSourceType::Tempo) ? tolerance : 0));
+		report.str("");
+	}
+}
+
+// raw steps of 0.02 are 2 steps of pan after its scaling by 126, so a
+// tolerance of 1.5 keeps them all and one of 2 drops all but the first
+void test_tolerance_after_scaling()
+{
+	Sequence seq;
+	ControllerSource source;
+	stringstream report;
+	streambuf* errors;
+	int i;
+	source.type = ControllerSourceType::Pan;
+	for (i = 0; i < 10; i++)
+	{
+		source.events.push_back(ControllerEvent(i * 10,
+			(i % 2 == 0) ? 0.0f : 0.02f));
+	}
+	seq.sources.push_back(source);
+	seq.tracks.push_back(Track());
+	seq.tracks[0].pan_source = 0;
+	errors = cerr.rdbuf(report.rdbuf());
+	seq.quantize_sources();
+	CHECK(seq.tracks[0].param_events[2].size() == 10);
+	CHECK(seq.tracks[0].param_events[2][0].value == 1);
+	CHECK(seq.tracks[0].param_events[2][1].value == 3);
+	seq.simplify_tolerance[(int)ControllerSourceType::Pan] = 1.5;
+	seq.simplify_sources();
+	CHECK(seq.tracks[0].param_events[2].size() == 10);
+	seq.simplify_tolerance[(int)ControllerSourceType::Pan] = 2;
+	seq.simplify_sources();
+	CHECK(seq.tracks[0].param_events[2].size() == 1);
+	cerr.rdbuf(errors);
+}
+
+// a stream which wanders no further than the tolerance from its first
+// value, and a constant one, each keep their first event alone
+void test_near_constant(mt19937& _rng)
+{
+	Sequence seq;
+	ControllerSource source;
+	stringstream report;
+	streambuf* errors;
+	int run;
+	int n;
+	int i;
+	errors = cerr.rdbuf(report.rdbuf());
+	for (run = 0; run < TEST_RUN_N; run++)
+	{
+		source.clear();
+		source.type = ControllerSourceType::Volume;
+		n = 2 + _rng() % 200;
+		for (i = 0; i < n; i++)
+		{
+			// volume is scaled by 128, so k / 128 is k steps
+			source.events.push_back(ControllerEvent(i * 5, 0.5f +
+				(((run % 2 == 0) || (i == 0)) ? 0.0f :
+					(float)(_rng() % 7) / 128.0f)));
+		}
+		seq.sources.assign(1, source);
+		seq.tracks.assign(1, Track());
+		seq.tracks[0].volume_source = 0;
+		seq.quantize_sources();
+		seq.simplify_tolerance[(int)ControllerSourceType::Volume] = 6;
+		seq.simplify_sources();
+		CHECK(seq.tracks[0].param_events[4].size() == 1);
+		if (seq.tracks[0].param_events[4].size() == 1)
+		{
+			CHECK(seq.tracks[0].param_events[4][0].ticks == 0);
+			CHECK(seq.tracks[0].param_events[4][0].value == 64);
+		}
+	}
+	cerr.rdbuf(errors);
+}
+
+// a new Sequence simplifies every channel type by one step and leaves
+// the tempo alone, so a stream wavering by a step keeps its first value
+// and the report is written
+void test_defaults()
+{
+	Sequence seq;
+	ControllerSource source;
+	stringstream report;
+	streambuf* errors;
+	int i;
+	for (i = 0; i < CONTROLLER_SOURCE_TYPE_N; i++)
+	{
+		CHECK(seq.simplify_tolerance[i] ==
+			(((i == (int)ControllerSourceType::Tempo) ||
+				(i == (int)ControllerSourceType::UserFixed)) ? 0 : 1));
+	}
+	source.type = ControllerSourceType::Volume;
+	for (i = 0; i < 10; i++)
+	{
+		// volume is scaled by 128, so these are 64 and 65
+		source.events.push_back(ControllerEvent(i * 10,
+			(i % 2 == 0) ? 0.5f : 0.5f + 1.5f / 128.0f));
+	}
+	seq.sources.push_back(source);
+	seq.tracks.push_back(Track());
+	seq.tracks[0].name = "Strings";
+	seq.tracks[0].volume_source = 0;
+	seq.quantize_sources();
+	errors = cerr.rdbuf(report.rdbuf());
+	seq.simplify_sources();
+	cerr.rdbuf(errors);
+	CHECK(seq.tracks[0].param_events[4].size() == 1);
+	CHECK(report.str() == "Track 0 (Strings): 10 -> 1 controller events\n");
+}
+
+int main()
+{
+	mt19937 rng(17);
+	test_tolerance_by_type(rng);
+	test_tolerance_after_scaling();
+	test_near_constant(rng);
+	test_defaults();
+	return test_result("simplify_test");
+}
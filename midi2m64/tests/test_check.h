@@ -0,0 +1,35 @@
+// A minimal check macro shared by the test drivers: each failed check is
+// reported with its line and counted, and the driver returns nonzero if
+// any failed.
+
+#ifndef _TEST_CHECK_H_INCLUDED
+#define _TEST_CHECK_H_INCLUDED
+
+#include <iostream>
+
+static int test_failures = 0;
+
+#define CHECK(_X_) test_check((_X_), #_X_, __FILE__, __LINE__)
+inline void test_check(bool _ok, const char* _what, const char* _file,
+	int _line)
+{
+	if (!_ok)
+	{
+		std::cerr << _file << ":" << _line << ": failed: " << _what << "\n";
+		test_failures++;
+	}
+}
+
+// reports the result and gives the driver's exit code
+inline int test_result(const char* _name)
+{
+	if (test_failures > 0)
+	{
+		std::cerr << _name << ": " << test_failures << " checks failed\n";
+		return 1;
+	}
+	std::cout << _name << " passed\n";
+	return 0;
+}
+
+#endif /* _TEST_CHECK_H_INCLUDED */
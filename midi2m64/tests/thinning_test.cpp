@@ -0,0 +1,383 @@
+// Checks the segmented least-squares thinning of controller sources:
+// opt_avg_intervals and opt_tolerance_intervals against a search of every
+// split of short random series, and ControllerSource::thin on longer
+// streams, which must start where the source did and keep each run within
+// its tolerance.
+
+// main.cpp is compiled into the test so that its classes can be used
+// directly; its entry point is renamed out of the way.
+#define main midi2m64_main
+#include "../main.cpp"
+#undef main
+
+#include "test_check.h"
+#include <random>
+
+#define TEST_RUN_N 2000
+// the longest series whose splits are all searched
+#define SERIES_MAX 11
+// how far sums of errors may drift between the prefix sums and the
+// direct sums
+#define ERROR_SLACK 1e-6
+
+// squared error of replacing _data[_first.._last] by its average, summed
+// directly
+double run_error(const vector<float>& _data, size_t _first, size_t _last)
+{
+	double mean;
+	double e;
+	size_t i;
+	mean = 0.0;
+	for (i = _first; i <= _last; i++)
+	{
+		mean += _data[i];
+	}
+	mean /= _last - _first + 1;
+	e = 0.0;
+	for (i = _first; i <= _last; i++)
+	{
+		e += (_data[i] - mean) * (_data[i] - mean);
+	}
+	return e;
+}
+
+// the runs of a split given by the bits of _mask: bit i set starts a run
+// at i + 1
+void split_starts(size_t _n, unsigned int _mask, vector<size_t>& _starts)
+{
+	size_t i;
+	_starts.assign(1, 0);
+	for (i = 0; i + 1 < _n; i++)
+	{
+		if (_mask & (1u << i))
+		{
+			_starts.push_back(i + 1);
+		}
+	}
+}
+
+// the total error of a split, and the largest error of one of its runs
+double split_error(const vector<float>& _data, const vector<size_t>& _starts,
+	double& _worst)
+{
+	double total;
+	double e;
+	size_t end;
+	size_t i;
+	total = 0.0;
+	_worst = 0.0;
+	for (i = 0; i < _starts.size(); i++)
+	{
+		end = (i + 1 < _starts.size()) ? _starts[i + 1] : _data.size();
+		e = run_error(_data, _starts[i], end - 1);
+		total += e;
+		_worst = max(_worst, e);
+	}
+	return total;
+}
+
+// whether _starts is a split of _n values: it starts at 0 and rises
+bool valid_starts(const vector<size_t>& _starts, size_t _n)
+{
+	size_t i;
+	if (_starts.empty() || (_starts[0] != 0))
+	{
+		return false;
+	}
+	for (i = 1; i < _starts.size(); i++)
+	{
+		if ((_starts[i] <= _starts[i - 1]) || (_starts[i] >= _n))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// a series of controller values, with runs of equal values and small
+// steps as well as jumps
+void make_series(mt19937& _rng, vector<float>& _data, size_t _n)
+{
+	size_t i;
+	_data.clear();
+	for (i = 0; i < _n; i++)
+	{
+		if ((i > 0) && (_rng() % 3 == 0))
+		{
+			_data.push_back(_data.back());
+		}
+		else
+		{
+			_data.push_back((float)(_rng() % 128) / 127.0f);
+		}
+	}
+}
+
+// the split into at most k runs with the least error
+void test_avg_intervals(mt19937& _rng)
+{
+	vector<float> data;
+	vector<size_t> starts;
+	vector<size_t> found;
+	double best;
+	double error;
+	double worst;
+	unsigned int mask;
+	size_t n;
+	size_t k;
+	size_t found_n;
+	int run;
+	for (run = 0; run < TEST_RUN_N; run++)
+	{
+		n = 1 + _rng() % SERIES_MAX;
+		k = 1 + _rng() % (n + 2);
+		make_series(_rng, data, n);
+		best = DBL_MAX;
+		for (mask = 0; mask < (1u << (n - 1)); mask++)
+		{
+			split_starts(n, mask, starts);
+			if (starts.size() <= k)
+			{
+				best = min(best, split_error(data, starts, worst));
+			}
+		}
+		found.assign(n, 0);
+		found_n = opt_avg_intervals(data.data(), n, k, found.data());
+		found.resize(found_n);
+		CHECK(found_n == min(k, n));
+		CHECK(valid_starts(found, n));
+		if (valid_starts(found, n))
+		{
+			error = split_error(data, found, worst);
+			CHECK(fabs(error - best) <= ERROR_SLACK);
+		}
+	}
+	CHECK(opt_avg_intervals(data.data(), 0, 4, found.data()) == 0);
+}
+
+// the fewest runs within the tolerance, and of those the least error
+void test_tolerance_intervals(mt19937& _rng)
+{
+	vector<float> data;
+	vector<size_t> starts;
+	vector<size_t> found;
+	double tolerance;
+	double best;
+	double error;
+	double worst;
+	unsigned int mask;
+	size_t best_n;
+	size_t n;
+	size_t found_n;
+	size_t i;
+	size_t j;
+	int run;
+	for (run = 0; run < TEST_RUN_N; run++)
+	{
+		n = 1 + _rng() % SERIES_MAX;
+		make_series(_rng, data, n);
+		// a tolerance no run's error lies close to, so that rounding
+		// cannot decide whether a run fits
+		do
+		{
+			tolerance = (run % 4 == 0) ? 0.0 :
+				(double)(_rng() % 1000) / 1000.0;
+			for (i = 0; i < n; i++)
+			{
+				for (j = i; j < n; j++)
+				{
+					if ((tolerance > 0.0) &&
+						(fabs(run_error(data, i, j) - tolerance) <
+							ERROR_SLACK))
+					{
+						break;
+					}
+				}
+				if (j < n)
+				{
+					break;
+				}
+			}
+		} while (i < n);
+		best_n = SIZE_MAX;
+		best = DBL_MAX;
+		for (mask = 0; mask < (1u << (n - 1)); mask++)
+		{
+			split_starts(n, mask, starts);
+			error = split_error(data, starts, worst);
+			if (worst > tolerance + ((tolerance > 0.0) ? 0.0 : ERROR_SLACK))
+			{
+				continue;
+			}
+			if (starts.size() < best_n)
+			{
+				best_n = starts.size();
+				best = error;
+			}
+			else if (starts.size() == best_n)
+			{
+				best = min(best, error);
+			}
+		}
+		found.assign(n, 0);
+		found_n = opt_tolerance_intervals(data.data(), n, tolerance,
+			found.data());
+		found.resize(found_n);
+		CHECK(found_n == best_n);
+		CHECK(valid_starts(found, n));
+		if (valid_starts(found, n))
+		{
+			error = split_error(data, found, worst);
+			CHECK(worst <= tolerance + ERROR_SLACK);
+			CHECK(fabs(error - best) <= ERROR_SLACK);
+		}
+	}
+	CHECK(opt_tolerance_intervals(data.data(), 0, 0.5, found.data()) == 0);
+}
+
+// the value a source holds on _ticks, or -1 before its first event
+float held_value(const vector<ControllerEvent>& _events, int _ticks)
+{
+	float value;
+	size_t i;
+	value = -1.0f;
+	for (i = 0; (i < _events.size()) && (_events[i].ticks <= _ticks); i++)
+	{
+		value = _events[i].value;
+	}
+	return value;
+}
+
+// thinning a stream keeps its first tick, replaces each run by its
+// average from the run's first event on, and in Tolerance mode keeps each
+// run within the tolerance or in Count mode to at most the count
+void test_thin(mt19937& _rng)
+{
+	ControllerSource source;
+	vector<ControllerEvent> original;
+	vector<float> values;
+	double error;
+	double mean;
+	size_t first;
+	size_t i;
+	size_t j;
+	int tick;
+	int run;
+	for (run = 0; run < TEST_RUN_N / 4; run++)
+	{
+		source.clear();
+		make_series(_rng, values, 2 + _rng() % 200);
+		tick = _rng() % 100;
+		for (i = 0; i < values.size(); i++)
+		{
+			source.events.push_back(ControllerEvent(tick, values[i]));
+			tick += 1 + _rng() % 30;
+		}
+		original = source.events;
+		if (run % 2 == 0)
+		{
+			source.thinning = ThinningMode::Tolerance;
+			source.thinning_tolerance = (float)(_rng() % 100) / 200.0f;
+		}
+		else
+		{
+			source.thinning = ThinningMode::Count;
+			source.thinning_count = 1 + _rng() % 20;
+		}
+		source.thin();
+		CHECK(!source.events.empty());
+		if (source.events.empty())
+		{
+			continue;
+		}
+		CHECK(source.events[0].ticks == original[0].ticks);
+		if (source.thinning == ThinningMode::Count)
+		{
+			CHECK(source.events.size() <= source.thinning_count);
+		}
+		// every original event falls in the run which holds its tick
+		for (i = 0, j = 0; j < source.events.size(); j++)
+		{
+			for (first = i; (i < original.size()) &&
+				((j + 1 == source.events.size()) ||
+					(original[i].ticks < source.events[j + 1].ticks)); i++);
+			CHECK((first < i) && (original[first].ticks ==
+				source.events[j].ticks));
+			mean = 0.0;
+			for (tick = first; tick < i; mean += original[tick++].value);
+			mean /= max((int)(i - first), 1);
+			CHECK(fabs(mean - source.events[j].value) <= ERROR_SLACK);
+			error = 0.0;
+			for (tick = first; tick < i; tick++)
+			{
+				error += (original[tick].value - mean) *
+					(original[tick].value - mean);
+			}
+			if (source.thinning == ThinningMode::Tolerance)
+			{
+				CHECK(error <= source.thinning_tolerance + ERROR_SLACK);
+			}
+		}
+		CHECK(i == original.size());
+		CHECK(held_value(source.events, original.back().ticks) ==
+			source.events.back().value);
+	}
+}
+
+// Sequence::thin_sources thins a source left at ThinningMode::None with
+// the default tolerance of its type, which is 0 for the tempo and fixed
+// values, and leaves a source set up by hand as it is
+void test_thin_sources()
+{
+	Sequence seq;
+	ControllerSource source;
+	int i;
+	int j;
+	for (i = 0; i < CONTROLLER_SOURCE_TYPE_N; i++)
+	{
+		source.clear();
+		source.type = (ControllerSourceType)i;
+		// a ramp a hundredth of a volume step apart, then a jump
+		for (j = 0; j < 20; j++)
+		{
+			source.events.push_back(ControllerEvent(j * 4,
+				0.5f + j / 12800.0f));
+		}
+		source.events.push_back(ControllerEvent(80, 0.9f));
+		seq.sources.push_back(source);
+	}
+	source.type = ControllerSourceType::Volume;
+	source.thinning = ThinningMode::Count;
+	source.thinning_count = 3;
+	seq.sources.push_back(source);
+	seq.thin_sources();
+	for (i = 0; i < CONTROLLER_SOURCE_TYPE_N; i++)
+	{
+		if ((i == (int)ControllerSourceType::Tempo) ||
+			(i == (int)ControllerSourceType::UserFixed))
+		{
+			CHECK(seq.sources[i].thinning == ThinningMode::None);
+			CHECK(seq.sources[i].events.size() == 21);
+		}
+		else
+		{
+			CHECK(seq.sources[i].thinning == ThinningMode::Tolerance);
+			CHECK(seq.sources[i].thinning_tolerance ==
+				seq.thinning_tolerance[i]);
+			CHECK(seq.sources[i].thinning_tolerance > 0);
+			CHECK(seq.sources[i].events.size() == 2);
+		}
+	}
+	CHECK(seq.sources.back().thinning == ThinningMode::Count);
+	CHECK(seq.sources.back().events.size() == 3);
+}
+
+int main()
+{
+	mt19937 rng(16);
+	test_avg_intervals(rng);
+	test_tolerance_intervals(rng);
+	test_thin(rng);
+	test_thin_sources();
+	return test_result("thinning_test");
+}